@@ -0,0 +1,179 @@
+// Memory Arena Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+
+#include <vector>
+#include <cstdlib>
+#include <new>
+
+
+/// Size in bytes of the first block allocated by an arena
+#define ARENA_BLOCK_SIZE 1048576
+
+/// Maximum size in bytes kept by an arena between requests
+#define ARENA_MAX_SIZE 67108864
+
+/// Alignment in bytes of each allocation
+#define ARENA_ALIGNMENT 16
+
+
+
+/// Memory arena for the transient buffers of a single request
+/** Allocations are carved sequentially out of large blocks and are never
+    freed individually. Instead, the whole arena is reset once the response
+    has been sent. After a reset, any overflow blocks are merged into a
+    single block large enough for the largest amount in use during the
+    previous request, so that in the steady state, requests make no
+    general-purpose heap calls. Buffers needed only for part of a request
+    can be released early by rewinding to a mark. An arena is owned by a single worker and is not thread safe.
+ */
+class Arena {
+
+ private:
+
+  /// A block of memory
+  struct Block {
+    char* data;
+    size_t size;
+  };
+
+  /// Our blocks, of which only the last is being filled
+  std::vector<Block> blocks;
+
+  /// Number of bytes used in our last block
+  size_t used;
+
+  /// Total number of bytes currently used
+  size_t total;
+
+  /// Largest total since our last reset
+  size_t peak;
+
+
+  /// Add a new block of at least the given size
+  void _grow( size_t n ){
+    Block b;
+    b.size = n;
+    b.data = (char*) malloc( n );
+    if( !b.data ) throw std::bad_alloc();
+    blocks.push_back( b );
+    used = 0;
+  }
+
+
+  /// Free all our blocks
+  void _release(){
+    for( unsigned int i=0; i<blocks.size(); i++ ) free( blocks[i].data );
+    blocks.clear();
+    used = 0;
+  }
+
+
+ public:
+
+  /// Position within an arena to which it can be rewound
+  struct Mark {
+    size_t blocks;
+    size_t used;
+    size_t total;
+  };
+
+
+  /// Constructor
+  Arena(): used(0), total(0), peak(0) {};
+
+
+  /// Destructor
+  ~Arena(){ this->_release(); };
+
+
+  /// Allocate memory which remains valid until the next reset
+  /** @param n number of bytes
+      @return pointer to memory aligned to ARENA_ALIGNMENT bytes
+   */
+  void* allocate( size_t n ){
+    n = (n + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+    if( blocks.empty() || used + n > blocks.back().size ){
+      this->_grow( n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE );
+    }
+    void* p = blocks.back().data + used;
+    used += n;
+    total += n;
+    if( total > peak ) peak = total;
+    return p;
+  };
+
+
+  /// Return our current position
+  Mark mark(){
+    Mark m;
+    m.blocks = blocks.size();
+    m.used = used;
+    m.total = total;
+    return m;
+  };
+
+
+  /// Release every allocation made since a mark
+  /** Any blocks added since the mark are freed. These are merged into a
+      single block at our next reset, so are rarely needed in the steady state
+      @param m mark returned by mark()
+   */
+  void rewind( const Mark& m ){
+    while( blocks.size() > m.blocks && blocks.size() > 1 ){
+      free( blocks.back().data );
+      blocks.pop_back();
+    }
+    used = ( blocks.size() == m.blocks ) ? m.used : 0;
+    total = m.total;
+  };
+
+
+  /// Release all allocations at once
+  void reset(){
+    // Merge our blocks into one large enough for the last request, unless too large to keep
+    if( blocks.size() > 1 || peak > ARENA_MAX_SIZE || ( !blocks.empty() && peak > blocks[0].size ) ){
+      size_t size = peak;
+      this->_release();
+      if( size > ARENA_MAX_SIZE ) size = ARENA_BLOCK_SIZE;
+      this->_grow( size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE );
+    }
+    used = 0;
+    total = 0;
+    peak = 0;
+  };
+
+
+  /// Return the number of bytes held by this arena
+  size_t getSize(){
+    size_t size = 0;
+    for( unsigned int i=0; i<blocks.size(); i++ ) size += blocks[i].size;
+    return size;
+  };
+
+};
+
+
+#endif
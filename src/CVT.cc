@@ -23,6 +23,8 @@
 #include "Environment.h"
 #include <cmath>
 #include <algorithm>
+#include <vector>
+#include <cstring>
 
 //#define CHUNKED 1
 
@@ -30,143 +32,15 @@ using namespace std;
 
 
 
-void CVT::send( Session* session ){
-
-  if( session->loglevel >= 2 ) *(session->logfile) << "CVT handler reached" << endl;
+/// Apply any colour conversion and floating point processing, leaving 8 bit data
+static void processRegion( Session* session, RawTile& region ){
 
   Timer function_timer;
 
-
-  this->session = session;
-  checkImage();
-
-
-  // Time this command
-  if( session->loglevel >= 2 ) command_timer.start();
-
-
-  // Reload info in case we are dealing with a sequence
-  //(*session->image)->loadImageInfo( session->view->xangle, session->view->yangle );
-
-
-  // Calculate the number of tiles at the requested resolution
-  unsigned int im_width = (*session->image)->getImageWidth();
-  unsigned int im_height = (*session->image)->getImageHeight();
-  int num_res = (*session->image)->getNumResolutions();
-
-  // Setup our view with some basic info
-  session->view->setImageSize( im_width, im_height );
-  session->view->setMaxResolutions( num_res );
-
-  // Get the resolution, width and height for this view
-  int requested_res = session->view->getResolution();
-  im_width = (*session->image)->image_widths[num_res-requested_res-1];
-  im_height = (*session->image)->image_heights[num_res-requested_res-1];
-
-
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "CVT :: Using resolution " << requested_res << " with size " << im_width << "x" << im_height << endl;
-  }
-
-
-  // Data length
-  int len;
-
-  // Set up our final image sizes and if we have a region defined,
-  // calculate our viewport
-  unsigned int resampled_width, resampled_height;
-  unsigned int view_left, view_top, view_width, view_height;
-
-  if( session->view->viewPortSet() ){
-
-    // Set the absolute viewport size and extract the co-ordinates
-    view_left = session->view->getViewLeft();
-    view_top = session->view->getViewTop();
-    view_width = session->view->getViewWidth();
-    view_height = session->view->getViewHeight();
-    resampled_width = session->view->getRequestWidth();
-    resampled_height = session->view->getRequestHeight();
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Region: " << view_left << "," << view_top
-			  << "," << view_width << "," << view_height << endl;
-    }
-  }
-  else{
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: No view port set" << endl;
-    view_left = 0;
-    view_top = 0;
-    view_width = im_width;
-    view_height = im_height;
-    resampled_width = session->view->getRequestWidth();
-    resampled_height = session->view->getRequestHeight();
-  }
-
-
-  // If we have requested that the aspect ratio be maintained, make sure the final image fits *within* the requested size
-  if( session->view->maintain_aspect ){
-    if( ((float)resampled_height/(float)view_height) > ((float)resampled_width/(float)view_width) ){
-      resampled_height = (unsigned int) round((((float)resampled_width/(float)view_width) * view_height));
-    }
-    else if( ((float)resampled_width/(float)view_width) > ((float)resampled_height/(float)view_height) ){
-      resampled_width = (unsigned int) round((((float)resampled_height/(float)view_height) * view_width));
-    }
-  }
-
-
-  if( session->loglevel >= 3 ){
-    *(session->logfile) << "CVT :: Requested scaled region size is " << resampled_width << "x" << resampled_height
-			<< " at resolution " << requested_res
-			<< ". Nearest existing resolution has region with size " << view_width << "x" << view_height << endl;
-  }
-
-
-#ifndef DEBUG
-
-  // Define our separator depending on the OS
-#ifdef WIN32
-  const string separator = "\\";
-#else
-  const string separator = "/";
-#endif
-
-
-  // Get our image file name and strip of the directory path and any suffix
-  string filename = (*session->image)->getImagePath();
-  int pos = filename.rfind(separator)+1;
-  string basename = filename.substr( pos, filename.rfind(".")-pos );
-
-  char str[1024];
-  snprintf( str, 1024,
-	    "Server: iipsrv/%s\r\n"
-	    "X-Powered-By: IIPImage\r\n"
-	    "%s\r\n"
-	    "Last-Modified: %s\r\n"
-	    "Content-Type: image/jpeg\r\n"
-	    "Content-Disposition: inline;filename=\"%s.jpg\"\r\n"
-#ifdef CHUNKED
-	    "Transfer-Encoding: chunked\r\n"
-#endif
-	    "\r\n",
-	    VERSION, session->response->getCacheControl().c_str(), (*session->image)->getTimestamp().c_str(), basename.c_str() );
-
-  session->out->printf( (const char*) str );
-#endif
-
-
-  // Get our requested region from our TileManager
-  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
-  RawTile complete_image = tilemanager.getRegion( requested_res,
-						  session->view->xangle, session->view->yangle,
-						  session->view->getLayers(),
-						  view_left, view_top, view_width, view_height );
-
-
-
   // Convert CIELAB to sRGB
   if( (*session->image)->getColourSpace() == CIELAB ){
     if( session->loglevel >= 5 ) function_timer.start();
-    filter_LAB2sRGB( complete_image );
+    filter_LAB2sRGB( region );
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting from CIELAB->sRGB in "
 			  << function_timer.getTime() << " microseconds" << endl;
@@ -176,12 +50,12 @@ void CVT::send( Session* session ){
 
 
   // Only use our floating point pipeline if necessary
-  if( complete_image.bpc > 8 || session->view->floatProcessing() ){
+  if( region.bpc > 8 || session->view->floatProcessing() ){
 
     // Apply normalization and perform float conversion
     {
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_normalize( complete_image, (*session->image)->max, (*session->image)->min );
+      filter_normalize( region, (*session->image)->max, (*session->image)->min );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Converting to floating point and normalizing in "
 			    << function_timer.getTime() << " microseconds" << endl;
@@ -192,7 +66,7 @@ void CVT::send( Session* session ){
     // Apply hill shading if requested
     if( session->view->shaded ){
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_shade( complete_image, session->view->shade[0], session->view->shade[1] );
+      filter_shade( region, session->view->shade[0], session->view->shade[1] );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying hill-shading in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -202,7 +76,7 @@ void CVT::send( Session* session ){
     // Apply color twist if requested
     if( session->view->ctw.size() ){
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_twist( complete_image, session->view->ctw );
+      filter_twist( region, session->view->ctw );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying color twist in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -213,7 +87,7 @@ void CVT::send( Session* session ){
     if( session->view->getGamma() != 1.0 ){
       float gamma = session->view->getGamma();
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_gamma( complete_image, gamma );
+      filter_gamma( region, gamma );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying gamma of " << gamma << " in "
 			    << function_timer.getTime() << " microseconds" << endl;
@@ -224,7 +98,7 @@ void CVT::send( Session* session ){
     // Apply inversion if requested
     if( session->view->inverted ){
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_inv( complete_image );
+      filter_inv( region );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying inversion in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -234,7 +108,7 @@ void CVT::send( Session* session ){
     // Apply color mapping if requested
     if( session->view->cmapped ){
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_cmap( complete_image, session->view->cmap );
+      filter_cmap( region, session->view->cmap );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying color map in " << function_timer.getTime() << " microseconds" << endl;
       }
@@ -244,7 +118,7 @@ void CVT::send( Session* session ){
     // Apply any contrast adjustments and/or clip from 16bit or 32bit to 8bit
     {
       if( session->loglevel >= 5 ) function_timer.start();
-      filter_contrast( complete_image, session->view->getContrast() );
+      filter_contrast( region, session->view->getContrast() );
       if( session->loglevel >= 5 ){
 	*(session->logfile) << "CVT :: Applying contrast of " << session->view->getContrast()
 			    << " and converting to 8bit in " << function_timer.getTime() << " microseconds" << endl;
@@ -252,41 +126,22 @@ void CVT::send( Session* session ){
     }
   }
 
+}
 
 
-  // Resize our image as requested. Use the interpolation method requested in the server configuration.
-  //  - Use bilinear interpolation by default
-  if( (view_width!=resampled_width) || (view_height!=resampled_height) ){
-
-    string interpolation_type;
-    if( session->loglevel >= 5 ) function_timer.start();
-
-    unsigned int interpolation = Environment::getInterpolation();
-    switch( interpolation ){
-     case 0:
-      interpolation_type = "nearest neighbour";
-      filter_interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
-      break;
-     default:
-      interpolation_type = "bilinear";
-      filter_interpolate_bilinear( complete_image, resampled_width, resampled_height );
-      break;
-    }
 
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
-			  << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
+/// Reduce the number of bands, convert to greyscale and flip as requested, after any resizing
+static void processOutput( Session* session, RawTile& image ){
 
+  Timer function_timer;
 
   // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( (complete_image.channels==2) || (complete_image.channels>3 ) ){
+  if( (image.channels==2) || (image.channels>3 ) ){
 
-    int output_channels = (complete_image.channels==2)? 1 : 3;
+    int output_channels = (image.channels==2)? 1 : 3;
     if( session->loglevel >= 5 ) function_timer.start();
 
-    filter_flatten( complete_image, output_channels );
+    filter_flatten( image, output_channels );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Flattening to " << output_channels << " channel"
@@ -302,7 +157,7 @@ void CVT::send( Session* session ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    filter_greyscale( complete_image );
+    filter_greyscale( image );
 
     if( session->loglevel >= 5 ){
       *(session->logfile) << "CVT :: Converting to greyscale in "
@@ -317,148 +172,451 @@ void CVT::send( Session* session ){
 
     if( session->loglevel >= 5 ) function_timer.start();
 
-    filter_flip( complete_image, session->view->flip  );
+    filter_flip( image, session->view->flip  );
 
     if( session->loglevel >= 5 ){
       string direction = session->view->flip==1 ? "horizontally" : "vertically";
-      *(session->logfile) << "JTL :: Flipping image " << direction << " in "
+      *(session->logfile) << "CVT :: Flipping image " << direction << " in "
 			  << function_timer.getTime() << " microseconds" << endl;
     }
   }
 
+}
 
 
-  // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-
-    if( session->loglevel >= 5 ) function_timer.start();
-
-    float rotation = session->view->getRotation();
-    filter_rotate( complete_image, rotation );
-
-    // For 90 and 270 rotation swap width and height
-    resampled_width = complete_image.width;
-    resampled_height = complete_image.height;
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
-			  << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
-
-
-
-  // Initialise our JPEG compression object
-  session->jpeg->InitCompression( complete_image, resampled_height );
-
-  // Add XMP metadata if this exists
-  if( (*session->image)->getMetadata("xmp").size() > 0 ){
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Adding XMP metadata" << endl;
-    session->jpeg->addMetadata( (*session->image)->getMetadata("xmp") );
-  }
 
-  len = session->jpeg->getHeaderSize();
+/// Send a block of data to the client as a separate chunk and flush it out
+static void sendData( Session* session, const unsigned char* data, int len, const char* name ){
 
 #ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: JPEG Header Chunk : " << str;
+  char str[16];
+  snprintf( str, 16, "%X\r\n", len );
+  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
   session->out->printf( str );
 #endif
 
-  if( session->out->putStr( (const char*) session->jpeg->getHeader(), len ) != len ){
+  if( session->out->putStr( (const char*) data, len ) != len ){
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing jpeg header" << endl;
+      *(session->logfile) << "CVT :: Error writing " << name << ": " << len << endl;
     }
   }
 
 #ifdef CHUNKED
+  // Send closing chunk CRLF
   session->out->printf( "\r\n" );
 #endif
 
   // Flush our block of data
   if( session->out->flush() == -1 ) {
     if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
+      *(session->logfile) << "CVT :: Error flushing " << name << endl;
     }
   }
 
+}
+
 
-  // Send out the data per strip of fixed height.
-  // Allocate enough memory for this plus an extra 64k for instances where compressed
-  // data is greater than uncompressed
-  unsigned int strip_height = 128;
-  unsigned int channels = complete_image.channels;
-  unsigned char* output = new unsigned char[resampled_width*channels*strip_height+65636];
-  int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
 
-  for( int n=0; n<strips; n++ ){
+/// JPEG compress and send a strip of our output image
+/** The JPEG stream is started with the first strip, as only then do we know the final
+    number of channels. The output buffer for compressed strips is allocated at the same time
+    @param session our current session
+    @param strip strip of 8 bit data
+    @param width width of our output image
+    @param height height of our output image
+    @param strip_height maximum strip height
+    @param output buffer for compressed data, allocated on our first call
+ */
+static void sendStrip( Session* session, const RawTile& strip, unsigned int width, unsigned int height,
+		       unsigned int strip_height, unsigned char*& output ){
 
-    // Get the starting index for this strip of data
-    unsigned char* input = &((unsigned char*)complete_image.data)[n*strip_height*resampled_width*channels];
+  if( !output ){
 
-    // The last strip may have a different height
-    if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
+    // Initialise our JPEG compression object
+    RawTile image( 0, strip.resolution, strip.hSequence, strip.vSequence, width, height, strip.channels, strip.bpc );
+    session->jpeg->InitCompression( image, strip_height );
 
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: About to JPEG compress strip with height " << strip_height << endl;
+    // Add XMP metadata if this exists
+    if( (*session->image)->getMetadata("xmp").size() > 0 ){
+      if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Adding XMP metadata" << endl;
+      session->jpeg->addMetadata( (*session->image)->getMetadata("xmp") );
     }
 
-    // Compress the strip
-    len = session->jpeg->CompressStrip( input, output, strip_height );
+    sendData( session, session->jpeg->getHeader(), session->jpeg->getHeaderSize(), "jpeg header" );
+
+    // Allocate enough memory for a strip plus an extra 64k for instances where compressed
+    // data is greater than uncompressed
+    size_t output_size = width*strip.channels*strip_height+65636;
+    if( session->arena ) output = (unsigned char*) session->arena->allocate( output_size );
+    else output = new unsigned char[output_size];
+  }
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: About to JPEG compress strip with height " << strip.height << endl;
+  }
+
+  // Compress the strip
+  int len = session->jpeg->CompressStrip( (unsigned char*) strip.data, output, strip.height );
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
+  }
+
+  sendData( session, output, len, "jpeg strip data" );
+
+}
+
+
+
+void CVT::send( Session* session ){
+
+  if( session->loglevel >= 2 ) *(session->logfile) << "CVT handler reached" << endl;
+
+  Timer function_timer;
+
+
+  this->session = session;
+  checkImage();
+
+
+  // Time this command
+  if( session->loglevel >= 2 ) command_timer.start();
+
+
+  // Reload info in case we are dealing with a sequence
+  //(*session->image)->loadImageInfo( session->view->xangle, session->view->yangle );
+
+
+  // Calculate the number of tiles at the requested resolution
+  unsigned int im_width = (*session->image)->getImageWidth();
+  unsigned int im_height = (*session->image)->getImageHeight();
+  int num_res = (*session->image)->getNumResolutions();
+
+  // Setup our view with some basic info
+  session->view->setImageSize( im_width, im_height );
+  session->view->setMaxResolutions( num_res );
+
+  // Get the resolution, width and height for this view
+  int requested_res = session->view->getResolution();
+  im_width = (*session->image)->image_widths[num_res-requested_res-1];
+  im_height = (*session->image)->image_heights[num_res-requested_res-1];
+
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: Using resolution " << requested_res << " with size " << im_width << "x" << im_height << endl;
+  }
+
+
+  // Data length
+  int len;
+
+  // Set up our final image sizes and if we have a region defined,
+  // calculate our viewport
+  unsigned int resampled_width, resampled_height;
+  unsigned int view_left, view_top, view_width, view_height;
+
+  if( session->view->viewPortSet() ){
+
+    // Set the absolute viewport size and extract the co-ordinates
+    view_left = session->view->getViewLeft();
+    view_top = session->view->getViewTop();
+    view_width = session->view->getViewWidth();
+    view_height = session->view->getViewHeight();
+    resampled_width = session->view->getRequestWidth();
+    resampled_height = session->view->getRequestHeight();
 
     if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
+      *(session->logfile) << "CVT :: Region: " << view_left << "," << view_top
+			  << "," << view_width << "," << view_height << endl;
+    }
+  }
+  else{
+    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: No view port set" << endl;
+    view_left = 0;
+    view_top = 0;
+    view_width = im_width;
+    view_height = im_height;
+    resampled_width = session->view->getRequestWidth();
+    resampled_height = session->view->getRequestHeight();
+  }
+
+
+  // If we have requested that the aspect ratio be maintained, make sure the final image fits *within* the requested size
+  if( session->view->maintain_aspect ){
+    if( ((float)resampled_height/(float)view_height) > ((float)resampled_width/(float)view_width) ){
+      resampled_height = (unsigned int) round((((float)resampled_width/(float)view_width) * view_height));
     }
+    else if( ((float)resampled_width/(float)view_width) > ((float)resampled_height/(float)view_height) ){
+      resampled_width = (unsigned int) round((((float)resampled_height/(float)view_height) * view_width));
+    }
+  }
+
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: Requested scaled region size is " << resampled_width << "x" << resampled_height
+			<< " at resolution " << requested_res
+			<< ". Nearest existing resolution has region with size " << view_width << "x" << view_height << endl;
+  }
+
+
+#ifndef DEBUG
+
+  // Define our separator depending on the OS
+#ifdef WIN32
+  const string separator = "\\";
+#else
+  const string separator = "/";
+#endif
 
+
+  // Get our image file name and strip of the directory path and any suffix
+  string filename = (*session->image)->getImagePath();
+  int pos = filename.rfind(separator)+1;
+  string basename = filename.substr( pos, filename.rfind(".")-pos );
+
+  char str[1024];
+  snprintf( str, 1024,
+	    "Server: iipsrv/%s\r\n"
+	    "X-Powered-By: IIPImage\r\n"
+	    "%s\r\n"
+	    "Last-Modified: %s\r\n"
+	    "%s"
+	    "Content-Type: image/jpeg\r\n"
+	    "Content-Disposition: inline;filename=\"%s.jpg\"\r\n"
 #ifdef CHUNKED
-    // Send chunk length in hex
-    snprintf( str, 1024, "%X\r\n", len );
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
-    session->out->printf( str );
+	    "Transfer-Encoding: chunked\r\n"
 #endif
+	    "\r\n",
+	    VERSION, session->response->getCacheControl().c_str(), (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), basename.c_str() );
+
+  session->out->printf( (const char*) str );
+#endif
+
+
+  // Output is compressed and sent in strips of fixed height
+  const unsigned int strip_height = 128;
+  unsigned char* output = NULL;
+
+  TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setThreads( session->regionThreads );
+
+  unsigned int interpolation = Environment::getInterpolation();
+  bool resize = (view_width!=resampled_width) || (view_height!=resampled_height);
+
+  // Error which stopped us once we had started sending our image
+  string failure;
+
+  // Rotations and vertical flips need the whole region at once
+  float rotation = session->view->getRotation();
+  bool rotate = ( (int)rotation % 90 == 0 && (int)rotation % 360 != 0 );
+
+
+  if( rotate || session->view->flip == 2 ){
+
+    // Get our requested region from our TileManager
+    RawTile complete_image = tilemanager.getRegion( requested_res,
+						    session->view->xangle, session->view->yangle,
+						    session->view->getLayers(),
+						    view_left, view_top, view_width, view_height );
+
+    processRegion( session, complete_image );
+
 
-    // Send this strip out to the client
-    if( len != session->out->putStr( (const char*) output, len ) ){
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error writing jpeg strip data: " << len << endl;
+    // Resize our image as requested. Use the interpolation method requested in the server configuration.
+    //  - Use bilinear interpolation by default
+    if( resize ){
+
+      string interpolation_type;
+      if( session->loglevel >= 5 ) function_timer.start();
+
+      switch( interpolation ){
+       case 0:
+	interpolation_type = "nearest neighbour";
+	filter_interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
+	break;
+       default:
+	interpolation_type = "bilinear";
+	filter_interpolate_bilinear( complete_image, resampled_width, resampled_height );
+	break;
+      }
+
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
+			    << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
-#ifdef CHUNKED
-    // Send closing chunk CRLF
-    session->out->printf( "\r\n" );
-#endif
 
-    // Flush our block of data
-    if( session->out->flush() == -1 ) {
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
+    processOutput( session, complete_image );
+
+
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if( rotate ){
+
+      if( session->loglevel >= 5 ) function_timer.start();
+
+      filter_rotate( complete_image, rotation );
+
+      // For 90 and 270 rotation swap width and height
+      resampled_width = complete_image.width;
+      resampled_height = complete_image.height;
+
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
+			    << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
+
+    // Send out the data per strip of fixed height
+    size_t row_length = resampled_width * complete_image.channels;
+    for( unsigned int top=0; top<resampled_height; top+=strip_height ){
+      RawTile strip( 0, requested_res, session->view->xangle, session->view->yangle, resampled_width,
+		     min( strip_height, resampled_height-top ), complete_image.channels, 8 );
+      strip.data = &((unsigned char*)complete_image.data)[top*row_length];
+      strip.memoryManaged = 0;
+      sendStrip( session, strip, resampled_width, resampled_height, strip_height, output );
+    }
+
   }
+  else{
 
-  // Finish off the image compression
-  len = session->jpeg->Finish( output );
+    // Otherwise process our region one band of tile rows at a time, resizing incrementally and
+    // sending each output strip as soon as it is complete, so that only a single band and strip
+    // are ever held in memory
+    unsigned int band_height = (*session->image)->getTileHeight();
+    if( band_height == 0 ) band_height = strip_height;
 
-#ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Final Data Chunk : " << str << endl;
-  session->out->printf( str );
-#endif
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Streaming region in bands of up to " << band_height << " rows" << endl;
+    }
+
+    // Vertical scale factor, which depends on our interpolation method
+    float yscale = 1.0;
+    if( resize ){
+      if( interpolation == 0 ) yscale = (float)view_height / (float)resampled_height;
+      else yscale = (float)(view_height-1) / (float)resampled_height;
+    }
+
+    // Output rows awaiting compression and the last row of our previous band,
+    // which bilinear interpolation may still need
+    vector<unsigned char> rows, previous;
+    unsigned int channels = 0;
+    unsigned int nrows = 0;
+
+    // Next output row
+    unsigned int j = 0;
+
+    unsigned int bottom = view_top + view_height;
+    unsigned int top = view_top;
+
+    // Errors before our first strip has been sent are reported as usual. After that our
+    // response has already started, so we can only stop and truncate our image
+    try{
+
+      while( top < bottom ){
+
+	// Align our bands to the image's tile rows
+	unsigned int end = ( (top / band_height) + 1 ) * band_height;
+	if( end > bottom ) end = bottom;
+
+	RawTile band = tilemanager.getRegion( requested_res,
+					      session->view->xangle, session->view->yangle,
+					      session->view->getLayers(),
+					      view_left, top, view_width, end - top );
+
+	processRegion( session, band );
+
+	if( channels == 0 ){
+	  channels = band.channels;
+	  rows.resize( resampled_width * channels * strip_height );
+	}
+
+	// Band rows relative to our region
+	unsigned int first = top - view_top;
+	unsigned int last = end - view_top;
+	size_t band_row_length = view_width * channels;
+	const unsigned char* data = (const unsigned char*) band.data;
+
+	// Generate every output row whose input rows we now have
+	while( j < resampled_height ){
+
+	  unsigned char* out = &rows[nrows * resampled_width * channels];
+
+	  if( !resize ){
+	    if( j >= last ) break;
+	    memcpy( out, &data[(j-first)*band_row_length], band_row_length );
+	  }
+	  else if( interpolation == 0 ){
+	    unsigned int jj = (unsigned int) floorf(j*yscale);
+	    if( jj >= last ) break;
+	    filter_interpolate_row_nearestneighbour( &data[(jj-first)*band_row_length], view_width, channels,
+						     out, resampled_width );
+	  }
+	  else{
+	    unsigned int jj = (unsigned int) floor( j*yscale );
+	    unsigned int jj2 = ( jj+1 < view_height ) ? jj+1 : jj;
+	    if( jj2 >= last ) break;
+
+	    float jscale = j*yscale;
+	    float c = (float)(jj+1) - jscale;
+	    float d = jscale - (float)jj;
+
+	    // Our upper row may be the last row of our previous band
+	    const unsigned char* in1 = ( jj < first ) ? &previous[0] : &data[(jj-first)*band_row_length];
+	    const unsigned char* in2 = &data[(jj2-first)*band_row_length];
+	    filter_interpolate_row_bilinear( in1, in2, c, d, view_width, channels, out, resampled_width );
+	  }
+
+	  j++;
+	  nrows++;
+
+	  // Compress and send each complete strip
+	  if( nrows == strip_height || j == resampled_height ){
+	    RawTile strip( 0, requested_res, session->view->xangle, session->view->yangle,
+			   resampled_width, nrows, channels, 8 );
+	    strip.dataLength = resampled_width * nrows * channels;
+	    strip.data = new unsigned char[strip.dataLength];
+	    memcpy( strip.data, &rows[0], strip.dataLength );
+	    processOutput( session, strip );
+	    sendStrip( session, strip, resampled_width, resampled_height, strip_height, output );
+	    nrows = 0;
+	  }
+	}
+
+	if( resize && interpolation != 0 ){
+	  previous.assign( &data[(last-first-1)*band_row_length], &data[(last-first)*band_row_length] );
+	}
+
+	top = end;
+      }
 
-  if( session->out->putStr( (const char*) output, len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing jpeg EOI markers" << endl;
     }
+    catch( const file_error& error ){
+      if( !output ) throw;
+      failure = error.what();
+    }
+    catch( const string& error ){
+      if( !output ) throw;
+      failure = error;
+    }
+
+    if( !failure.empty() && session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error after image data sent, truncating image: " << failure << endl;
+    }
+
   }
 
-  delete[] output;
+
+  // Finish off the image compression. A truncated image is left without its EOI marker
+  if( output ){
+    len = session->jpeg->Finish( output );
+    if( failure.empty() ) sendData( session, output, len, "jpeg EOI markers" );
+    if( !session->arena ) delete[] output;
+  }
 
 
 #ifdef CHUNKED
-  // Send closing chunk CRLF
-  session->out->printf( "\r\n" );
   // Send closing blank chunk
   session->out->printf( "0\r\n\r\n" );
 #endif
@@ -481,4 +639,3 @@ void CVT::send( Session* session ){
 
 
 }
-
@@ -81,27 +81,50 @@ namespace __gnu_cxx {
 
 #include <iostream>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "RawTile.h"
+#include "Thread.h"
+
+
 
+/// Number of one minute intervals over which cache hit ratios are recorded
+#define CACHE_STATS_MINUTES 60
+
+
+/// Magic signature and format version for cache snapshot files
+/** Version 2 numbers resolutions including any virtual levels generated for
+    TIFF images with missing pyramid levels, so version 1 tiles cannot be reused
+ */
+#define SNAPSHOT_MAGIC "IIPCACHE"
+#define SNAPSHOT_VERSION 2
 
 
 /// Cache to store raw tile data
+/** All public functions are thread safe */
 
 class Cache {
 
 
  private:
 
+  /// Lock protecting all cache structures
+  Mutex mutex;
+
   /// Basic object storage size
   int tileSize;
 
-  /// Max memory size in bytes
-  unsigned long maxSize;
-
-  /// Current memory running total
-  unsigned long currentSize;
-
   /// Main cache storage typedef
 #ifdef HAVE_EXT_POOL_ALLOCATOR
   typedef std::list < std::pair<const std::string,RawTile>,
@@ -125,57 +148,281 @@ class Cache {
 #endif
 
 
-  /// Main cache storage object
-  TileList tileList;
+  /// An independently sized LRU list together with its index
+  struct Segment {
+
+    /// Max memory size in bytes
+    unsigned long maxSize;
+
+    /// Current memory running total
+    unsigned long currentSize;
+
+    /// Cache storage object
+    TileList tileList;
+
+    /// Cache storage index object
+    TileMap tileMap;
+
+    /// Number of tiles evicted to make room for new ones
+    unsigned long evictions;
+
+    Segment(): maxSize(0), currentSize(0), evictions(0) {};
+  };
+
+
+  /// Main cache segment
+  Segment main;
+
+  /// Protected segment for low resolution tiles, which are not evicted by main cache traffic
+  Segment pinned;
+
+  /// Tiles with a resolution number below this are stored in the pinned segment
+  int pinnedResolutions;
+
+
+  /// Lookup counters for a one minute interval
+  struct Interval {
+    time_t minute;
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  /// Cache hits and misses for each compression type
+  unsigned long hits[4], misses[4];
+
+  /// Cache hits and misses for processed tiles
+  unsigned long processedHits, processedMisses;
+
+  /// Number of tiles inserted
+  unsigned long inserts;
 
-  /// Main Cache storage index object
-  TileMap tileMap;
+  /// Number of tiles replaced because their source image had been modified
+  unsigned long stale;
+
+  /// Ring of per-minute lookup counters
+  Interval intervals[CACHE_STATS_MINUTES];
+
+  /// Tiles currently being decoded by a thread following a cache miss
+  std::set < std::string > decoding;
+
+  /// Signalled whenever a thread finishes decoding a tile
+  Condition decoded;
+
+  /// Number of cache misses which waited for another thread to decode the same tile
+  unsigned long coalesced;
+
+  /// Memory used by the tiles of each image
+  HASHMAP < std::string, unsigned long > imageSizes;
+
+
+  /// Memory accounted for a cached tile
+  unsigned long _size( const std::string& key, const RawTile& r ) {
+    return r.dataLength + ( r.filename.capacity() + key.capacity() )*sizeof(char) + tileSize;
+  }
+
+
+  /// Record a cache lookup
+  void _record( CompressionType c, bool processed, bool hit ) {
+    if( processed ) hit ? processedHits++ : processedMisses++;
+    else if( c >= 0 && c < 4 ) hit ? hits[c]++ : misses[c]++;
+    time_t minute = time( NULL ) / 60;
+    Interval& i = intervals[ minute % CACHE_STATS_MINUTES ];
+    if( i.minute != minute ){
+      i.minute = minute; i.hits = 0; i.misses = 0;
+    }
+    hit ? i.hits++ : i.misses++;
+  }
+
+
+  /// Select the segment a tile belongs to
+  Segment& _segment( int resolution ) {
+    if( resolution < pinnedResolutions && pinned.maxSize > 0 ) return pinned;
+    return main;
+  }
+
+
+  /// Order image memory usage by decreasing size
+  static bool _largest( const std::pair<std::string,unsigned long>& a, const std::pair<std::string,unsigned long>& b ) {
+    return a.second > b.second;
+  }
 
 
   /// Internal touch function
   /** Touches a key in the Cache and makes it the most recently used
+   *  @param s segment to search
    *  @param key to be touched
    *  @return a Map_Iter pointing to the key that was touched.
    */
-  TileMap::iterator _touch( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return miter;
+  TileMap::iterator _touch( Segment& s, const std::string &key ) {
+    TileMap::iterator miter = s.tileMap.find( key );
+    if( miter == s.tileMap.end() ) return miter;
     // Move the found node to the head of the list.
-    tileList.splice( tileList.begin(), tileList, miter->second );
+    s.tileList.splice( s.tileList.begin(), s.tileList, miter->second );
     return miter;
   }
 
 
   /// Interal remove function
   /**
+   *  @param s segment containing the key
    *  @param miter Map_Iter that points to the key to remove
    *  @warning miter is no longer usable after being passed to this function.
    */
-  void _remove( const TileMap::iterator &miter ) {
-    // Reduce our current size counter
-    currentSize -= ( (miter->second->second).dataLength +
-		     ( (miter->second->second).filename.capacity() + (miter->second->first).capacity() )*sizeof(char) +
-		     tileSize );
-    tileList.erase( miter->second );
-    tileMap.erase( miter );
+  void _remove( Segment& s, const TileMap::iterator &miter ) {
+    // Reduce our current size counters
+    const RawTile& r = miter->second->second;
+    unsigned long size = this->_size( miter->second->first, r );
+    s.currentSize -= size;
+    HASHMAP < std::string, unsigned long >::iterator im = imageSizes.find( r.filename );
+    if( im != imageSizes.end() ){
+      if( im->second <= size ) imageSizes.erase( im );
+      else im->second -= size;
+    }
+    s.tileList.erase( miter->second );
+    s.tileMap.erase( miter );
   }
 
 
   /// Interal remove function
-  /** @param key to remove */
-  void _remove( const std::string &key ) {
-    TileMap::iterator miter = tileMap.find( key );
-    this->_remove( miter );
+  /** @param s segment containing the key
+      @param key to remove
+   */
+  void _remove( Segment& s, const std::string &key ) {
+    TileMap::iterator miter = s.tileMap.find( key );
+    this->_remove( s, miter );
+  }
+
+
+  /// Internal insert function
+  /** @param key index under which to store the tile
+      @param r tile to be inserted
+   */
+  void _insert( const std::string& key, const RawTile& r ) {
+
+    Segment& s = this->_segment( r.resolution );
+
+    // Touch the key, if it exists
+    TileMap::iterator miter = this->_touch( s, key );
+
+    // Check whether this tile exists in our cache
+    if( miter != s.tileMap.end() ){
+      // Check the timestamp and delete if necessary
+      if( miter->second->second.timestamp < r.timestamp ){
+	this->_remove( s, miter );
+	stale++;
+      }
+      // If this index already exists and it is up to date, do nothing
+      else return;
+    }
+
+    // Store the key if it doesn't already exist in our cache
+    // Ok, do the actual insert at the head of the list
+    s.tileList.push_front( std::make_pair(key,r) );
+
+    // And store this in our map
+    List_Iter liter = s.tileList.begin();
+    s.tileMap[ key ] = liter;
+
+    // Update our total current size variable. Use the string::capacity function
+    // rather than length() as std::string can allocate slightly more than necessary.
+    // Use our stored copies so that the size matches exactly that removed by _remove()
+    unsigned long size = this->_size( liter->first, liter->second );
+    s.currentSize += size;
+    imageSizes[ r.filename ] += size;
+    inserts++;
+
+    // Check to see if we need to remove an element due to exceeding max_size.
+    // Tiles evicted from the pinned segment are simply dropped
+    this->_shrink( s );
+
+  }
+
+
+  /// Evict the least recently used tiles of a segment until it fits within its maximum size
+  /** @param s segment to shrink */
+  void _shrink( Segment& s ) {
+    while( s.currentSize > s.maxSize && !s.tileList.empty() ) {
+      // Remove the last element
+      List_Iter liter = s.tileList.end();
+      --liter;
+      this->_remove( s, liter->first );
+      s.evictions++;
+    }
+  }
+
+
+  /// Write a length-prefixed string to a snapshot file
+  static bool _write( FILE* f, const std::string& s ) {
+    unsigned int len = s.length();
+    return ( fwrite( &len, sizeof(len), 1, f ) == 1 ) &&
+      ( len == 0 || fwrite( s.data(), 1, len, f ) == len );
+  }
+
+
+  /// Write a fixed size value to a snapshot file
+  template <class T> static bool _write( FILE* f, const T& v ) {
+    return fwrite( &v, sizeof(T), 1, f ) == 1;
+  }
+
+
+  /// Read a fixed size value from a snapshot buffer, checking bounds
+  template <class T> static bool _read( const unsigned char*& p, const unsigned char* end, T& v ) {
+    if( (size_t)(end - p) < sizeof(T) ) return false;
+    memcpy( &v, p, sizeof(T) );
+    p += sizeof(T);
+    return true;
+  }
+
+
+  /// Read a length-prefixed string from a snapshot buffer, checking bounds
+  static bool _read( const unsigned char*& p, const unsigned char* end, std::string& s ) {
+    unsigned int len;
+    if( !_read( p, end, len ) || (size_t)(end - p) < len ) return false;
+    s.assign( (const char*) p, len );
+    p += len;
+    return true;
   }
 
 
 
  public:
 
+  /// Snapshot of the cache statistics
+  struct Statistics {
+    /// Hits and misses for each compression type, indexed by CompressionType
+    unsigned long hits[4], misses[4];
+    /// Hits and misses for processed tiles
+    unsigned long processedHits, processedMisses;
+    /// Tiles inserted and tiles replaced as their source image was modified
+    unsigned long inserts, stale;
+    /// Cache misses which waited for a concurrent decode of the same tile
+    unsigned long coalesced;
+    /// Number of tiles, bytes used, maximum bytes and evictions for the main and pinned segments
+    unsigned int tiles, pinnedTiles;
+    unsigned long size, maxSize, pinnedSize, pinnedMaxSize;
+    unsigned long evictions, pinnedEvictions;
+    /// Lookups for each of the last CACHE_STATS_MINUTES minutes, most recent first
+    unsigned long minuteHits[CACHE_STATS_MINUTES], minuteMisses[CACHE_STATS_MINUTES];
+    /// Images using the most memory, together with their usage in bytes
+    std::vector< std::pair<std::string,unsigned long> > images;
+  };
+
+
   /// Constructor
-  /** @param max Maximum cache size in MB */
-  Cache( float max ) {
-    maxSize = (unsigned long)(max*1024000) ; currentSize = 0;
+  /** @param max Maximum cache size in MB
+      @param pinnedMax Maximum size in MB of the pinned low resolution segment
+      @param resolutions Number of lowest resolution levels to store in the pinned segment
+   */
+  Cache( float max, float pinnedMax = 0, int resolutions = 0 ) {
+    main.maxSize = (unsigned long)(max*1024000);
+    pinned.maxSize = (unsigned long)(pinnedMax*1024000);
+    pinnedResolutions = resolutions;
+    for( int i=0; i<4; i++ ){ hits[i] = 0; misses[i] = 0; }
+    processedHits = 0; processedMisses = 0;
+    inserts = 0; stale = 0; coalesced = 0;
+    for( int i=0; i<CACHE_STATS_MINUTES; i++ ){
+      intervals[i].minute = 0; intervals[i].hits = 0; intervals[i].misses = 0;
+    }
     // 64 chars added at the end represents an average string length
     tileSize = sizeof( RawTile ) + sizeof( std::pair<const std::string,RawTile> ) +
       sizeof( std::pair<const std::string, List_Iter> ) + sizeof(char)*64 + sizeof(List_Iter);
@@ -184,67 +431,146 @@ class Cache {
 
   /// Destructor
   ~Cache() {
-    tileList.clear();
-    tileMap.clear();
+    ScopedLock lock( mutex );
+    main.tileList.clear();
+    main.tileMap.clear();
+    pinned.tileList.clear();
+    pinned.tileMap.clear();
   }
 
 
   /// Insert a tile
-  /** @param r Tile to be inserted */
-  void insert( const RawTile& r ) {
+  /** @param r Tile to be inserted
+      @param variant optional identifier of any processing applied to the tile
+   */
+  void insert( const RawTile& r, const std::string& variant = std::string() ) {
 
-    if( maxSize == 0 ) return;
+    if( this->_segment( r.resolution ).maxSize == 0 ) return;
 
     std::string key = this->getIndex( r.filename, r.resolution, r.tileNum,
-				      r.hSequence, r.vSequence, r.compressionType, r.quality );
+				      r.hSequence, r.vSequence, r.compressionType, r.quality, variant );
 
-    // Touch the key, if it exists
-    TileMap::iterator miter = this->_touch( key );
+    ScopedLock lock( mutex );
 
-    // Check whether this tile exists in our cache
-    if( miter != tileMap.end() ){
-      // Check the timestamp and delete if necessary
-      if( miter->second->second.timestamp < r.timestamp ){
-	this->_remove( miter );
-      }
-      // If this index already exists and it is up to date, do nothing
-      else return;
-    }
+    this->_insert( key, r );
+  }
 
-    // Store the key if it doesn't already exist in our cache
-    // Ok, do the actual insert at the head of the list
-    tileList.push_front( std::make_pair(key,r) );
 
-    // And store this in our map
-    List_Iter liter = tileList.begin();
-    tileMap[ key ] = liter;
+  /// Change the maximum cache sizes, evicting tiles if necessary
+  /** @param max Maximum cache size in MB
+      @param pinnedMax Maximum size in MB of the pinned low resolution segment
+   */
+  void setMaxSize( float max, float pinnedMax ) {
+    ScopedLock lock( mutex );
+    main.maxSize = (unsigned long)(max*1024000);
+    pinned.maxSize = (unsigned long)(pinnedMax*1024000);
+    this->_shrink( main );
+    this->_shrink( pinned );
+  }
 
-    // Update our total current size variable. Use the string::capacity function
-    // rather than length() as std::string can allocate slightly more than necessary
-    // The +1 is for the terminating null byte
-    currentSize += (r.dataLength + (r.filename.capacity()+key.capacity())*sizeof(char) + tileSize);
 
-    // Check to see if we need to remove an element due to exceeding max_size
-    while( currentSize > maxSize ) {
-      // Remove the last element
-      liter = tileList.end();
-      --liter;
-      this->_remove( liter->first );
-    }
+  /// Return the number of tiles in the cache
+  unsigned int getNumElements() {
+    ScopedLock lock( mutex );
+    return main.tileList.size() + pinned.tileList.size();
+  }
+
 
+  /// Return the number of MB stored
+  float getMemorySize() {
+    ScopedLock lock( mutex );
+    return (float) ( (main.currentSize + pinned.currentSize) / 1024000.0 );
   }
 
 
-  /// Return the number of tiles in the cache
-  unsigned int getNumElements() { return tileList.size(); }
+  /// Return the number of tiles in the pinned segment
+  unsigned int getNumPinnedElements() {
+    ScopedLock lock( mutex );
+    return pinned.tileList.size();
+  }
 
 
-  /// Return the number of MB stored
-  float getMemorySize() { return (float) ( currentSize / 1024000.0 ); }
+  /// Return the number of MB stored in the pinned segment
+  float getPinnedMemorySize() {
+    ScopedLock lock( mutex );
+    return (float) ( pinned.currentSize / 1024000.0 );
+  }
+
+
+  /// Return the maximum number of bytes which can be stored in the main and pinned segments
+  unsigned long getMaxSize() {
+    ScopedLock lock( mutex );
+    return main.maxSize + pinned.maxSize;
+  }
+
+
+  /// Return the number of tiles evicted so far to make room for new tiles
+  unsigned long getEvictions() {
+    ScopedLock lock( mutex );
+    return main.evictions + pinned.evictions;
+  }
+
+
+  /// Return a snapshot of the cache statistics
+  /** @param stats structure to fill
+      @param n maximum number of images to list by memory usage
+   */
+  void getStatistics( Statistics& stats, unsigned int n ) {
+
+    ScopedLock lock( mutex );
+
+    for( int i=0; i<4; i++ ){ stats.hits[i] = hits[i]; stats.misses[i] = misses[i]; }
+    stats.processedHits = processedHits;
+    stats.processedMisses = processedMisses;
+    stats.inserts = inserts;
+    stats.stale = stale;
+    stats.coalesced = coalesced;
+    stats.tiles = main.tileList.size();
+    stats.pinnedTiles = pinned.tileList.size();
+    stats.size = main.currentSize;
+    stats.maxSize = main.maxSize;
+    stats.pinnedSize = pinned.currentSize;
+    stats.pinnedMaxSize = pinned.maxSize;
+    stats.evictions = main.evictions;
+    stats.pinnedEvictions = pinned.evictions;
+
+    time_t minute = time( NULL ) / 60;
+    for( int i=0; i<CACHE_STATS_MINUTES; i++ ){
+      const Interval& interval = intervals[ (minute-i) % CACHE_STATS_MINUTES ];
+      bool current = ( interval.minute == minute-i );
+      stats.minuteHits[i] = current ? interval.hits : 0;
+      stats.minuteMisses[i] = current ? interval.misses : 0;
+    }
+
+    stats.images.assign( imageSizes.begin(), imageSizes.end() );
+    if( n < stats.images.size() ){
+      std::partial_sort( stats.images.begin(), stats.images.begin()+n, stats.images.end(), _largest );
+      stats.images.resize( n );
+    }
+    else std::sort( stats.images.begin(), stats.images.end(), _largest );
+  }
+
+
+  /// Record the outcome of a tile lookup in our statistics
+  /** A single request may probe the cache several times for the same tile, for
+   *  instance under different compression types, so lookups are not counted by
+   *  getTile() or copyTile() themselves: this must be called once per tile requested
+   *  @param r resolution number
+   *  @param c requested compression type
+   *  @param hit whether an up to date tile was found
+   *  @param processed whether the lookup was for a processed tile
+   */
+  void record( int r, CompressionType c, bool hit, bool processed = false ) {
+    if( this->_segment( r ).maxSize == 0 ) return;
+    ScopedLock lock( mutex );
+    this->_record( c, processed, hit );
+  }
 
 
   /// Get a tile from the cache
-  /** 
+  /** The tile data is copied, so the result remains valid even if the tile
+   *  is subsequently evicted by another thread. The lookup is not recorded
+   *  in our statistics
    *  @param f filename
    *  @param r resolution number
    *  @param t tile number
@@ -252,19 +578,293 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return pointer to data or NULL on error
+   *  @param tile tile into which the cached tile is copied
+   *  @param variant optional identifier of any processing applied to the tile
+   *  @return whether the tile was found
+   */
+  bool getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q,
+		RawTile& tile, const std::string& variant = std::string() ) {
+
+    Segment& s = this->_segment( r );
+    if( s.maxSize == 0 ) return false;
+
+    std::string key = this->getIndex( f, r, t, h, v, c, q, variant );
+
+    ScopedLock lock( mutex );
+
+    TileMap::iterator miter = this->_touch( s, key );
+    if( miter == s.tileMap.end() ) return false;
+
+    tile = miter->second->second;
+    return true;
+  }
+
+
+  /// Copy part of an uncompressed tile from the cache directly into a view
+  /** Unlike getTile(), only the part of the tile which is needed is copied.
+   *  The lookup is not recorded in our statistics
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @param timestamp timestamp of the source image: older tiles are treated as missing
+   *  @param view destination and part of the tile to copy
+   *  @return whether an up to date tile was found
    */
-  RawTile* getTile( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  bool copyTile( const std::string& f, int r, int t, int h, int v, time_t timestamp, const RawTileView& view ) {
+
+    Segment& s = this->_segment( r );
+    if( s.maxSize == 0 ) return false;
 
-    if( maxSize == 0 ) return NULL;
+    std::string key = this->getIndex( f, r, t, h, v, UNCOMPRESSED, 0 );
 
-    std::string key = this->getIndex( f, r, t, h, v, c, q );
+    ScopedLock lock( mutex );
+
+    TileMap::iterator miter = this->_touch( s, key );
+    if( miter == s.tileMap.end() || miter->second->second.timestamp < timestamp ) return false;
+
+    const RawTile& tile = miter->second->second;
+    tile.copyTo( view, tile.width );
+    return true;
+  }
 
-    TileMap::iterator miter = tileMap.find( key );
-    if( miter == tileMap.end() ) return NULL;
-    this->_touch( key );
 
-    return &(miter->second->second);
+  /// Claim the decoding of a tile following a cache miss
+  /** Concurrent misses for the same tile are coalesced: if another thread is
+   *  already decoding this tile, wait until it has finished before claiming it.
+   *  Each call must be matched by a call to endDecode()
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   *  @return whether we had to wait, in which case the tile is likely to be in the cache
+   */
+  bool beginDecode( const std::string& f, int r, int t, int h, int v ) {
+
+    std::string key = this->getIndex( f, r, t, h, v, UNCOMPRESSED, 0 );
+
+    ScopedLock lock( mutex );
+
+    // Nothing to share if tiles of this resolution are not cached. Our cache size can
+    // change at any time when settings are reloaded, so only check it under our lock
+    if( this->_segment( r ).maxSize == 0 ) return false;
+
+    bool waited = false;
+    while( decoding.find( key ) != decoding.end() ){
+      decoded.wait( mutex );
+      waited = true;
+    }
+    if( waited ) coalesced++;
+    decoding.insert( key );
+    return waited;
+  }
+
+
+  /// Release a tile claimed with beginDecode() and wake up any waiting threads
+  /** The claim is always released, even if our cache has since been disabled,
+   *  so that no thread is left waiting for it
+   *  @param f filename
+   *  @param r resolution number
+   *  @param t tile number
+   *  @param h horizontal sequence number
+   *  @param v vertical sequence number
+   */
+  void endDecode( const std::string& f, int r, int t, int h, int v ) {
+
+    std::string key = this->getIndex( f, r, t, h, v, UNCOMPRESSED, 0 );
+
+    ScopedLock lock( mutex );
+    decoding.erase( key );
+    decoded.broadcast();
+  }
+
+
+  /// Write the contents of the cache to a snapshot file
+  /** Tiles are written from least to most recently used together with their
+      keys and timestamps so that a subsequent load() restores the LRU order.
+      The snapshot is first written to a temporary file, which is then renamed.
+      Tiles are copied out one at a time, so that the cache remains in use while
+      we write, and any evicted in the meantime are skipped.
+      @param path snapshot file path
+      @param uncompressed whether to also store UNCOMPRESSED tiles
+      @return number of tiles written or -1 on error
+   */
+  int save( const std::string& path, bool uncompressed ) {
+
+    // Store both the pinned and main segments
+    Segment* segments[2] = { &pinned, &main };
+
+    // Collect the keys of the tiles we are going to store, least recently used first.
+    // Our lock is only held while doing this and while copying each tile, so that
+    // other threads can carry on using the cache while we write
+    std::vector<std::string> keys[2];
+    {
+      ScopedLock lock( mutex );
+      for( int l = 0; l < 2; l++ ){
+	const TileList& list = segments[l]->tileList;
+	for( TileList::const_reverse_iterator i = list.rbegin(); i != list.rend(); ++i ){
+	  if( uncompressed || i->second.compressionType != UNCOMPRESSED ) keys[l].push_back( i->first );
+	}
+      }
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f ) return -1;
+
+    // The number of tiles is filled in once we know how many are still in the cache
+    unsigned int n = 0;
+    bool ok = ( fwrite( SNAPSHOT_MAGIC, 1, 8, f ) == 8 ) &&
+      _write( f, (unsigned int) SNAPSHOT_VERSION ) && _write( f, n );
+
+    for( int l = 0; l < 2; l++ ){
+      for( unsigned int k = 0; ok && k < keys[l].size(); k++ ){
+
+	// Copy the tile, skipping any which have since been evicted
+	RawTile* tile = NULL;
+	{
+	  ScopedLock lock( mutex );
+	  TileMap::iterator miter = segments[l]->tileMap.find( keys[l][k] );
+	  if( miter != segments[l]->tileMap.end() ) tile = new RawTile( miter->second->second );
+	}
+	if( !tile ) continue;
+
+	const RawTile& r = *tile;
+	ok = _write( f, keys[l][k] ) && _write( f, r.filename ) &&
+	    _write( f, r.tileNum ) && _write( f, r.resolution ) &&
+	    _write( f, r.hSequence ) && _write( f, r.vSequence ) &&
+	    _write( f, (int) r.compressionType ) && _write( f, r.quality ) &&
+	    _write( f, (long long) r.timestamp ) &&
+	    _write( f, r.width ) && _write( f, r.height ) &&
+	    _write( f, r.channels ) && _write( f, r.bpc ) &&
+	    _write( f, (int) r.sampleType ) && _write( f, (int) r.padded ) &&
+	    _write( f, r.dataLength ) &&
+	    ( r.dataLength == 0 || fwrite( r.data, 1, r.dataLength, f ) == (size_t) r.dataLength );
+	delete tile;
+	n++;
+      }
+    }
+
+    ok = ok && fseek( f, 8 + sizeof(unsigned int), SEEK_SET ) == 0 && _write( f, n );
+
+    if( fclose( f ) != 0 ) ok = false;
+    if( !ok || rename( tmp.c_str(), path.c_str() ) != 0 ){
+      remove( tmp.c_str() );
+      return -1;
+    }
+
+    return n;
+  }
+
+
+  /// Reload a cache snapshot written by save()
+  /** The file is memory mapped and each tile is copied into the cache. Tiles
+      whose source image no longer exists or whose modification time differs from
+      the tile timestamp are dropped.
+      @param path snapshot file path
+      @param prefix file system prefix to prepend to tile file names
+      @return number of tiles loaded or -1 if the snapshot could not be read
+   */
+  int load( const std::string& path, const std::string& prefix ) {
+
+    if( main.maxSize == 0 && pinned.maxSize == 0 ) return 0;
+
+    unsigned char* buffer = NULL;
+    size_t length = 0;
+
+#ifndef WIN32
+    int fd = open( path.c_str(), O_RDONLY );
+    if( fd == -1 ) return -1;
+    struct stat sb;
+    if( fstat( fd, &sb ) == -1 || sb.st_size == 0 ){
+      close( fd );
+      return -1;
+    }
+    length = sb.st_size;
+    void* map = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( map == MAP_FAILED ) return -1;
+    buffer = (unsigned char*) map;
+#else
+    FILE* f = fopen( path.c_str(), "rb" );
+    if( !f ) return -1;
+    fseek( f, 0, SEEK_END );
+    length = ftell( f );
+    fseek( f, 0, SEEK_SET );
+    buffer = new unsigned char[length];
+    if( fread( buffer, 1, length, f ) != length ) length = 0;
+    fclose( f );
+#endif
+
+    const unsigned char* p = buffer;
+    const unsigned char* end = buffer + length;
+    unsigned int version = 0, n = 0;
+    int loaded = -1;
+
+    if( length >= 8 && memcmp( p, SNAPSHOT_MAGIC, 8 ) == 0 ){
+      p += 8;
+      if( _read( p, end, version ) && version == SNAPSHOT_VERSION && _read( p, end, n ) ){
+
+	loaded = 0;
+
+	// Modification times of the source images we have already checked
+	std::map <std::string, time_t> mtimes;
+
+	for( unsigned int i = 0; i < n; i++ ){
+
+	  std::string key;
+	  RawTile r;
+	  int compression, sample, padded;
+	  long long timestamp;
+
+	  if( !( _read( p, end, key ) && _read( p, end, r.filename ) &&
+		 _read( p, end, r.tileNum ) && _read( p, end, r.resolution ) &&
+		 _read( p, end, r.hSequence ) && _read( p, end, r.vSequence ) &&
+		 _read( p, end, compression ) && _read( p, end, r.quality ) &&
+		 _read( p, end, timestamp ) &&
+		 _read( p, end, r.width ) && _read( p, end, r.height ) &&
+		 _read( p, end, r.channels ) && _read( p, end, r.bpc ) &&
+		 _read( p, end, sample ) && _read( p, end, padded ) &&
+		 _read( p, end, r.dataLength ) ) ) break;
+
+	  if( r.dataLength < 0 || (size_t)(end - p) < (size_t) r.dataLength ) break;
+
+	  r.compressionType = (CompressionType) compression;
+	  r.sampleType = (SampleType) sample;
+	  r.padded = padded;
+	  r.timestamp = (time_t) timestamp;
+
+	  // Point directly into our mapped buffer - the data is copied on insertion
+	  r.data = (void*) p;
+	  r.memoryManaged = 0;
+	  p += r.dataLength;
+
+	  // Check the timestamp of the source image
+	  std::map <std::string, time_t>::iterator m = mtimes.find( r.filename );
+	  if( m == mtimes.end() ){
+	    struct stat st;
+	    time_t mtime = ( stat( (prefix+r.filename).c_str(), &st ) == 0 ) ? st.st_mtime : 0;
+	    m = mtimes.insert( std::make_pair( r.filename, mtime ) ).first;
+	  }
+	  if( m->second == 0 || m->second != r.timestamp ) continue;
+	  if( this->_segment( r.resolution ).maxSize == 0 ) continue;
+
+	  ScopedLock lock( mutex );
+	  this->_insert( key, r );
+	  loaded++;
+	}
+      }
+    }
+
+#ifndef WIN32
+    munmap( buffer, length );
+#else
+    delete[] buffer;
+#endif
+
+    return loaded;
   }
 
 
@@ -277,12 +877,15 @@ class Cache {
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
+   *  @param variant optional identifier of any processing applied to the tile
    *  @return string
    */
-  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
+  std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q,
+			const std::string& variant = std::string() ) {
     char tmp[1024];
     snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+    if( variant.empty() ) return std::string( tmp );
+    return std::string( tmp ) + ":" + variant;
   }
 
 
@@ -0,0 +1,304 @@
+/*
+    IIP Tile Cache Warm-up Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "CacheWarmer.h"
+#include "Environment.h"
+#include "JPEGCompressor.h"
+#include "TPTImage.h"
+#include "Tokenizer.h"
+#include "URL.h"
+#include "View.h"
+
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Sort our tile requests by decreasing request count
+static bool tileOrder( const pair< pair<int,int>, unsigned int >& a, const pair< pair<int,int>, unsigned int >& b ){
+  return a.second > b.second;
+}
+
+
+/// Remove any trailing carriage return from a line
+static void chomp( string& line ){
+  if( !line.empty() && line[line.length()-1] == '\r' ) line.erase( line.length()-1 );
+}
+
+
+
+bool CacheWarmer::begin(){
+
+  if( file.empty() ) return false;
+
+  ScopedLock lock( mutex );
+  if( running ) return false;
+
+  // Reap any previous, finished warm-up thread
+  this->join();
+
+  running = true;
+  stopping = false;
+  warmed = 0;
+
+  if( !this->start() ){
+    running = false;
+    return false;
+  }
+  return true;
+}
+
+
+
+void CacheWarmer::stop(){
+  stopping = true;
+  this->join();
+}
+
+
+
+void CacheWarmer::parseRequest( const string& query, vector<Image>& images, map<string,unsigned int>& index ){
+
+  string image;
+  int resolution = -1, tile = -1;
+
+  Tokenizer izer( query, "&" );
+  while( izer.hasMoreTokens() ){
+
+    string token = izer.nextToken();
+    size_t n = token.find_first_of( "=" );
+    if( n == string::npos ) continue;
+
+    string command = token.substr( 0, n );
+    transform( command.begin(), command.end(), command.begin(), ::tolower );
+    string argument = URL( token.substr( n+1 ) ).decode();
+
+    if( command == "fif" ) image = argument;
+    else if( command == "jtl" ){
+      size_t c = argument.find( "," );
+      if( c != string::npos ){
+	resolution = atoi( argument.substr( 0, c ).c_str() );
+	tile = atoi( argument.substr( c+1 ).c_str() );
+      }
+    }
+    // For other protocols we only record the image for warming of its lowest resolutions
+    else if( command == "deepzoom" ){
+      size_t p = argument.rfind( "_files/" );
+      if( p != string::npos ) image = argument.substr( 0, p );
+      else if( (p = argument.rfind( ".dzi" )) != string::npos ) image = argument.substr( 0, p );
+    }
+    else if( command == "zoomify" ){
+      size_t p = argument.rfind( "/TileGroup" );
+      if( p == string::npos ) p = argument.rfind( "/ImageProperties.xml" );
+      if( p != string::npos ) image = argument.substr( 0, p );
+    }
+    else if( command == "iiif" ){
+      size_t p = argument.rfind( "/info.json" );
+      if( p == string::npos ){
+	// Strip the region, size, rotation and quality.format components
+	p = argument.length();
+	for( int i=0; i<4 && p != string::npos && p > 0; i++ ) p = argument.rfind( "/", p-1 );
+      }
+      if( p != string::npos && p > 0 ) image = argument.substr( 0, p );
+    }
+  }
+
+  // Filter out any ../ exactly as FIF does
+  size_t n;
+  while( (n=image.find("../")) != string::npos ) image.erase(n,3);
+  if( image.empty() ) return;
+
+  map<string,unsigned int>::iterator i = index.find( image );
+  if( i == index.end() ){
+    Image im;
+    im.name = image;
+    im.count = 0;
+    images.push_back( im );
+    i = index.insert( make_pair( image, images.size()-1 ) ).first;
+  }
+
+  Image& im = images[i->second];
+  im.count++;
+  if( resolution >= 0 && tile >= 0 ) im.tiles[ make_pair(resolution,tile) ]++;
+}
+
+
+
+void CacheWarmer::parse( vector<Image>& images ){
+
+  ifstream in( file.c_str(), ios::in | ios::binary );
+  if( !in ) return;
+
+  // Only read the tail of large files such as logs
+  in.seekg( 0, ios::end );
+  streamoff length = in.tellg();
+  bool partial = false;
+  if( length > WARMUP_TAIL ){
+    in.seekg( length - WARMUP_TAIL, ios::beg );
+    partial = true;
+  }
+  else in.seekg( 0, ios::beg );
+
+  string line;
+
+  // Skip any incomplete first line
+  if( partial ) getline( in, line );
+
+  vector<string> lines;
+  bool log = false;
+  const string marker = "Full Request is ";
+
+  while( getline( in, line ) ){
+    chomp( line );
+    if( line.find( marker ) != string::npos ) log = true;
+    lines.push_back( line );
+  }
+
+  map<string,unsigned int> index;
+
+  for( vector<string>::iterator l = lines.begin(); l != lines.end(); ++l ){
+    if( log ){
+      size_t p = l->find( marker );
+      if( p != string::npos ) this->parseRequest( l->substr( p + marker.length() ), images, index );
+    }
+    else if( !l->empty() && (*l)[0] != '#' ){
+      this->parseRequest( "FIF=" + *l, images, index );
+    }
+  }
+
+  // Most frequently requested images first, otherwise keep the order of the file
+  stable_sort( images.begin(), images.end(), CacheWarmer::imageOrder );
+}
+
+
+
+bool CacheWarmer::warm( TileManager& tilemanager, int resolution, int tile ){
+
+  if( stopping ) return false;
+
+  try{
+    View view;
+    view.setMaxLayers( Environment::getMaxLayers() );
+    RawTile rawtile = tilemanager.getTile( resolution, tile, view.xangle, view.yangle, view.getLayers(), JPEG );
+    bytes += rawtile.dataLength;
+  }
+  catch( ... ){
+    // Ignore tiles we cannot decode
+    return true;
+  }
+
+  warmed++;
+
+  // Stop once we have used our share of the cache. Evictions are not a useful
+  // signal, as live traffic causes them too
+  if( bytes >= budget ) return false;
+
+  if( rate > 0 ){
+#ifdef WIN32
+    Sleep( 1000 / rate );
+#else
+    usleep( 1000000 / rate );
+#endif
+  }
+
+  return !stopping;
+}
+
+
+
+void CacheWarmer::run(){
+
+  vector<Image> images;
+  this->parse( images );
+
+  bytes = 0;
+  budget = (unsigned long) ( tileCache->getMaxSize() * WARMUP_CACHE_FRACTION );
+  JPEGCompressor jpeg( quality );
+  bool ok = true;
+
+  for( vector<Image>::iterator i = images.begin(); ok && i != images.end(); ++i ){
+
+    IIPImage* image = NULL;
+
+    try{
+      IIPImage test( i->name );
+      test.setFileNamePattern( Environment::getFileNamePattern() );
+      test.setFileSystemPrefix( Environment::getFileSystemPrefix() );
+      test.Initialise();
+
+      if( test.getImageFormat() == TIF ) image = new TPTImage( test );
+#ifdef HAVE_KAKADU
+      else if( test.getImageFormat() == JPEG2000 ) image = new KakaduImage( test );
+#endif
+      else continue;
+
+      image->openImage();
+    }
+    catch( ... ){
+      // Skip images which cannot be opened
+      if( image ) delete image;
+      continue;
+    }
+
+    TileManager tilemanager( tileCache, image, watermark, &jpeg, NULL, 0 );
+
+    // First the most frequently requested tiles
+    vector< pair< pair<int,int>, unsigned int > > tiles( i->tiles.begin(), i->tiles.end() );
+    stable_sort( tiles.begin(), tiles.end(), tileOrder );
+    for( unsigned int t=0; ok && t<tiles.size(); t++ ){
+      if( tiles[t].first.first < (int) image->getNumResolutions() ){
+	ok = this->warm( tilemanager, tiles[t].first.first, tiles[t].first.second );
+      }
+    }
+
+    // Then the lowest resolution levels
+    int num_res = image->getNumResolutions();
+    unsigned int tw = image->getTileWidth();
+    unsigned int th = image->getTileHeight();
+    for( int r=0; ok && r<num_res && tw>0 && th>0; r++ ){
+      unsigned int ntiles = (unsigned int) ( ceil( (double)image->image_widths[num_res-r-1]/tw ) *
+					     ceil( (double)image->image_heights[num_res-r-1]/th ) );
+      if( ntiles > WARMUP_MAX_LEVEL_TILES ) break;
+      for( unsigned int t=0; ok && t<ntiles; t++ ) ok = this->warm( tilemanager, r, t );
+    }
+
+    image->closeImage();
+    delete image;
+  }
+
+  ScopedLock lock( mutex );
+  running = false;
+}
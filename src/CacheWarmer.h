@@ -0,0 +1,169 @@
+// Tile Cache Warm-up Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _CACHEWARMER_H
+#define _CACHEWARMER_H
+
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "Cache.h"
+#include "Thread.h"
+#include "TileManager.h"
+#include "Watermark.h"
+
+
+/// Maximum number of bytes read from the end of a warm-up file
+#define WARMUP_TAIL 33554432  // 32MB
+
+/// Resolution levels with no more than this number of tiles are warmed for every listed image
+#define WARMUP_MAX_LEVEL_TILES 16
+
+/// Fraction of the tile cache which a warm-up may fill
+#define WARMUP_CACHE_FRACTION 0.5
+
+
+
+/// Fill the tile cache in a background thread
+/** The warm-up file is either a list of images, one per line as they would be
+    given to the FIF command, or an iipsrv log file. In the latter case the
+    requests recorded in the log are replayed and the most frequently requested
+    tiles of the most frequently requested images are decoded first. For every
+    image the lowest resolution levels are also decoded. Tiles are decoded at a
+    limited rate so as not to compete with live requests and warm-up stops once
+    the tiles it has decoded would fill WARMUP_CACHE_FRACTION of the tile cache,
+    leaving the rest to live traffic.
+ */
+class CacheWarmer : public Thread {
+
+ private:
+
+  /// Tile cache to fill
+  Cache* tileCache;
+
+  /// Watermark to apply to tiles
+  Watermark* watermark;
+
+  /// Warm-up file
+  std::string file;
+
+  /// Maximum number of tiles decoded per second (0 for no limit)
+  unsigned int rate;
+
+  /// JPEG quality with which to compress tiles
+  int quality;
+
+  /// Whether clients may start a warm-up with the WRM command
+  bool command;
+
+  /// Lock protecting our status
+  Mutex mutex;
+
+  /// Whether a warm-up is in progress
+  bool running;
+
+  /// Set to request that a running warm-up stops
+  volatile bool stopping;
+
+  /// Number of tiles decoded during the current or last warm-up
+  volatile unsigned int warmed;
+
+  /// Number of bytes of tiles decoded during the current warm-up and the number we may decode
+  unsigned long bytes, budget;
+
+
+  /// Tile requests per image: maps resolution and tile number to request count
+  typedef std::map < std::pair<int,int>, unsigned int > TileCounts;
+
+  /// Images to warm together with their request count and requested tiles
+  struct Image {
+    std::string name;
+    unsigned int count;
+    TileCounts tiles;
+  };
+
+  /// Sort images by decreasing request count
+  static bool imageOrder( const Image& a, const Image& b ){ return a.count > b.count; };
+
+
+  /// Read the warm-up file
+  /** @param images list of images to fill in order of first appearance */
+  void parse( std::vector<Image>& images );
+
+  /// Parse a single request query string from a log file
+  /** @param query request query string
+      @param images list of images to update
+      @param index map from image name to position in our list
+   */
+  void parseRequest( const std::string& query, std::vector<Image>& images,
+		     std::map<std::string,unsigned int>& index );
+
+  /// Decode and cache a single tile, applying our rate limit
+  /** @return false if warm-up should stop */
+  bool warm( TileManager& tilemanager, int resolution, int tile );
+
+  /// Thread function
+  void run();
+
+
+ public:
+
+  /// Constructor
+  /** @param c tile cache
+      @param f warm-up file
+      @param r maximum number of tiles to decode per second
+      @param q JPEG quality
+      @param w watermark
+      @param cmd whether clients may start a warm-up with the WRM command
+   */
+  CacheWarmer( Cache* c, const std::string& f, unsigned int r, int q, Watermark* w, bool cmd ):
+    tileCache(c), watermark(w), file(f), rate(r), quality(q), command(cmd),
+    running(false), stopping(false), warmed(0), bytes(0), budget(0) {};
+
+  /// Destructor: stops any warm-up in progress
+  ~CacheWarmer(){ this->stop(); };
+
+  /// Start a warm-up in the background
+  /** @return false if no warm-up file has been configured or a warm-up is already running */
+  bool begin();
+
+  /// Stop any warm-up in progress and wait for it to finish
+  void stop();
+
+  /// Whether a warm-up is in progress
+  bool isRunning(){ ScopedLock lock( mutex ); return running; };
+
+  /// Return the number of tiles decoded during the current or last warm-up
+  unsigned int getTilesWarmed(){ return warmed; };
+
+  /// Return our warm-up file
+  const std::string& getFile(){ return file; };
+
+  /// Whether clients may start a warm-up with the WRM command
+  bool commandEnabled(){ return command; };
+
+};
+
+
+#endif
@@ -110,6 +110,7 @@ void DeepZoom::run( Session* session, const std::string& argument ){
 	      "Server: iipsrv/%s\r\n"
 	      "Content-Type: application/xml\r\n"
 	      "Last-Modified: %s\r\n"
+	      "%s"
 	      "%s\r\n"
 	      "\r\n"
 	      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
@@ -117,7 +118,7 @@ void DeepZoom::run( Session* session, const std::string& argument ){
 	      "TileSize=\"%d\" Overlap=\"0\" Format=\"jpg\">"
 	      "<Size Width=\"%d\" Height=\"%d\"/>"
 	      "</Image>",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), tw, width, height );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str(), tw, width, height );
 
     session->out->printf( (const char*) str );
     session->response->setImageSent();
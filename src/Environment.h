@@ -27,6 +27,10 @@
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
 #define MAX_IMAGE_CACHE_SIZE 10.0
+#define METADATA_CACHE_SIZE 1000
+#define METADATA_INDEX ""
+#define NEGATIVE_CACHE_SIZE 10000
+#define NEGATIVE_CACHE_TTL 60
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
 #define MAX_CVT 5000
@@ -41,17 +45,75 @@
 #define CORS "";
 #define BASE_URL "";
 #define CACHE_CONTROL "max-age=86400"; // 24 hours
+#define CACHE_SNAPSHOT ""
+#define CACHE_SNAPSHOT_UNCOMPRESSED 0
+#define PINNED_CACHE_SIZE 0.0
+#define PINNED_RESOLUTIONS 0
+#define CACHE_WARMUP ""
+#define CACHE_WARMUP_RATE 20
+#define CACHE_WARMUP_COMMAND 0
+#define STATS_COMMAND 0
+#define TIFF_CONVERSION_DIR ""
+#define WORKER_THREADS 1
+#define REGION_THREADS 1
+#define BULK_THREADS 0
+#define BULK_QUEUE_LIMIT 0
+#define REQUEST_TIMEOUT 0
+#define CONFIG_FILE ""
 
 
 #include <string>
+#include <map>
+#include <fstream>
 
 
 /// Class to obtain environment variables
+/** Those settings which can be reloaded while running may also be taken from a
+    configuration file, which overrides the environment without modifying it
+ */
 class Environment {
 
 
  public:
 
+  /// Settings read from a configuration file
+  typedef std::map<std::string,std::string> Config;
+
+
+ private:
+
+  /// Look up a variable in a configuration, if given, and otherwise in our environment
+  static const char* lookup( const char* name, const Config* config ){
+    if( config ){
+      Config::const_iterator i = config->find( name );
+      if( i != config->end() ) return i->second.c_str();
+    }
+    return getenv( name );
+  }
+
+
+ public:
+
+  /// Read a configuration file containing NAME=value lines
+  /** Blank lines and lines starting with # are ignored
+      @param path configuration file path
+      @param config configuration to fill in
+      @return false if the file could not be opened
+   */
+  static bool readConfig( const std::string& path, Config& config ){
+    std::ifstream file( path.c_str() );
+    if( !file ) return false;
+    std::string line;
+    while( std::getline( file, line ) ){
+      if( !line.empty() && line[line.length()-1] == '\r' ) line.erase( line.length()-1 );
+      size_t n = line.find( '=' );
+      if( line.empty() || line[0] == '#' || n == std::string::npos || n == 0 ) continue;
+      config[ line.substr( 0, n ) ] = line.substr( n+1 );
+    }
+    return true;
+  }
+
+
   static int getVerbosity(){
     int loglevel = VERBOSITY;
     char *envpara = getenv( "VERBOSITY" );
@@ -64,16 +126,16 @@ class Environment {
   }
 
 
-  static std::string getLogFile(){
-    char* envpara = getenv( "LOGFILE" );
+  static std::string getLogFile( const Config* config = NULL ){
+    const char* envpara = lookup( "LOGFILE", config );
     if( envpara ) return std::string( envpara );
     else return LOGFILE;
   }
 
 
-  static float getMaxImageCacheSize(){
+  static float getMaxImageCacheSize( const Config* config = NULL ){
     float max_image_cache_size = MAX_IMAGE_CACHE_SIZE;
-    char* envpara = getenv( "MAX_IMAGE_CACHE_SIZE" );
+    const char* envpara = lookup( "MAX_IMAGE_CACHE_SIZE", config );
     if( envpara ){
       max_image_cache_size = atof( envpara );
     }
@@ -81,6 +143,48 @@ class Environment {
   }
 
 
+  static unsigned int getMetadataCacheSize( const Config* config = NULL ){
+    int metadata_cache_size = METADATA_CACHE_SIZE;
+    const char* envpara = lookup( "METADATA_CACHE_SIZE", config );
+    if( envpara ){
+      metadata_cache_size = atoi( envpara );
+      if( metadata_cache_size < 0 ) metadata_cache_size = 0;
+    }
+    return (unsigned int) metadata_cache_size;
+  }
+
+
+  static unsigned int getNegativeCacheSize(){
+    int negative_cache_size = NEGATIVE_CACHE_SIZE;
+    char* envpara = getenv( "NEGATIVE_CACHE_SIZE" );
+    if( envpara ){
+      negative_cache_size = atoi( envpara );
+      if( negative_cache_size < 0 ) negative_cache_size = 0;
+    }
+    return (unsigned int) negative_cache_size;
+  }
+
+
+  static unsigned int getNegativeCacheTTL(){
+    int negative_cache_ttl = NEGATIVE_CACHE_TTL;
+    char* envpara = getenv( "NEGATIVE_CACHE_TTL" );
+    if( envpara ){
+      negative_cache_ttl = atoi( envpara );
+      if( negative_cache_ttl < 0 ) negative_cache_ttl = 0;
+    }
+    return (unsigned int) negative_cache_ttl;
+  }
+
+
+  static std::string getMetadataIndex(){
+    char* envpara = getenv( "METADATA_INDEX" );
+    std::string metadata_index;
+    if( envpara ) metadata_index = std::string( envpara );
+    else metadata_index = METADATA_INDEX;
+    return metadata_index;
+  }
+
+
   static std::string getFileNamePattern(){
     char* envpara = getenv( "FILENAME_PATTERN" );
     std::string filename_pattern;
@@ -93,8 +197,8 @@ class Environment {
   }
 
 
-  static int getJPEGQuality(){
-    char* envpara = getenv( "JPEG_QUALITY" );
+  static int getJPEGQuality( const Config* config = NULL ){
+    const char* envpara = lookup( "JPEG_QUALITY", config );
     int jpeg_quality;
     if( envpara ){
       jpeg_quality = atoi( envpara );
@@ -107,8 +211,8 @@ class Environment {
   }
 
 
-  static int getMaxCVT(){
-    char* envpara = getenv( "MAX_CVT" );
+  static int getMaxCVT( const Config* config = NULL ){
+    const char* envpara = lookup( "MAX_CVT", config );
     int max_CVT;
     if( envpara ){
       max_CVT = atoi( envpara );
@@ -120,8 +224,8 @@ class Environment {
   }
 
 
-  static int getMaxLayers(){
-    char* envpara = getenv( "MAX_LAYERS" );
+  static int getMaxLayers( const Config* config = NULL ){
+    const char* envpara = lookup( "MAX_LAYERS", config );
     int layers;
     if( envpara ) layers = atoi( envpara );
     else layers = MAX_LAYERS;
@@ -142,8 +246,8 @@ class Environment {
   }
 
 
-  static std::string getWatermark(){
-    char* envpara = getenv( "WATERMARK" );
+  static std::string getWatermark( const Config* config = NULL ){
+    const char* envpara = lookup( "WATERMARK", config );
     std::string watermark;
     if( envpara ){
       watermark = std::string( envpara );
@@ -154,9 +258,9 @@ class Environment {
   }
 
 
-  static float getWatermarkProbability(){
+  static float getWatermarkProbability( const Config* config = NULL ){
     float watermark_probability = WATERMARK_PROBABILITY;
-    char* envpara = getenv( "WATERMARK_PROBABILITY" );
+    const char* envpara = lookup( "WATERMARK_PROBABILITY", config );
 
     if( envpara ){
       watermark_probability = atof( envpara );
@@ -168,9 +272,9 @@ class Environment {
   }
 
 
-  static float getWatermarkOpacity(){
+  static float getWatermarkOpacity( const Config* config = NULL ){
     float watermark_opacity = WATERMARK_OPACITY;
-    char* envpara = getenv( "WATERMARK_OPACITY" );
+    const char* envpara = lookup( "WATERMARK_OPACITY", config );
 
     if( envpara ){
       watermark_opacity = atof( envpara );
@@ -214,8 +318,8 @@ class Environment {
   }
 
 
-  static std::string getCORS(){
-    char* envpara = getenv( "CORS" );
+  static std::string getCORS( const Config* config = NULL ){
+    const char* envpara = lookup( "CORS", config );
     std::string cors;
     if( envpara ) cors = std::string( envpara );
     else cors = CORS;
@@ -223,8 +327,8 @@ class Environment {
   }
 
 
-  static std::string getBaseURL(){
-    char* envpara = getenv( "BASE_URL" );
+  static std::string getBaseURL( const Config* config = NULL ){
+    const char* envpara = lookup( "BASE_URL", config );
     std::string base_url;
     if( envpara ) base_url = std::string( envpara );
     else base_url = BASE_URL;
@@ -232,14 +336,162 @@ class Environment {
   }
 
 
-  static std::string getCacheControl(){
-    char* envpara = getenv( "CACHE_CONTROL" );
+  static std::string getCacheControl( const Config* config = NULL ){
+    const char* envpara = lookup( "CACHE_CONTROL", config );
     std::string cache_control;
     if( envpara ) cache_control = std::string( envpara );
     else cache_control = CACHE_CONTROL;
     return cache_control;
   }
 
+
+  static std::string getCacheSnapshot(){
+    char* envpara = getenv( "CACHE_SNAPSHOT" );
+    std::string cache_snapshot;
+    if( envpara ) cache_snapshot = std::string( envpara );
+    else cache_snapshot = CACHE_SNAPSHOT;
+    return cache_snapshot;
+  }
+
+
+  static bool getCacheSnapshotUncompressed(){
+    char* envpara = getenv( "CACHE_SNAPSHOT_UNCOMPRESSED" );
+    int uncompressed;
+    if( envpara ) uncompressed = atoi( envpara );
+    else uncompressed = CACHE_SNAPSHOT_UNCOMPRESSED;
+    return ( uncompressed != 0 );
+  }
+
+
+  static float getPinnedCacheSize( const Config* config = NULL ){
+    float pinned_cache_size = PINNED_CACHE_SIZE;
+    const char* envpara = lookup( "PINNED_CACHE_SIZE", config );
+    if( envpara ){
+      pinned_cache_size = atof( envpara );
+      if( pinned_cache_size < 0 ) pinned_cache_size = 0;
+    }
+    return pinned_cache_size;
+  }
+
+
+  static int getPinnedResolutions(){
+    int pinned_resolutions = PINNED_RESOLUTIONS;
+    char* envpara = getenv( "PINNED_RESOLUTIONS" );
+    if( envpara ){
+      pinned_resolutions = atoi( envpara );
+      if( pinned_resolutions < 0 ) pinned_resolutions = 0;
+    }
+    return pinned_resolutions;
+  }
+
+
+  static std::string getCacheWarmup(){
+    char* envpara = getenv( "CACHE_WARMUP" );
+    std::string cache_warmup;
+    if( envpara ) cache_warmup = std::string( envpara );
+    else cache_warmup = CACHE_WARMUP;
+    return cache_warmup;
+  }
+
+
+  static bool getCacheWarmupCommand(){
+    char* envpara = getenv( "CACHE_WARMUP_COMMAND" );
+    int command;
+    if( envpara ) command = atoi( envpara );
+    else command = CACHE_WARMUP_COMMAND;
+    return ( command != 0 );
+  }
+
+
+  static bool getStatsCommand(){
+    char* envpara = getenv( "STATS_COMMAND" );
+    int command;
+    if( envpara ) command = atoi( envpara );
+    else command = STATS_COMMAND;
+    return ( command != 0 );
+  }
+
+
+  static unsigned int getCacheWarmupRate(){
+    int rate = CACHE_WARMUP_RATE;
+    char* envpara = getenv( "CACHE_WARMUP_RATE" );
+    if( envpara ){
+      rate = atoi( envpara );
+      if( rate < 0 ) rate = 0;
+    }
+    return (unsigned int) rate;
+  }
+
+
+  static std::string getTiffConversionDir(){
+    char* envpara = getenv( "TIFF_CONVERSION_DIR" );
+    std::string dir;
+    if( envpara ) dir = std::string( envpara );
+    else dir = TIFF_CONVERSION_DIR;
+    return dir;
+  }
+
+
+  static int getWorkerThreads(){
+    int threads = WORKER_THREADS;
+    char* envpara = getenv( "WORKER_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 1 ) threads = 1;
+    }
+    return threads;
+  }
+
+
+  static int getRegionThreads(){
+    int threads = REGION_THREADS;
+    char* envpara = getenv( "REGION_THREADS" );
+    if( envpara ){
+      threads = atoi( envpara );
+      if( threads < 1 ) threads = 1;
+    }
+    return threads;
+  }
+
+
+  static int getBulkThreads(){
+    int threads = BULK_THREADS;
+    char* envpara = getenv( "BULK_THREADS" );
+    if( envpara ) threads = atoi( envpara );
+    return threads;
+  }
+
+
+  static unsigned int getBulkQueueLimit(){
+    int limit = BULK_QUEUE_LIMIT;
+    char* envpara = getenv( "BULK_QUEUE_LIMIT" );
+    if( envpara ){
+      limit = atoi( envpara );
+      if( limit < 0 ) limit = 0;
+    }
+    return (unsigned int) limit;
+  }
+
+
+  static unsigned int getRequestTimeout(){
+    int timeout = REQUEST_TIMEOUT;
+    char* envpara = getenv( "REQUEST_TIMEOUT" );
+    if( envpara ){
+      timeout = atoi( envpara );
+      if( timeout < 0 ) timeout = 0;
+    }
+    return (unsigned int) timeout;
+  }
+
+
+  static std::string getConfigFile(){
+    char* envpara = getenv( "CONFIG_FILE" );
+    std::string config_file;
+    if( envpara ) config_file = std::string( envpara );
+    else config_file = CONFIG_FILE;
+    return config_file;
+  }
+
 };
 
 
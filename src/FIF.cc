@@ -20,8 +20,12 @@
 
 
 #include <algorithm>
+#include <sstream>
+#include <cerrno>
+#include <sys/stat.h>
 #include "Task.h"
 #include "URL.h"
+#include "Tokenizer.h"
 #include "Environment.h"
 #include "TPTImage.h"
 
@@ -29,7 +33,9 @@
 #include "KakaduImage.h"
 #endif
 
-#define MAXIMAGECACHE 1000  // Max number of items in image cache
+#ifdef HAVE_GLOB_H
+#include <glob.h>
+#endif
 
 
 
@@ -37,6 +43,104 @@ using namespace std;
 
 
 
+/// Return a strong entity tag for a request on an image with a given modification time
+/** As the same request gives a different response if our default JPEG quality or our
+    watermark are changed, for instance by a configuration reload, these are included.
+    So are our base URL and the host, scheme and URI of the request, from which the
+    IDs within IIIF info.json responses are generated
+ */
+static string getETag( Session* session, const string& request, time_t timestamp ){
+
+  stringstream settings;
+  settings << request << '\0' << session->jpeg->getQuality()
+	   << '\0' << session->headers["BASE_URL"] << '\0' << session->headers["HTTP_HOST"]
+	   << '\0' << session->headers["HTTPS"] << '\0' << session->headers["REQUEST_URI"];
+  if( session->watermark && session->watermark->isSet() ){
+    settings << '\0' << session->watermark->getImage() << '\0' << session->watermark->getOpacity()
+	     << '\0' << session->watermark->getProbability();
+  }
+  string data = settings.str();
+
+  // 64 bit FNV-1a hash of our request, which includes the image path and all view parameters,
+  // together with our settings
+  unsigned long long hash = 14695981039346656037ULL;
+  for( unsigned int i=0; i<data.length(); i++ ){
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  char tag[64];
+  snprintf( tag, 64, "\"%016llx-%lx\"", hash, (unsigned long) timestamp );
+  return string( tag );
+}
+
+
+
+/// Check whether an image definitely does not exist, either as a file or as an image sequence
+/** @param path image path including our file system prefix
+    @param pattern file name pattern of image sequences
+ */
+static bool imageMissing( const string& path, const string& pattern ){
+
+  struct stat sb;
+  if( stat( path.c_str(), &sb ) == 0 || errno != ENOENT ) return false;
+
+#ifdef HAVE_GLOB_H
+  // Sequence files are named after our path, so make sure that there are none
+  glob_t gdat;
+  string filename = path + pattern + "*_*.*";
+  int status = glob( filename.c_str(), 0, NULL, &gdat );
+  globfree( &gdat );
+  if( status != GLOB_NOMATCH ) return false;
+#endif
+
+  return true;
+}
+
+
+
+/// Check whether a conditional request can be answered with 304 Not Modified
+static bool notModified( Session* session, time_t timestamp, const string& etag ){
+
+  map<const string,string>::const_iterator header;
+
+  // If-None-Match takes precedence over If-Modified-Since. Tags are compared weakly
+  if( (header = session->headers.find("HTTP_IF_NONE_MATCH")) != session->headers.end() ){
+    Tokenizer izer( header->second, "," );
+    while( izer.hasMoreTokens() ){
+      string tag = izer.nextToken();
+      tag.erase( 0, tag.find_first_not_of( " \t" ) );
+      tag.erase( tag.find_last_not_of( " \t" ) + 1 );
+      if( tag.compare( 0, 2, "W/" ) == 0 ) tag.erase( 0, 2 );
+      if( tag == "*" || tag == etag ) return true;
+    }
+    return false;
+  }
+
+  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
+  if( (header = session->headers.find("HTTP_IF_MODIFIED_SINCE")) != session->headers.end() ){
+
+    tm mod_t;
+    time_t t;
+
+    strptime( header->second.c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t );
+
+    // Use POSIX cross-platform mktime() function to generate a timestamp.
+    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
+    t = mktime(&mod_t);
+    if( t == -1 ){
+      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Error creating timestamp" << endl;
+      return false;
+    }
+
+    return ( timestamp <= t );
+  }
+
+  return false;
+}
+
+
+
 void FIF::run( Session* session, const string& src ){
 
   if( session->loglevel >= 3 ) *(session->logfile) << "FIF handler reached" << endl;
@@ -75,58 +179,105 @@ void FIF::run( Session* session, const string& src ){
   time_t timestamp = 0;
 
 
+  // Reject images which have recently failed to open without touching the file system
+  NegativeCache::ErrorType error_type;
+  string error_message;
+  if( session->negativeCache && session->negativeCache->find( argument, error_type, error_message ) ){
+    if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Negative cache hit" << endl;
+    if( error_type == NegativeCache::FILE_ERROR ){
+      session->response->setError( "1 3", "FIF" );
+      throw file_error( error_message );
+    }
+    throw error_message;
+  }
+
+
+  // Whether our image has been found and is of a supported type
+  bool identified = false;
+
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
-    // Check whether cache is empty
-    if( session->imageCache->empty() ){
-      if( session->loglevel >= 1 ) *(session->logfile) << "FIF :: Image cache initialization" << endl;
+    // Look up our image in the cache. Cached images are shared between requests and
+    // threads, so we only take a reference to them rather than a copy
+    ImageCache::Reference cached = session->imageCache->find( argument );
+
+    // Rescan image sequences whose directory has changed since they were cached
+    if( !cached.empty() && cached->sequenceChanged() ){
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image sequence changed: rescanning" << endl;
+      cached = ImageCache::Reference();
+    }
+
+    // Cache Hit
+    if( !cached.empty() ){
+      timestamp = cached->timestamp;       // Record timestamp if we have a cached image
+      if( session->loglevel >= 2 ){
+	*(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
+      }
+    }
+    // Cache Miss
+    else{
+      if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
       test = IIPImage( argument );
       test.setFileNamePattern( filename_pattern );
       test.setFileSystemPrefix( filesystem_prefix );
-      test.Initialise();
+
+      // Take our metadata from our index if we have one, avoiding any file access
+      if( session->imageIndex && session->imageIndex->find( argument, test ) ){
+	timestamp = test.timestamp;
+	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image metadata found in index" << endl;
+      }
+      else test.Initialise();
     }
-    // If not, look up our object
-    else{
-      // Cache Hit
-      if( session->imageCache->find(argument) != session->imageCache->end() ){
-	test = (*session->imageCache)[ argument ];
-	timestamp = test.timestamp;       // Record timestamp if we have a cached image
+
+    const IIPImage& metadata = cached.empty() ? test : *cached;
+
+
+    // Answer conditional requests before opening our image. Images we have just
+    // initialised have an up to date timestamp, otherwise we need to check it
+    time_t modified = ( timestamp == 0 ) ? metadata.timestamp : metadata.getModificationTime();
+
+    if( modified > 0 ){
+      string etag = getETag( session, session->headers["QUERY_STRING"], modified );
+      session->response->setETag( etag );
+      if( notModified( session, modified, etag ) ){
 	if( session->loglevel >= 2 ){
-	  *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->size() << endl;
+	  *(session->logfile) << "FIF :: Unmodified content" << endl;
+	  *(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
 	}
-      }
-      // Cache Miss
-      else{
-	if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
-	test = IIPImage( argument );
-	test.setFileNamePattern( filename_pattern );
-	test.setFileSystemPrefix( filesystem_prefix );
-	test.Initialise();
-	// Delete items if our list of images is too long.
-	if( session->imageCache->size() >= MAXIMAGECACHE ) session->imageCache->erase( session->imageCache->begin() );
+	throw( 304 );
       }
     }
 
 
 
+
     /***************************************************************
       Test for different image types - only TIFF is native for now
     ***************************************************************/
 
-    ImageFormat format = test.getImageFormat();
+    ImageFormat format = metadata.getImageFormat();
 
     if( format == TIF ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: TIFF image detected" << endl;
-      *session->image = new TPTImage( test );
+      TPTImage* tpt = new TPTImage( metadata );
+      tpt->setConverter( session->tiffConverter );
+      *session->image = tpt;
     }
 #ifdef HAVE_KAKADU
     else if( format == JPEG2000 ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: JPEG2000 image detected" << endl;
-      *session->image = new KakaduImage( test );
+      *session->image = new KakaduImage( metadata );
     }
 #endif
-    else throw string( "Unsupported image type: " + argument );
+    else{
+      // This will not change unless the file itself does, so remember it
+      string error = "Unsupported image type: " + argument;
+      if( session->negativeCache ) session->negativeCache->insert( argument, NegativeCache::OTHER_ERROR, error );
+      throw error;
+    }
+
+    identified = true;
 
     /* Disable module loading for now!
     else{
@@ -167,15 +318,20 @@ void FIF::run( Session* session, const string& src ){
     (*session->image)->openImage();
 
     // Check timestamp consistency. If cached timestamp is older, update metadata
+    bool updated = false;
     if( timestamp>0 && (timestamp < (*session->image)->timestamp) ){
       if( session->loglevel >= 2 ){
 	*(session->logfile) << "FIF :: Image timestamp changed: reloading metadata" << endl;
       }
+      (*session->image)->image_widths.clear();
+      (*session->image)->image_heights.clear();
       (*session->image)->loadImageInfo( (*session->image)->currentX, (*session->image)->currentY );
+      updated = true;
     }
 
-    // Add this image to our cache, overwriting previous version if it exists
-    (*session->imageCache)[argument] = *(*session->image);
+    // Add new or updated images to our cache. Cached entries are never modified,
+    // so an updated image replaces its previous entry
+    if( cached.empty() || updated ) session->imageCache->insert( argument, *(*session->image) );
 
     if( session->loglevel >= 3 ){
       *(session->logfile) << "FIF :: Created image" << endl;
@@ -199,39 +355,18 @@ void FIF::run( Session* session, const string& src ){
 
   }
   catch( const file_error& error ){
+    // Only remember images which do not exist, neither as a file nor as a sequence. Other
+    // errors, such as permissions, running out of file descriptors or damaged files, may
+    // well be transient
+    if( session->negativeCache && !identified && imageMissing( filesystem_prefix + argument, filename_pattern ) ){
+      session->negativeCache->insert( argument, NegativeCache::FILE_ERROR, error.what() );
+    }
     // Unavailable file error code is 1 3
     session->response->setError( "1 3", "FIF" );
     throw error;
   }
 
 
-  // Check whether we have had an if_modified_since header. If so, compare to our image timestamp
-  if( session->headers.find("HTTP_IF_MODIFIED_SINCE") != session->headers.end() ){
-
-    tm mod_t;
-    time_t t;
-
-    strptime( (session->headers)["HTTP_IF_MODIFIED_SINCE"].c_str(), "%a, %d %b %Y %H:%M:%S %Z", &mod_t );
-
-    // Use POSIX cross-platform mktime() function to generate a timestamp.
-    // This needs UTC, but to avoid a slow TZ environment reset for each request, we set this once globally in Main.cc
-    t = mktime(&mod_t);
-    if( (session->loglevel >= 1) && (t == -1) ) *(session->logfile) << "FIF :: Error creating timestamp" << endl;
-
-    if( (*session->image)->timestamp <= t ){
-      if( session->loglevel >= 2 ){
-	*(session->logfile) << "FIF :: Unmodified content" << endl;
-	*(session->logfile) << "FIF :: Total command time " << command_timer.getTime() << " microseconds" << endl;
-      }
-      throw( 304 );
-    }
-    else{
-      if( session->loglevel >= 2 ){
-	*(session->logfile) << "FIF :: Content modified since requested time" << endl;
-      }
-    }
-  }
-
   // Reset our angle values
   session->view->xangle = 0;
   session->view->yangle = 90;
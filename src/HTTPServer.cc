@@ -0,0 +1,600 @@
+/*
+    IIP Embedded HTTP/1.1 Server Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "HTTPServer.h"
+
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <ctime>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+
+
+// Not all platforms allow us to suppress SIGPIPE on each call
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+using namespace std;
+
+
+
+/// Protocols which may be given as the first path component instead of in the query string
+static const char* protocols[] = { "iiif", "deepzoom", "zoomify" };
+
+
+
+/// Convert a string to lower case
+static string lower( string s ){
+  transform( s.begin(), s.end(), s.begin(), ::tolower );
+  return s;
+}
+
+
+/// Remove leading and trailing white space
+static string trim( const string& s ){
+  size_t a = s.find_first_not_of( " \t" );
+  if( a == string::npos ) return string();
+  size_t b = s.find_last_not_of( " \t\r" );
+  return s.substr( a, b-a+1 );
+}
+
+
+/// Send a complete buffer list, retrying after partial writes
+static bool sendAll( int socket, struct iovec* iov, int n ){
+
+  while( n > 0 ){
+
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    ssize_t sent = sendmsg( socket, &msg, MSG_NOSIGNAL );
+    if( sent < 0 ){
+      if( errno == EINTR ) continue;
+      return false;
+    }
+
+    // Skip over whatever has been sent
+    while( n > 0 && (size_t) sent >= iov->iov_len ){
+      sent -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if( n > 0 ){
+      iov->iov_base = (char*) iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+
+  return true;
+}
+
+
+
+
+HTTPWriter::HTTPWriter( int s, bool h, bool k, bool c ){
+  socket = s;
+  head = h;
+  keepalive = k;
+  chunked = c;
+  parsed = nobody = started = failed = false;
+  discarded = 0;
+  bufsize = 65536;
+  buffer = (char*) malloc( bufsize );
+  sz = 0;
+  if( !buffer ) failed = true;
+  recorded = NULL;
+  rsz = rbufsize = 0;
+  capturing = false;
+}
+
+
+
+HTTPWriter::~HTTPWriter(){
+  if( buffer ) free( buffer );
+  if( recorded ) free( recorded );
+}
+
+
+
+bool HTTPWriter::append( char*& b, size_t& size, size_t& capacity, const char* msg, size_t len ){
+  if( size+len > capacity ){
+    // Grow geometrically to avoid a reallocation for each write
+    if( capacity == 0 ) capacity = 65536;
+    while( size+len > capacity ) capacity *= 2;
+    char* n = (char*) realloc( b, capacity );
+    if( !n ) return false;
+    b = n;
+  }
+  memcpy( &b[size], msg, len );
+  size += len;
+  return true;
+}
+
+
+
+void HTTPWriter::capture(){
+  if( capturing || recorded ) return;
+  rbufsize = 65536;
+  recorded = (char*) malloc( rbufsize );
+  capturing = ( recorded != NULL );
+}
+
+
+
+void HTTPWriter::parse( bool end ){
+
+  // Find the end of our CGI headers
+  size_t n = std::min( sz, (size_t) HTTP_MAX_HEADER );
+  string data( buffer, n );
+  size_t last = data.find( "\r\n\r\n" );
+  size_t skip = 4;
+  size_t alt = data.find( "\n\n" );
+  if( last == string::npos || ( alt != string::npos && alt < last ) ){
+    last = alt;
+    skip = 2;
+  }
+
+  // Wait for the rest of our headers unless there cannot be any
+  if( last == string::npos && !end && sz <= HTTP_MAX_HEADER ) return;
+
+  string status = "200 OK";
+  stringstream lines;
+  size_t body = 0;
+
+  if( last != string::npos ){
+    body = last + skip;
+    stringstream cgi( data.substr( 0, last ) );
+    string line;
+    while( getline( cgi, line ) ){
+      line = trim( line );
+      if( line.empty() ) continue;
+      size_t colon = line.find( ':' );
+      if( colon == string::npos ) continue;
+      string name = lower( line.substr( 0, colon ) );
+      // The Status header becomes our status line and we set the framing headers ourselves
+      if( name == "status" ) status = trim( line.substr( colon+1 ) );
+      else if( name != "content-length" && name != "connection" && name != "transfer-encoding" ){
+	lines << line << "\r\n";
+      }
+    }
+  }
+  else lines << "Content-Type: text/plain\r\n";
+
+  header = "HTTP/1.1 " + status + "\r\n" + lines.str();
+
+  // Responses with these status codes never have a body
+  int code = atoi( status.c_str() );
+  nobody = ( code == 304 || code == 204 || (code >= 100 && code < 200) );
+
+  // Keep only the start of our body
+  sz -= body;
+  memmove( buffer, &buffer[body], sz );
+  parsed = true;
+
+  if( head || nobody ){
+    discarded = sz;
+    sz = 0;
+  }
+}
+
+
+
+bool HTTPWriter::send( const char* msg, size_t len ){
+
+  if( failed ) return false;
+
+  // Our status line and headers go out with our first chunk
+  if( !started ){
+    started = true;
+    if( chunked ) header += "Transfer-Encoding: chunked\r\n";
+    else keepalive = false;
+    header += string( "Connection: " ) + ( keepalive ? "keep-alive" : "close" ) + "\r\n\r\n";
+  }
+  else header.clear();
+
+  char size[32];
+  snprintf( size, sizeof(size), "%lx\r\n", (unsigned long)( sz + len ) );
+
+  struct iovec iov[5];
+  int n = 0;
+  if( !header.empty() ){
+    iov[n].iov_base = (void*) header.data();
+    iov[n++].iov_len = header.length();
+  }
+  if( chunked ){
+    iov[n].iov_base = (void*) size;
+    iov[n++].iov_len = strlen( size );
+  }
+  if( sz > 0 ){
+    iov[n].iov_base = (void*) buffer;
+    iov[n++].iov_len = sz;
+  }
+  if( len > 0 ){
+    iov[n].iov_base = (void*) msg;
+    iov[n++].iov_len = len;
+  }
+  if( chunked ){
+    iov[n].iov_base = (void*) "\r\n";
+    iov[n++].iov_len = 2;
+  }
+
+  sz = 0;
+  if( !sendAll( socket, iov, n ) ) failed = true;
+  return !failed;
+}
+
+
+
+void HTTPWriter::write( const char* msg, size_t len ){
+
+  if( capturing ){
+    if( rsz+len > WRITER_CAPTURE_LIMIT || !append( recorded, rsz, rbufsize, msg, len ) ){
+      // Too large to be stored, so stop recording
+      free( recorded );
+      recorded = NULL;
+      capturing = false;
+    }
+  }
+
+  if( failed || len == 0 ) return;
+
+  if( !parsed ){
+    if( !append( buffer, sz, bufsize, msg, len ) ){
+      failed = true;
+      return;
+    }
+    this->parse( false );
+    // Stream whatever follows our headers if there is already too much to hold back
+    if( parsed && sz > HTTP_CHUNK_SIZE ) this->send( NULL, 0 );
+    return;
+  }
+
+  if( head || nobody ){
+    discarded += len;
+    return;
+  }
+
+  // Send large writes straight from the caller's data together with anything buffered
+  if( sz+len > HTTP_CHUNK_SIZE ){
+    this->send( msg, len );
+    return;
+  }
+
+  if( !append( buffer, sz, bufsize, msg, len ) ) failed = true;
+}
+
+
+
+int HTTPWriter::flush(){
+  if( failed ) return -1;
+  if( started && sz > 0 && !this->send( NULL, 0 ) ) return -1;
+  return 0;
+}
+
+
+
+bool HTTPWriter::finish(){
+
+  if( failed ) return false;
+  if( !parsed ) this->parse( true );
+
+  // The whole of our response is buffered, so we can give its length
+  if( !started ){
+    string start = header;
+    if( !nobody ){
+      stringstream length;
+      length << "Content-Length: " << ( head ? discarded : sz ) << "\r\n";
+      start += length.str();
+    }
+    start += string( "Connection: " ) + ( keepalive ? "keep-alive" : "close" ) + "\r\n\r\n";
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void*) start.data();
+    iov[0].iov_len = start.length();
+    iov[1].iov_base = (void*) buffer;
+    iov[1].iov_len = sz;
+    return sendAll( socket, iov, sz ? 2 : 1 );
+  }
+
+  // Send our last chunk and the terminating empty chunk
+  if( sz > 0 && !this->send( NULL, 0 ) ) return false;
+  if( chunked ){
+    struct iovec iov;
+    iov.iov_base = (void*) "0\r\n\r\n";
+    iov.iov_len = 5;
+    if( !sendAll( socket, &iov, 1 ) ) return false;
+  }
+
+  return keepalive;
+}
+
+
+
+
+bool HTTPRequest::keepAlive(){
+  string connection = lower( headers["connection"] );
+  if( protocol == "HTTP/1.0" ) return connection == "keep-alive";
+  return connection != "close";
+}
+
+
+
+char** HTTPRequest::getEnvironment(){
+
+  string path = target, query;
+  size_t q = target.find( '?' );
+  if( q != string::npos ){
+    path = target.substr( 0, q );
+    query = target.substr( q+1 );
+  }
+
+  // Allow our protocols to be given as a path, such as /iiif/image.tif/info.json
+  if( query.empty() ){
+    for( unsigned int i=0; i<sizeof(protocols)/sizeof(char*); i++ ){
+      string prefix = string( "/" ) + protocols[i] + "/";
+      if( path.compare( 0, prefix.length(), prefix ) == 0 ){
+	query = string( protocols[i] ) + "=" + path.substr( prefix.length() );
+	break;
+      }
+    }
+  }
+
+  parameters.clear();
+  parameters.push_back( "QUERY_STRING=" + query );
+  parameters.push_back( "REQUEST_URI=" + target );
+  parameters.push_back( "REQUEST_METHOD=" + method );
+  parameters.push_back( "SERVER_PROTOCOL=" + protocol );
+
+  // Pass on our headers as CGI variables
+  for( map<string,string>::const_iterator h = headers.begin(); h != headers.end(); ++h ){
+    string name = "HTTP_" + h->first;
+    transform( name.begin(), name.end(), name.begin(), ::toupper );
+    replace( name.begin(), name.end(), '-', '_' );
+    parameters.push_back( name + "=" + h->second );
+  }
+
+  environment.clear();
+  for( vector<string>::iterator p = parameters.begin(); p != parameters.end(); ++p ){
+    environment.push_back( &(*p)[0] );
+  }
+  environment.push_back( NULL );
+
+  return &environment[0];
+}
+
+
+
+
+HTTPConnection::HTTPConnection( int s, unsigned int t ){
+
+  socket = s;
+  timeout = t;
+
+  // Send small responses such as tiles immediately
+  int one = 1;
+  setsockopt( socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+#ifdef SO_NOSIGPIPE
+  setsockopt( socket, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one) );
+#endif
+}
+
+
+
+HTTPConnection::~HTTPConnection(){
+  close( socket );
+}
+
+
+
+void HTTPConnection::error( const string& status ){
+  string response = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  struct iovec iov;
+  iov.iov_base = (void*) response.data();
+  iov.iov_len = response.length();
+  sendAll( socket, &iov, 1 );
+}
+
+
+
+bool HTTPConnection::skip( size_t length, time_t deadline ){
+
+  while( true ){
+
+    size_t n = ( input.length() < length ) ? input.length() : length;
+    input.erase( 0, n );
+    length -= n;
+    if( length == 0 ) return true;
+
+    time_t now = time( NULL );
+    if( now >= deadline ) return false;
+
+    struct pollfd fds;
+    fds.fd = socket;
+    fds.events = POLLIN;
+    fds.revents = 0;
+    int ready = poll( &fds, 1, 1000 * ( deadline - now ) );
+    if( ready < 0 && errno == EINTR ) continue;
+    if( ready <= 0 ) continue;
+
+    char buf[8192];
+    ssize_t r = recv( socket, buf, sizeof(buf), 0 );
+    if( r < 0 && (errno == EINTR || errno == EAGAIN) ) continue;
+    if( r <= 0 ) return false;
+    input.append( buf, r );
+  }
+}
+
+
+
+bool HTTPConnection::read( HTTPRequest& request, int listener ){
+
+  // Read until we have a complete set of headers. Anything after these belongs
+  // to the next pipelined request and is kept for the next call.
+  // The whole request must arrive within our deadline, which starts with its first byte
+  time_t deadline = input.empty() ? 0 : time( NULL ) + HTTP_HEADER_TIMEOUT;
+  time_t idle = time( NULL ) + timeout;
+  size_t end;
+  while( (end = input.find( "\r\n\r\n" )) == string::npos ){
+
+    if( input.length() > HTTP_MAX_HEADER ){
+      this->error( "431 Request Header Fields Too Large" );
+      return false;
+    }
+
+    time_t now = time( NULL );
+    if( deadline && now >= deadline ){
+      this->error( "408 Request Timeout" );
+      return false;
+    }
+    if( !deadline && now >= idle ) return false;
+
+    // While idle, also watch for other clients waiting to connect
+    struct pollfd fds[2];
+    fds[0].fd = socket;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = listener;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    int nfds = ( !deadline && listener >= 0 ) ? 2 : 1;
+
+    int ready = poll( fds, nfds, 1000 * ( (deadline ? deadline : idle) - now ) );
+    if( ready < 0 && errno == EINTR ) continue;
+    if( ready < 0 ) return false;
+    if( ready == 0 ) continue;
+    if( !(fds[0].revents & (POLLIN|POLLHUP|POLLERR)) ){
+      // Hand our worker over to a waiting client
+      if( fds[1].revents & POLLIN ) return false;
+      continue;
+    }
+
+    char buf[8192];
+    ssize_t n = recv( socket, buf, sizeof(buf), 0 );
+    if( n < 0 && (errno == EINTR || errno == EAGAIN) ) continue;
+    if( n <= 0 ) return false;
+    input.append( buf, n );
+    if( !deadline ) deadline = time( NULL ) + HTTP_HEADER_TIMEOUT;
+  }
+
+  string head = input.substr( 0, end );
+  input.erase( 0, end+4 );
+
+  request.headers.clear();
+  stringstream lines( head );
+  string line;
+
+  // Request line
+  getline( lines, line );
+  stringstream requestline( trim( line ) );
+  requestline >> request.method >> request.target >> request.protocol;
+  if( request.target.empty() || request.protocol.compare( 0, 5, "HTTP/" ) != 0 ){
+    this->error( "400 Bad Request" );
+    return false;
+  }
+
+  while( getline( lines, line ) ){
+    size_t colon = line.find( ':' );
+    if( colon == string::npos ) continue;
+    request.headers[ lower( trim( line.substr( 0, colon ) ) ) ] = trim( line.substr( colon+1 ) );
+  }
+
+  // We only serve images and metadata, so do not accept request bodies
+  if( request.method != "GET" && request.method != "HEAD" ){
+    this->error( "501 Not Implemented" );
+    return false;
+  }
+
+  // Any body must be read past to reach the next pipelined request. We have no use for
+  // bodies, so only accept small ones of a given length, which we discard
+  map<string,string>::const_iterator header = request.headers.find( "transfer-encoding" );
+  if( header != request.headers.end() && lower( header->second ) != "identity" ){
+    this->error( "501 Not Implemented" );
+    return false;
+  }
+  if( (header = request.headers.find( "content-length" )) != request.headers.end() ){
+    const string& value = header->second;
+    unsigned long length = strtoul( value.c_str(), NULL, 10 );
+    if( value.empty() || value.find_first_not_of( "0123456789" ) != string::npos ){
+      this->error( "400 Bad Request" );
+      return false;
+    }
+    if( length > HTTP_MAX_BODY ){
+      this->error( "413 Content Too Large" );
+      return false;
+    }
+    if( !this->skip( length, deadline ) ){
+      this->error( "408 Request Timeout" );
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+
+int HTTPConnection::listen( const string& address, int backlog ){
+
+  string host, port = address;
+  size_t colon = address.rfind( ':' );
+  if( colon != string::npos ){
+    host = address.substr( 0, colon );
+    port = address.substr( colon+1 );
+  }
+
+  struct addrinfo hints, *result;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result ) != 0 ) return -1;
+
+  int s = -1;
+  for( struct addrinfo* a = result; a; a = a->ai_next ){
+    s = ::socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+    if( s < 0 ) continue;
+    int one = 1;
+    setsockopt( s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if( bind( s, a->ai_addr, a->ai_addrlen ) == 0 && ::listen( s, backlog ) == 0 ) break;
+    close( s );
+    s = -1;
+  }
+
+  freeaddrinfo( result );
+  return s;
+}
@@ -0,0 +1,250 @@
+// Embedded HTTP/1.1 Server Classes
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <ctime>
+
+#include "Writer.h"
+
+
+/// Number of seconds an idle persistent connection is kept open
+#define HTTP_KEEPALIVE_TIMEOUT 5
+
+/// Maximum size in bytes of the request line and headers of a single request
+#define HTTP_MAX_HEADER 65536
+
+/// Number of seconds allowed to receive the request line and headers once a request has begun
+#define HTTP_HEADER_TIMEOUT 10
+
+/// Maximum size in bytes of a request body, which we read and discard
+#define HTTP_MAX_BODY 65536
+
+/// Number of milliseconds to wait before accepting again when out of file descriptors or memory
+#define HTTP_ACCEPT_BACKOFF 100
+
+
+
+/// Size in bytes beyond which a response is streamed to the client in chunks
+#define HTTP_CHUNK_SIZE 65536
+
+
+
+/// Writer which sends a CGI-style response as an HTTP/1.1 response
+/** Tasks write their responses exactly as they do for FastCGI, with a block of
+    CGI headers including an optional Status header. Responses of up to
+    HTTP_CHUNK_SIZE bytes are buffered and sent by finish() with a Content-Length
+    header. Beyond this, the response is streamed with chunked transfer encoding,
+    each flush or full buffer being sent straight away as a single chunk, so that
+    memory use is bounded whatever the size of the response. HTTP/1.0 clients,
+    which do not support chunked encoding, instead have their connection closed
+    at the end of a streamed response.
+ */
+class HTTPWriter : public Writer {
+
+ private:
+
+  /// Client socket
+  int socket;
+
+  /// Whether this is a reply to a HEAD request, in which case no body is sent
+  bool head;
+
+  /// Whether the connection is to be kept open after this response
+  bool keepalive;
+
+  /// Whether the client accepts chunked transfer encoding
+  bool chunked;
+
+  /// Whether our CGI headers have been parsed, whether our response has no body
+  /// and whether our status line and headers have been sent
+  bool parsed, nobody, started;
+
+  /// Whether sending has failed
+  bool failed;
+
+  /// Status line and headers, without the framing headers
+  std::string header;
+
+  /// Length of a body which is not sent
+  size_t discarded;
+
+  /// Data not yet sent: the CGI headers until these are parsed, then the body
+  char* buffer;
+  size_t sz, bufsize;
+
+  /// Recorded output
+  char* recorded;
+  size_t rsz, rbufsize;
+
+  /// Whether we are recording our output
+  bool capturing;
+
+  /// Add data to a buffer, growing it as needed
+  /** @return false if memory could not be allocated */
+  static bool append( char*& b, size_t& size, size_t& capacity, const char* msg, size_t len );
+
+  /// Parse our CGI headers into our status line and headers once they are complete
+  /** @param end whether the response is complete, in which case all remaining data
+      is treated as body if no headers are found
+   */
+  void parse( bool end );
+
+  /// Send our buffered data followed by the given data as a single chunk, after our headers if not yet sent
+  bool send( const char* msg, size_t len );
+
+  /// Write out the given data
+  void write( const char* msg, size_t len );
+
+
+ public:
+
+  /// Constructor
+  /** @param s client socket
+      @param h whether this is a reply to a HEAD request
+      @param k whether the connection is to be kept open after this response
+      @param c whether the client accepts chunked transfer encoding
+   */
+  HTTPWriter( int s, bool h, bool k, bool c );
+
+  /// Destructor
+  ~HTTPWriter();
+
+  int putStr( const char* msg, int len ){ this->write( msg, len ); return len; };
+  int putS( const char* msg ){ size_t len = strlen( msg ); this->write( msg, len ); return len; };
+  int printf( const char* msg ){ size_t len = strlen( msg ); this->write( msg, len ); return len; };
+
+  /// Send any buffered data once we have started streaming our response
+  /** Before then, data is held back so that small responses can be sent with a Content-Length */
+  int flush();
+
+  /// Start recording our output, up to WRITER_CAPTURE_LIMIT bytes
+  void capture();
+
+  const char* getOutput( size_t& len ){
+    len = capturing ? rsz : 0;
+    return capturing ? recorded : NULL;
+  };
+
+  /// Send the rest of our response
+  /** @return false if the response could not be sent or the connection must be closed */
+  bool finish();
+
+};
+
+
+
+/// A single HTTP request
+struct HTTPRequest {
+
+  /// Request method, target and protocol version
+  std::string method, target, protocol;
+
+  /// Request headers with lower case names
+  std::map < std::string, std::string > headers;
+
+  /// CGI style parameters in NAME=value form
+  std::vector < std::string > parameters;
+
+  /// NULL terminated list of pointers into our parameters
+  std::vector < char* > environment;
+
+  /// Whether the client wants the connection to be kept open
+  bool keepAlive();
+
+  /// Return our request as a list of CGI parameters which can be used with FCGX_GetParam
+  char** getEnvironment();
+
+};
+
+
+
+/// A persistent connection to an HTTP client
+/** Requests are read one at a time, so that pipelined requests are answered in order.
+    A connection is closed if it stays idle for longer than its timeout or if a
+    request takes longer than HTTP_HEADER_TIMEOUT seconds to arrive, so that slow
+    clients cannot hold on to a worker indefinitely.
+ */
+class HTTPConnection {
+
+ private:
+
+  /// Client socket
+  int socket;
+
+  /// Number of seconds to wait for a request before closing the connection
+  unsigned int timeout;
+
+  /// Data received but not yet parsed
+  std::string input;
+
+  /// Send a short error response
+  void error( const std::string& status );
+
+  /// Read and discard a request body
+  /** @param length length of the body in bytes
+      @param deadline time by which the whole body must have arrived
+      @return false if the body did not arrive in time or the connection was closed
+   */
+  bool skip( size_t length, time_t deadline );
+
+
+ public:
+
+  /// Constructor
+  /** @param s client socket, which is closed on destruction
+      @param timeout number of seconds to wait for a request before closing the connection
+   */
+  HTTPConnection( int s, unsigned int timeout );
+
+  /// Destructor
+  ~HTTPConnection();
+
+  /// Read the next request
+  /** @param request request to fill in
+      @param listener listening socket to watch while the connection is idle: if other
+      clients are waiting to connect, the idle connection is closed so that they can be
+      served. Use -1 to wait for the full timeout
+      @return false if the connection has been closed or the request is invalid
+   */
+  bool read( HTTPRequest& request, int listener = -1 );
+
+  /// Return our socket
+  int getSocket(){ return socket; };
+
+  /// Open a TCP socket on which to listen for HTTP connections
+  /** @param address port number or host:port
+      @param backlog socket backlog
+      @return socket or -1 on error
+   */
+  static int listen( const std::string& address, int backlog );
+
+};
+
+
+#endif
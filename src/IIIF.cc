@@ -226,6 +226,7 @@ void IIIF::run( Session* session, const string& src ){
     header << "Server: iipsrv/" << VERSION << eof
 	   << "Content-Type: application/ld+json" << eof
 	   << "Last-Modified: " << (*session->image)->getTimestamp() << eof
+	   << session->response->getETag()
 	   << session->response->getCacheControl() << eof;
 
     if( !cors.empty() ) header << cors << eof;
@@ -48,6 +48,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
   std::swap( first.imagePath, second.imagePath );
   std::swap( first.isFile, second.isFile );
   std::swap( first.suffix, second.suffix );
+  std::swap( first.directoryTimestamp, second.directoryTimestamp );
   std::swap( first.virtual_levels, second.virtual_levels );
   std::swap( first.format, second.format );
   std::swap( first.fileSystemPrefix, second.fileSystemPrefix );
@@ -138,33 +139,8 @@ void IIPImage::testImageType() throw(file_error)
 #ifdef HAVE_GLOB_H
 
     // Check for sequence
-    glob_t gdat;
-    string filename = path + fileNamePattern + "000_090.*";
-
-    if( glob( filename.c_str(), 0, NULL, &gdat ) != 0 ){
-      globfree( &gdat );
-      string message = path + string( " is neither a file nor part of an image sequence" );
-      throw file_error( message );
-    }
-    if( gdat.gl_pathc != 1 ){
-      globfree( &gdat );
-      string message = string( "There are multiple file extensions matching " )  + filename;
-      throw file_error( message );
-    }
-
-    string tmp( gdat.gl_pathv[0] );
-    globfree( &gdat );
-
+    string tmp = measureSequence();
     isFile = false;
-
-    int dot = tmp.find_last_of( "." );
-    int len = tmp.length();
-
-    suffix = tmp.substr( dot + 1, len );
-    if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" ) format = JPEG2000;
-    else if( suffix == "tif" || suffix == "tiff" ) format = TIF;
-    else format = UNSUPPORTED;
-
     updateTimestamp( tmp );
 
 #else
@@ -192,6 +168,18 @@ void IIPImage::updateTimestamp( const string& path ) throw(file_error)
 
 
 
+time_t IIPImage::getModificationTime() const
+{
+  string path = fileSystemPrefix + imagePath;
+  if( !isFile ) path += fileNamePattern + "000_090." + suffix;
+
+  struct stat sb;
+  if( stat( path.c_str(), &sb ) == -1 ) return 0;
+  return sb.st_mtime;
+}
+
+
+
 const std::string IIPImage::getTimestamp()
 {
   tm *t;
@@ -205,75 +193,100 @@ const std::string IIPImage::getTimestamp()
 
 
 
-void IIPImage::measureVerticalAngles()
+time_t IIPImage::getDirectoryTimestamp() const
 {
-  verticalAnglesList.clear();
-
-#ifdef HAVE_GLOB_H
-
-  glob_t gdat;
-  unsigned int i;
-
-  string filename = fileSystemPrefix + imagePath + fileNamePattern + "000_*." + suffix;
-  
-  if( glob( filename.c_str(), 0, NULL, &gdat ) != 0 ){
-    globfree( &gdat );
-  }
-
-  for( i=0; i < gdat.gl_pathc; i++ ){
-
-    // Extract angle no from path name.
-    int angle;
-    string tmp( gdat.gl_pathv[i] );
-    int len = tmp.length() - suffix.length() - 1;
-    string sequence_no = tmp.substr( len-3, 3 );
-    istringstream(sequence_no) >> angle;
-    verticalAnglesList.push_front( angle );
-  }
-
-  verticalAnglesList.sort();
-
-  globfree( &gdat );
-
-#endif
+  string path = fileSystemPrefix + imagePath + fileNamePattern;
+  size_t n = path.find_last_of( '/' );
+  string directory = ( n == string::npos ) ? "." : path.substr( 0, n+1 );
 
+  struct stat sb;
+  if( stat( directory.c_str(), &sb ) == -1 ) return 0;
+  return sb.st_mtime;
 }
 
 
 
-void IIPImage::measureHorizontalAngles()
+string IIPImage::measureSequence() throw(file_error)
 {
+  string base = fileSystemPrefix + imagePath + fileNamePattern;
+  string first;
+
   horizontalAnglesList.clear();
+  verticalAnglesList.clear();
 
 #ifdef HAVE_GLOB_H
 
+  // Take our directory timestamp before scanning, so that any later change is detected
+  directoryTimestamp = getDirectoryTimestamp();
+
   glob_t gdat;
   unsigned int i;
 
-  string filename = fileSystemPrefix + imagePath + fileNamePattern + "*_090." + suffix;
+  string filename = base + "*_*.*";
 
   if( glob( filename.c_str(), 0, NULL, &gdat ) != 0 ){
     globfree( &gdat );
+    string message = fileSystemPrefix + imagePath + string( " is neither a file nor part of an image sequence" );
+    throw file_error( message );
   }
 
+  // Our suffix is that of the file of our first view
+  string pattern = base + "000_090.";
+  for( i=0; i < gdat.gl_pathc; i++ ){
+    string tmp( gdat.gl_pathv[i] );
+    if( tmp.compare( 0, pattern.length(), pattern ) == 0 && tmp.find( '.', pattern.length() ) == string::npos ){
+      if( !first.empty() ){
+	globfree( &gdat );
+	string message = string( "There are multiple file extensions matching " ) + pattern + "*";
+	throw file_error( message );
+      }
+      first = tmp;
+    }
+  }
+
+  if( first.empty() ){
+    globfree( &gdat );
+    string message = fileSystemPrefix + imagePath + string( " is neither a file nor part of an image sequence" );
+    throw file_error( message );
+  }
+
+  suffix = first.substr( pattern.length() );
+  if( suffix == "jp2" || suffix == "jpx" || suffix == "j2k" ) format = JPEG2000;
+  else if( suffix == "tif" || suffix == "tiff" ) format = TIF;
+  else format = UNSUPPORTED;
+
+  // Horizontal angles are those with a vertical angle of 90 and vertical angles
+  // those with a horizontal angle of 0
   for( i=0; i < gdat.gl_pathc; i++ ){
 
-    // Extract angle no from path name.
-    int angle;
     string tmp( gdat.gl_pathv[i] );
-    int start = string(fileSystemPrefix + imagePath + fileNamePattern).length();
-    int end = tmp.find_last_of("_");
-    string n = tmp.substr( start, end-start );
-    istringstream(n) >> angle;
-    horizontalAnglesList.push_front( angle );
+    int len = tmp.length() - suffix.length() - 1;
+    if( len <= (int) base.length() || tmp.compare( len, string::npos, "." + suffix ) != 0 ) continue;
+
+    // Extract angle numbers from path name
+    string n = tmp.substr( base.length(), len - base.length() );
+    size_t underscore = n.find_last_of( "_" );
+    if( underscore == string::npos ) continue;
+
+    int angle;
+    if( n.substr( underscore+1 ) == "090" ){
+      istringstream( n.substr( 0, underscore ) ) >> angle;
+      horizontalAnglesList.push_front( angle );
+    }
+    if( n.compare( 0, 4, "000_" ) == 0 ){
+      istringstream( n.substr( n.length() > 3 ? n.length()-3 : 0 ) ) >> angle;
+      verticalAnglesList.push_front( angle );
+    }
   }
 
   horizontalAnglesList.sort();
+  verticalAnglesList.sort();
 
   globfree( &gdat );
 
 #endif
 
+  return first;
 }
 
 
@@ -282,15 +295,9 @@ void IIPImage::Initialise()
 {
   testImageType();
 
-  if( !isFile ){
-    // Measure sequence angles
-    measureHorizontalAngles();
-
-    // Measure vertical view angles
-    measureVerticalAngles();
-  }
-  // If it's a single value, give the view default angles of 0 and 90
-  else{
+  // Sequence angles are measured when testing the image type, so if it's
+  // a single value, give the view default angles of 0 and 90
+  if( isFile ){
     horizontalAnglesList.push_front( 0 );
     verticalAnglesList.push_front( 90 );
   }
@@ -60,6 +60,9 @@ enum ImageFormat { TIF, JPEG2000, UNSUPPORTED };
 
 class IIPImage {
 
+  // Our metadata index reads and restores our complete state
+  friend class ImageIndex;
+
  private:
 
   /// Image path supplied
@@ -80,11 +83,17 @@ class IIPImage {
   /// Private function to determine the image type
   void testImageType() throw( file_error );
 
-  /// If we have a sequence of images, determine which horizontal angles exist
-  void measureHorizontalAngles();
+  /// Modification time of the directory holding our image sequence
+  time_t directoryTimestamp;
+
+  /// If we have a sequence of images, determine our suffix and which angles exist
+  /** All files of the sequence are found with a single directory scan
+      @return path of the file of our first view
+   */
+  std::string measureSequence() throw( file_error );
 
-  /// If we have a sequence of images, determine which vertical angles exist
-  void measureVerticalAngles();
+  /// Return the modification time of the directory holding our image sequence
+  time_t getDirectoryTimestamp() const;
 
   /// The list of available horizontal angles (for image sequences)
   std::list <int> horizontalAnglesList;
@@ -152,6 +161,7 @@ class IIPImage {
   /// Default Constructor
   IIPImage()
    : isFile( false ),
+    directoryTimestamp( 0 ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
     tile_width( 0 ),
@@ -173,6 +183,7 @@ class IIPImage {
   IIPImage( const std::string& s )
    : imagePath( s ),
     isFile( false ),
+    directoryTimestamp( 0 ),
     virtual_levels( 0 ),
     format( UNSUPPORTED ),
     tile_width( 0 ),
@@ -197,6 +208,7 @@ class IIPImage {
     fileNamePattern( image.fileNamePattern ),
     isFile( image.isFile ),
     suffix( image.suffix ),
+    directoryTimestamp( image.directoryTimestamp ),
     horizontalAnglesList( image.horizontalAnglesList ),
     verticalAnglesList( image.verticalAnglesList ),
     lut( image.lut ),
@@ -249,13 +261,25 @@ class IIPImage {
 
   /// Get the image format
   //  const std::string& getImageFormat() { return format; };
-  ImageFormat getImageFormat() { return format; };
+  ImageFormat getImageFormat() const { return format; };
 
   /// Get the image timestamp
   /** @param s file path
    */
   void updateTimestamp( const std::string& s ) throw( file_error );
 
+  /// Return the current modification time of our image without opening it
+  /** For image sequences, this is the time of the file of our first view
+      @return modification time or 0 if the image cannot be found
+   */
+  time_t getModificationTime() const;
+
+  /// Check whether files have been added to or removed from our image sequence
+  /** Only the modification time of the directory is checked
+      @return false for single images or if unchanged
+   */
+  bool sequenceChanged() const { return !isFile && directoryTimestamp != getDirectoryTimestamp(); };
+
   /// Get a HTTP RFC 1123 formatted timestamp
   const std::string getTimestamp();
 
@@ -265,6 +289,9 @@ class IIPImage {
   /// Set isFile
   void setIsFile( bool is){ isFile = is; };
 
+  /// Return whether our image is a single file rather than part of a sequence
+  bool getIsFile() const { return isFile; };
+
   ///Get the file system prefix
   const std::string getFileSystemPrefix() { return fileSystemPrefix; };
 
@@ -321,9 +348,21 @@ class IIPImage {
     return metadata[index];
   };
 
+  /// Return a new, unopened copy of this image which can be opened and decoded independently
+  /** Used to decode tiles in parallel: Overloaded by child class.
+      @return new image, to be deleted by the caller, or NULL if not supported
+   */
+  virtual IIPImage* clone() { return NULL; };
+
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return the number of virtual resolutions whose tiles are generated by the TileManager
+  /** These are our lowest resolutions, which are missing from the file and whose tiles are
+      generated by reducing those of the resolution above. Overloaded by child class.
+   */
+  virtual unsigned int getVirtualTileLevels(){ return 0; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
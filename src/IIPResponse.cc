@@ -34,10 +34,12 @@ IIPResponse::IIPResponse(){
   server = "Server: iipsrv/" + string(VERSION);
   powered = "X-Powered-By: IIPImage";
   modified = "";
+  etag = "";
   mimeType = "Content-Type: application/vnd.netfpx";
   cors = "";
   eof = "\r\n";
   sent = false;
+  cacheable = true;
 }
 
 
@@ -104,7 +106,7 @@ string IIPResponse::formatResponse() {
       eof + eof + error;
   }
   else{
-    response = server + eof + powered + eof + cacheControl + eof + modified + eof + mimeType + eof;
+    response = server + eof + powered + eof + cacheControl + eof + modified + eof + etag + mimeType + eof;
     if( !cors.empty() ) response += cors + eof;
     response += eof + protocol + eof + responseBody;
   }
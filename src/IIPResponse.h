@@ -45,6 +45,7 @@ class IIPResponse{
   std::string server;              // Server header
   std::string powered;             // Powered By header
   std::string modified;            // Last modified header
+  std::string etag;                // Entity tag header
   std::string cacheControl;        // Cache control header
   std::string mimeType;            // Mime type header
   std::string eof;                 // End of response delimitter eg "\r\n"
@@ -53,6 +54,7 @@ class IIPResponse{
   std::string error;               // Error message
   std::string cors;                // CORS (Cross-Origin Resource Sharing) setting
   bool sent;                       // Indicate whether a response has been sent
+  bool cacheable;                  // Whether the response may be stored in an external cache
 
 
  public:
@@ -71,6 +73,16 @@ class IIPResponse{
   void setLastModified( const std::string& m ) { modified = "Last-Modified: " + m; };
 
 
+  /// Set the ETag header
+  /** @param e quoted entity tag */
+  void setETag( const std::string& e ) { etag = "ETag: " + e + eof; };
+
+
+  /// Get the ETag header
+  /** @return header including its line ending, or an empty string if none has been set */
+  std::string getETag(){ return etag; };
+
+
   /// Add a response string
   /** @param r response string */
   void addResponse( const std::string& r ); 
@@ -154,6 +166,15 @@ class IIPResponse{
   bool imageSent() { return sent; };
 
 
+  /// Set whether the response may be stored in an external cache such as Memcached
+  /** @param c whether cacheable */
+  void setCacheable( bool c ) { cacheable = c; };
+
+
+  /// Indicate whether the response may be stored in an external cache
+  bool isCacheable() { return cacheable; };
+
+
   /// Display our advertising banner ;-)
   /** @param version server version */
   std::string getAdvert( const std::string& version );
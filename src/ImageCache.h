@@ -0,0 +1,231 @@
+// Image Metadata Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGECACHE_H
+#define _IMAGECACHE_H
+
+
+#include <string>
+#include <list>
+
+// For our HASHMAP definition
+#include "Cache.h"
+#include "IIPImage.h"
+#include "Thread.h"
+
+
+
+/// LRU cache of image metadata shared by all of our requests
+/** Entries are immutable and reference counted. Lookups return a Reference
+    to the cached IIPImage rather than a copy, which remains valid even if the
+    entry is evicted or replaced while it is in use. Updated metadata is stored
+    by inserting a new entry. When full, the least recently used image is evicted.
+    All functions are thread safe.
+ */
+class ImageCache {
+
+ public:
+
+  class Reference;
+
+ private:
+
+  friend class Reference;
+
+  /// A cached image
+  struct Entry {
+    /// Image metadata
+    IIPImage image;
+    /// Number of References to this entry plus one while it is in our cache
+    unsigned int references;
+    /// Position of this image in our LRU list
+    std::list<std::string>::iterator position;
+    Entry( const IIPImage& i ): image(i), references(1) {};
+  };
+
+  /// Image paths, most recently used first
+  std::list<std::string> lru;
+
+  /// Entries indexed by image path
+  typedef HASHMAP < std::string, Entry* > EntryMap;
+  EntryMap entries;
+
+  /// Maximum number of images
+  unsigned int maxSize;
+
+  /// Lock protecting our entries and their reference counts
+  Mutex mutex;
+
+  ImageCache( const ImageCache& );
+  ImageCache& operator= ( const ImageCache& );
+
+
+  /// Drop a reference to an entry, deleting it once unused. Our lock must be held
+  static void _release( Entry* e ){
+    if( --e->references == 0 ) delete e;
+  };
+
+
+  /// Remove an image. Our lock must be held
+  void _remove( EntryMap::iterator i ){
+    lru.erase( i->second->position );
+    _release( i->second );
+    entries.erase( i );
+  };
+
+
+  /// Evict least recently used images until we are within our maximum size. Our lock must be held
+  void _shrink(){
+    while( entries.size() > maxSize && !lru.empty() ){
+      this->_remove( entries.find( lru.back() ) );
+    }
+  };
+
+
+ public:
+
+  /// Shared reference to a cached image
+  class Reference {
+
+    friend class ImageCache;
+
+  private:
+
+    ImageCache* cache;
+    Entry* entry;
+
+    void release(){
+      if( entry ){
+	ScopedLock lock( cache->mutex );
+	_release( entry );
+      }
+      entry = NULL;
+    };
+
+  public:
+
+    /// Constructor for an empty reference
+    Reference(): cache(NULL), entry(NULL) {};
+
+    /// Copy constructor
+    Reference( const Reference& r ): cache(r.cache), entry(r.entry) {
+      if( entry ){
+	ScopedLock lock( cache->mutex );
+	entry->references++;
+      }
+    };
+
+    /// Assignment operator
+    Reference& operator= ( const Reference& r ){
+      if( this != &r ){
+	Reference copy( r );
+	this->release();
+	cache = copy.cache;
+	entry = copy.entry;
+	copy.entry = NULL;
+      }
+      return *this;
+    };
+
+    /// Destructor
+    ~Reference(){ this->release(); };
+
+    /// Whether this refers to an image
+    bool empty() const { return entry == NULL; };
+
+    /// Return our cached image
+    const IIPImage& operator*() const { return entry->image; };
+    const IIPImage* operator->() const { return &entry->image; };
+
+  };
+
+
+  /// Constructor
+  /** @param max maximum number of images */
+  ImageCache( unsigned int max ): maxSize(max) {};
+
+
+  /// Destructor
+  ~ImageCache(){
+    ScopedLock lock( mutex );
+    for( EntryMap::iterator i = entries.begin(); i != entries.end(); ++i ) _release( i->second );
+  };
+
+
+  /// Look up an image, marking it as most recently used
+  /** @param path image path
+      @return reference to the cached image, which is empty if not found
+   */
+  Reference find( const std::string& path ){
+    Reference r;
+    // Copying a Reference takes our lock, so only return once it is released
+    {
+      ScopedLock lock( mutex );
+      EntryMap::iterator i = entries.find( path );
+      if( i != entries.end() ){
+	Entry* e = i->second;
+	lru.splice( lru.begin(), lru, e->position );
+	e->references++;
+	r.cache = this;
+	r.entry = e;
+      }
+    }
+    return r;
+  };
+
+
+  /// Store an image, replacing any existing entry
+  /** @param path image path
+      @param image image metadata, which is copied
+   */
+  void insert( const std::string& path, const IIPImage& image ){
+    // Copy outside of our lock
+    Entry* e = new Entry( image );
+    ScopedLock lock( mutex );
+    EntryMap::iterator i = entries.find( path );
+    if( i != entries.end() ) this->_remove( i );
+    lru.push_front( path );
+    e->position = lru.begin();
+    entries[path] = e;
+    this->_shrink();
+  };
+
+
+  /// Change the maximum number of images, evicting images if necessary
+  /** @param max maximum number of images */
+  void setMaxSize( unsigned int max ){
+    ScopedLock lock( mutex );
+    maxSize = max;
+    this->_shrink();
+  };
+
+
+  /// Return the number of cached images
+  unsigned int size(){
+    ScopedLock lock( mutex );
+    return entries.size();
+  };
+
+};
+
+
+#endif
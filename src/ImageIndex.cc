@@ -0,0 +1,365 @@
+/*
+    IIP Image Metadata Index Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ImageIndex.h"
+#include "Environment.h"
+#include "TPTImage.h"
+
+#ifdef HAVE_KAKADU
+#include "KakaduImage.h"
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Append a fixed size value to a record
+template <class T> static void _put( string& out, const T& v ){
+  out.append( (const char*) &v, sizeof(T) );
+}
+
+
+/// Append a length-prefixed string to a record
+static void _put( string& out, const string& s ){
+  _put( out, (unsigned int) s.length() );
+  out.append( s );
+}
+
+
+/// Append a length-prefixed vector to a record
+template <class T> static void _put( string& out, const vector<T>& v ){
+  _put( out, (unsigned int) v.size() );
+  for( unsigned int i=0; i<v.size(); i++ ) _put( out, v[i] );
+}
+
+
+/// Read a fixed size value from a record, checking bounds
+template <class T> static bool _get( const unsigned char*& p, const unsigned char* end, T& v ){
+  if( (size_t)(end - p) < sizeof(T) ) return false;
+  memcpy( &v, p, sizeof(T) );
+  p += sizeof(T);
+  return true;
+}
+
+
+/// Read a length-prefixed string from a record, checking bounds
+static bool _get( const unsigned char*& p, const unsigned char* end, string& s ){
+  unsigned int len;
+  if( !_get( p, end, len ) || (size_t)(end - p) < len ) return false;
+  s.assign( (const char*) p, len );
+  p += len;
+  return true;
+}
+
+
+/// Read a length-prefixed vector from a record, checking bounds
+template <class T> static bool _get( const unsigned char*& p, const unsigned char* end, vector<T>& v ){
+  unsigned int n;
+  if( !_get( p, end, n ) || (size_t)(end - p) / sizeof(T) < n ) return false;
+  v.resize( n );
+  for( unsigned int i=0; i<n; i++ ) _get( p, end, v[i] );
+  return true;
+}
+
+
+
+/// Order index records by path alone, so that a stable sort keeps duplicates in input order
+static bool _byPath( const pair<string,string>& a, const pair<string,string>& b ){
+  return a.first < b.first;
+}
+
+
+
+bool ImageIndex::open( const string& path ){
+
+  this->close();
+
+  unsigned char* b = NULL;
+  size_t l = 0;
+
+#ifndef WIN32
+  int fd = ::open( path.c_str(), O_RDONLY );
+  if( fd == -1 ) return false;
+  struct stat sb;
+  if( fstat( fd, &sb ) == -1 || sb.st_size == 0 ){
+    ::close( fd );
+    return false;
+  }
+  l = sb.st_size;
+  void* map = mmap( NULL, l, PROT_READ, MAP_PRIVATE, fd, 0 );
+  ::close( fd );
+  if( map == MAP_FAILED ) return false;
+  b = (unsigned char*) map;
+#else
+  FILE* f = fopen( path.c_str(), "rb" );
+  if( !f ) return false;
+  fseek( f, 0, SEEK_END );
+  l = ftell( f );
+  fseek( f, 0, SEEK_SET );
+  b = new unsigned char[l];
+  if( fread( b, 1, l, f ) != l ) l = 0;
+  fclose( f );
+#endif
+
+  buffer = b;
+  length = l;
+
+  // Check our header and that our table of offsets is complete
+  const unsigned char* p = buffer;
+  const unsigned char* end = buffer + length;
+  unsigned int version = 0, n = 0;
+  bool ok = ( length >= 8 && memcmp( p, INDEX_MAGIC, 8 ) == 0 );
+  if( ok ){
+    p += 8;
+    ok = _get( p, end, version ) && version == INDEX_VERSION && _get( p, end, n ) &&
+      (size_t)(end - p) / sizeof(unsigned long long) >= n;
+  }
+
+  if( !ok ){
+    this->close();
+    return false;
+  }
+
+  table = p;
+  count = n;
+  return true;
+}
+
+
+
+void ImageIndex::close(){
+  if( buffer ){
+#ifndef WIN32
+    munmap( (void*) buffer, length );
+#else
+    delete[] buffer;
+#endif
+  }
+  buffer = NULL;
+  table = NULL;
+  length = 0;
+  count = 0;
+}
+
+
+
+bool ImageIndex::record( unsigned int n, const char*& path, unsigned int& len, const unsigned char*& p ){
+  unsigned long long offset;
+  memcpy( &offset, table + n*sizeof(offset), sizeof(offset) );
+  if( offset >= length ) return false;
+  p = buffer + offset;
+  if( !_get( p, buffer + length, len ) || (size_t)(buffer + length - p) < len ) return false;
+  path = (const char*) p;
+  p += len;
+  return true;
+}
+
+
+
+bool ImageIndex::find( const string& path, IIPImage& image ){
+
+  if( count == 0 ) return false;
+
+  // Binary search of our records, which are sorted by path
+  unsigned int lo = 0, hi = count;
+  const unsigned char* p = NULL;
+  while( lo < hi ){
+    unsigned int mid = lo + (hi-lo)/2;
+    const char* name;
+    unsigned int len;
+    if( !this->record( mid, name, len, p ) ) return false;
+    int c = memcmp( path.data(), name, std::min( (size_t) len, path.length() ) );
+    if( c == 0 ) c = ( path.length() < len ) ? -1 : ( path.length() > len ? 1 : 0 );
+    if( c == 0 ) break;
+    if( c < 0 ) hi = mid;
+    else lo = mid + 1;
+    p = NULL;
+  }
+  if( !p ) return false;
+
+  // Read into a copy, so that the image is untouched if the record is corrupt
+  IIPImage im( image );
+  const unsigned char* end = buffer + length;
+  long long timestamp;
+  int format, sampleType, colourspace;
+  unsigned int nmeta;
+
+  if( !( _get( p, end, timestamp ) && _get( p, end, format ) &&
+	 _get( p, end, im.tile_width ) && _get( p, end, im.tile_height ) &&
+	 _get( p, end, im.numResolutions ) && _get( p, end, im.bpc ) &&
+	 _get( p, end, im.channels ) && _get( p, end, sampleType ) &&
+	 _get( p, end, colourspace ) && _get( p, end, im.quality_layers ) &&
+	 _get( p, end, im.virtual_levels ) &&
+	 _get( p, end, im.image_widths ) && _get( p, end, im.image_heights ) &&
+	 _get( p, end, im.min ) && _get( p, end, im.max ) && _get( p, end, im.lut ) &&
+	 _get( p, end, nmeta ) ) ) return false;
+
+  for( unsigned int i=0; i<nmeta; i++ ){
+    string key, value;
+    if( !( _get( p, end, key ) && _get( p, end, value ) ) ) return false;
+    im.metadata[key] = value;
+  }
+
+  im.timestamp = (time_t) timestamp;
+  im.format = (ImageFormat) format;
+  im.sampleType = (SampleType) sampleType;
+  im.colourspace = (ColourSpaces) colourspace;
+
+  // Indexed images are always single files
+  im.isFile = true;
+  im.horizontalAnglesList.clear();
+  im.horizontalAnglesList.push_front( 0 );
+  im.verticalAnglesList.clear();
+  im.verticalAnglesList.push_front( 90 );
+
+  image = im;
+  return true;
+}
+
+
+
+int ImageIndex::build( istream& list, const string& path, ostream& log ){
+
+  string prefix = Environment::getFileSystemPrefix();
+  string pattern = Environment::getFileNamePattern();
+
+  // Records keyed by image path
+  vector < pair<string,string> > records;
+  string line;
+
+  while( getline( list, line ) ){
+
+    if( !line.empty() && line[line.length()-1] == '\r' ) line.erase( line.length()-1 );
+    if( line.empty() || line[0] == '#' ) continue;
+
+    IIPImage* image = NULL;
+
+    try{
+      IIPImage test( line );
+      test.setFileSystemPrefix( prefix );
+      test.setFileNamePattern( pattern );
+      test.Initialise();
+
+      if( !test.isFile ){
+	log << "Skipping image sequence '" << line << "'" << endl;
+	continue;
+      }
+
+      if( test.getImageFormat() == TIF ) image = new TPTImage( test );
+#ifdef HAVE_KAKADU
+      else if( test.getImageFormat() == JPEG2000 ) image = new KakaduImage( test );
+#endif
+      else throw string( "Unsupported image type" );
+
+      image->openImage();
+
+      const IIPImage& im = *image;
+      string r;
+      _put( r, (long long) im.timestamp );
+      _put( r, (int) im.format );
+      _put( r, im.tile_width );
+      _put( r, im.tile_height );
+      _put( r, im.numResolutions );
+      _put( r, im.bpc );
+      _put( r, im.channels );
+      _put( r, (int) im.sampleType );
+      _put( r, (int) im.colourspace );
+      _put( r, im.quality_layers );
+      _put( r, im.virtual_levels );
+      _put( r, im.image_widths );
+      _put( r, im.image_heights );
+      _put( r, im.min );
+      _put( r, im.max );
+      _put( r, im.lut );
+      _put( r, (unsigned int) im.metadata.size() );
+      for( map<const string,string>::const_iterator m = im.metadata.begin(); m != im.metadata.end(); ++m ){
+	_put( r, m->first );
+	_put( r, m->second );
+      }
+
+      records.push_back( make_pair( line, r ) );
+
+      image->closeImage();
+      delete image;
+    }
+    catch( const file_error& error ){
+      log << "Unable to index '" << line << "': " << error.what() << endl;
+      delete image;
+    }
+    catch( const string& error ){
+      log << "Unable to index '" << line << "': " << error << endl;
+      delete image;
+    }
+
+  }
+
+  // Sort by path for binary search, keeping the last of any duplicates
+  stable_sort( records.begin(), records.end(), _byPath );
+  vector < pair<string,string> > sorted;
+  for( unsigned int i=0; i<records.size(); i++ ){
+    if( !sorted.empty() && sorted.back().first == records[i].first ) sorted.back() = records[i];
+    else sorted.push_back( records[i] );
+  }
+
+  // Header and table of record offsets
+  unsigned int n = sorted.size();
+  string header( INDEX_MAGIC, 8 );
+  _put( header, (unsigned int) INDEX_VERSION );
+  _put( header, n );
+  unsigned long long offset = header.length() + n * sizeof(unsigned long long);
+  for( unsigned int i=0; i<n; i++ ){
+    _put( header, offset );
+    offset += sizeof(unsigned int) + sorted[i].first.length() + sorted[i].second.length();
+  }
+
+  // Write to a temporary file which then replaces any existing index
+  string tmp = path + ".tmp";
+  FILE* f = fopen( tmp.c_str(), "wb" );
+  if( !f ) return -1;
+
+  bool ok = fwrite( header.data(), 1, header.length(), f ) == header.length();
+  for( unsigned int i=0; ok && i<n; i++ ){
+    string r;
+    _put( r, sorted[i].first );
+    r.append( sorted[i].second );
+    ok = fwrite( r.data(), 1, r.length(), f ) == r.length();
+  }
+
+  if( fclose( f ) != 0 ) ok = false;
+  if( !ok || rename( tmp.c_str(), path.c_str() ) != 0 ){
+    remove( tmp.c_str() );
+    return -1;
+  }
+
+  return n;
+}
@@ -0,0 +1,109 @@
+// Image Metadata Index Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _IMAGEINDEX_H
+#define _IMAGEINDEX_H
+
+
+#include <string>
+#include <iostream>
+
+#include "IIPImage.h"
+
+
+/// Identifier and version of our index file format
+#define INDEX_MAGIC "IIPINDEX"
+#define INDEX_VERSION 2
+
+
+
+/// Read-only index of image metadata built offline for large collections
+/** The index is built by iipsrv --build-index from a list of image paths, as
+    they would be given to the FIF command, and stores everything we would
+    otherwise read from each image on first access: format, dimensions of each
+    resolution, tile size, channels, bits per channel, sample type, colour
+    space, min and max values, basic metadata and modification time. At run
+    time the index file is memory mapped and looked up by binary search, so
+    that the first view of an indexed image needs no metadata I/O. Images
+    modified since the index was built are detected when they are opened and
+    their metadata is reloaded as usual. Image sequences are not indexed.
+    The file is written in native byte order. Lookups are thread safe.
+ */
+class ImageIndex {
+
+ private:
+
+  /// Mapped index file
+  const unsigned char* buffer;
+  size_t length;
+
+  /// Number of images and the table of their record offsets
+  unsigned int count;
+  const unsigned char* table;
+
+  ImageIndex( const ImageIndex& );
+  ImageIndex& operator= ( const ImageIndex& );
+
+  /// Return the image path and position of the metadata of record n
+  bool record( unsigned int n, const char*& path, unsigned int& len, const unsigned char*& p );
+
+
+ public:
+
+  /// Constructor
+  ImageIndex(): buffer(NULL), length(0), count(0), table(NULL) {};
+
+  /// Destructor
+  ~ImageIndex(){ this->close(); };
+
+  /// Map an index file
+  /** @param path index file path
+      @return whether the index could be opened
+   */
+  bool open( const std::string& path );
+
+  /// Unmap our index file
+  void close();
+
+  /// Return the number of indexed images
+  unsigned int size(){ return count; };
+
+  /// Look up an image and fill in its metadata
+  /** @param path image path as given to the FIF command
+      @param image image whose path, file system prefix and file name pattern have been set
+      @return whether the image was found
+   */
+  bool find( const std::string& path, IIPImage& image );
+
+  /// Build an index file
+  /** Images are opened using the FILESYSTEM_PREFIX and FILENAME_PATTERN settings
+      @param list stream of image paths, one per line
+      @param path index file path, which is replaced atomically
+      @param log stream to which progress and errors are written
+      @return number of images indexed or -1 if the index could not be written
+   */
+  static int build( std::istream& list, const std::string& path, std::ostream& log );
+
+};
+
+
+#endif
@@ -95,8 +95,9 @@ iip_init_destination (j_compress_ptr cinfo)
 				 mx * sizeof(JOCTET) );
   */
 
-  // In fact just allocate with new
-  dest->buffer = new JOCTET[mx];
+  // In fact just allocate with new, or from our arena if we have one
+  if( dest->arena ) dest->buffer = (JOCTET*) dest->arena->allocate( mx * sizeof(JOCTET) );
+  else dest->buffer = new JOCTET[mx];
   dest->size = mx;
 
   // Set compressor pointers for library
@@ -152,7 +153,8 @@ void iip_term_destination( j_compress_ptr cinfo )
 
   dest->size = datacount;
 
-  delete[] dest->buffer;
+  // Arena memory is released in bulk at the end of the request
+  if( !dest->arena ) delete[] dest->buffer;
 }
 
 
@@ -213,6 +215,7 @@ void JPEGCompressor::InitCompression( const RawTile& rawtile, unsigned int strip
   //dest->pub.empty_output_buffer = iip_empty_output_buffer;
   dest->pub.term_destination = iip_term_destination;
   dest->strip_height = strip_height;
+  dest->arena = arena;
 
   cinfo.image_width = width;
   cinfo.image_height = height;
@@ -292,7 +295,7 @@ unsigned int JPEGCompressor::Finish( unsigned char* output ) throw (string)
 
   // Tidy up and de-allocate memory
   dest->pub.next_output_byte = dest->buffer;
-  cinfo.next_scanline = dest->strip_height;
+  cinfo.next_scanline = cinfo.image_height;
   jpeg_finish_compress( &cinfo );
 
   size_t datacount = dest->size;
@@ -367,9 +370,17 @@ int JPEGCompressor::Compress( RawTile& rawtile ) throw (string)
   dest->pub.empty_output_buffer = iip_empty_output_buffer;
   dest->pub.term_destination = iip_term_destination;
   dest->strip_height = 0;
+  dest->arena = arena;
+
+  // Our buffers are only needed for this tile, so give them back to our arena once
+  // we are done rather than letting it grow with every tile of a request
+  Arena::Mark mark;
+  if( arena ) mark = arena->mark();
 
   // Allocate memory for our destination
-  dest->source = new unsigned char[width*height*channels + MX]; // Add some extra buffering
+  size_t mx = width*height*channels + MX; // Add some extra buffering
+  if( arena ) dest->source = (unsigned char*) arena->allocate( mx );
+  else dest->source = new unsigned char[mx];
 
   // Set floating point quality (highest, but possibly slower depending
   //  on hardware)
@@ -400,12 +411,14 @@ int JPEGCompressor::Compress( RawTile& rawtile ) throw (string)
   // Should be faster than scanlines.
   if( (row_stride * height) <= (512*512*channels) ){
 
-    JSAMPROW *array = new JSAMPROW[height];
+    JSAMPROW *array;
+    if( arena ) array = (JSAMPROW*) arena->allocate( height * sizeof(JSAMPROW) );
+    else array = new JSAMPROW[height];
     for( y=0; y < height; y++ ){
       array[y] = &data[ y * row_stride ];
     }
     jpeg_write_scanlines( &cinfo, array, height );
-    delete[] array;
+    if( !arena ) delete[] array;
 
   }
   else{
@@ -431,8 +444,9 @@ int JPEGCompressor::Compress( RawTile& rawtile ) throw (string)
 
   // Copy memory back to the tile
   memcpy( rawtile.data, dest->source, y );
-  delete[] dest->source;
+  if( !arena ) delete[] dest->source;
   jpeg_destroy_compress( &cinfo );
+  if( arena ) arena->rewind( mark );
 
 
   // Set the tile compression parameters
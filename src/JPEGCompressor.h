@@ -27,6 +27,7 @@
 #include <cstdio>
 #include <string>
 #include "RawTile.h"
+#include "Arena.h"
 
 
 extern "C"{
@@ -48,6 +49,7 @@ typedef struct {
   JOCTET *buffer;		     /**< working buffer */
   unsigned char* source;             /**< source data */
   unsigned int strip_height;         /**< used for stream-based encoding */
+  Arena* arena;                      /**< arena for our buffers, if any */
 
 } iip_destination_mgr;
 
@@ -82,12 +84,20 @@ class JPEGCompressor{
   iip_destination_mgr dest_mgr;
   iip_dest_ptr dest;
 
+  /// Arena from which our working buffers are allocated, if any
+  Arena* arena;
+
 
  public:
 
   /// Constructor
   /** @param quality JPEG Quality factor (0-100) */
-   JPEGCompressor( int quality ) { Q = quality; dest = NULL; };
+   JPEGCompressor( int quality ) { Q = quality; dest = NULL; arena = NULL; };
+
+
+  /// Allocate our working buffers from an arena rather than the heap
+  /** @param a arena, which must not be reset while compression is in progress */
+  void setArena( Arena* a ){ arena = a; };
 
 
   /// Set the compression quality
@@ -106,9 +116,10 @@ class JPEGCompressor{
   /// Initialise strip based compression
   /** If we are doing a strip based encoding, we need to first initialise
       with InitCompression, then compress a single strip at a time using
-      CompressStrip and finally clean up using Finish
-      @param rawtile tile containing the image to be compressed
-      @param strip_height pixel height of the strip we want to compress
+      CompressStrip and finally clean up using Finish. Only enough memory
+      for a single strip is allocated, so the image itself need not exist yet
+      @param rawtile tile with the dimensions and channels of the whole image
+      @param strip_height maximum pixel height of the strips we will compress
       @return header size
    */
   void InitCompression( const RawTile& rawtile, unsigned int strip_height ) throw (std::string);
@@ -75,8 +75,19 @@ void JTL::send( Session* session, int resolution, int tile ){
   else ct = JPEG;
 
 
-  RawTile rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
-					 session->view->yangle, session->view->getLayers(), ct );
+  // Tiles which need processing are cached in their final JPEG form under a hash of the
+  // view parameters, so that repeated requests with the same parameters become cache hits
+  RawTile cached;
+  string variant;
+  bool processed = false;
+  if( ct == UNCOMPRESSED ){
+    variant = session->view->getProcessingHash();
+    processed = tilemanager.getProcessedTile( resolution, tile, session->view->xangle,
+					      session->view->yangle, variant, cached );
+  }
+
+  RawTile rawtile = processed ? cached : tilemanager.getTile( resolution, tile, session->view->xangle,
+								session->view->yangle, session->view->getLayers(), ct );
 
 
   int len = rawtile.dataLength;
@@ -89,185 +100,194 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
-  // Convert CIELAB to sRGB
-  if( (*session->image)->getColourSpace() == CIELAB ){
-
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Converting from CIELAB->sRGB";
-      function_timer.start();
-    }
-    filter_LAB2sRGB( rawtile );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
-
+  // Apply our processing pipeline unless we already have a processed tile
+  if( !processed ){
 
-  // Only use our float pipeline if necessary
-  if( rawtile.bpc > 8 || session->view->floatProcessing() ){
+    // Convert CIELAB to sRGB
+    if( (*session->image)->getColourSpace() == CIELAB ){
 
-    // Apply normalization and float conversion
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Normalizing and converting to float";
-      function_timer.start();
-    }
-    filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-    }
-
-
-    // Apply hill shading if requested
-    if( session->view->shaded ){
       if( session->loglevel >= 4 ){
-	*(session->logfile) << "JTL :: Applying hill-shading";
+	*(session->logfile) << "JTL :: Converting from CIELAB->sRGB";
 	function_timer.start();
       }
-      filter_shade( rawtile, session->view->shade[0], session->view->shade[1] );
+      filter_LAB2sRGB( rawtile );
       if( session->loglevel >= 4 ){
 	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply color twist if requested
-    if( session->view->ctw.size() ){
+    // Only use our float pipeline if necessary
+    if( rawtile.bpc > 8 || session->view->floatProcessing() ){
+
+      // Apply normalization and float conversion
       if( session->loglevel >= 4 ){
-	*(session->logfile) << "JTL :: Applying color twist";
+	*(session->logfile) << "JTL :: Normalizing and converting to float";
 	function_timer.start();
       }
-      filter_twist( rawtile, session->view->ctw );
+      filter_normalize( rawtile, (*session->image)->max, (*session->image)->min );
       if( session->loglevel >= 4 ){
 	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
       }
-    }
 
 
-    // Apply any gamma correction
-    if( session->view->getGamma() != 1.0 ){
-      float gamma = session->view->getGamma();
+      // Apply hill shading if requested
+      if( session->view->shaded ){
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << "JTL :: Applying hill-shading";
+	  function_timer.start();
+	}
+	filter_shade( rawtile, session->view->shade[0], session->view->shade[1] );
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+
+
+      // Apply color twist if requested
+      if( session->view->ctw.size() ){
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << "JTL :: Applying color twist";
+	  function_timer.start();
+	}
+	filter_twist( rawtile, session->view->ctw );
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+
+
+      // Apply any gamma correction
+      if( session->view->getGamma() != 1.0 ){
+	float gamma = session->view->getGamma();
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << "JTL :: Applying gamma of " << gamma;
+	  function_timer.start();
+	}
+	filter_gamma( rawtile, gamma);
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+
+
+      // Apply inversion if requested
+      if( session->view->inverted ){
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << "JTL :: Applying inversion";
+	  function_timer.start();
+	}
+	filter_inv( rawtile );
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+
+
+      // Apply color mapping if requested
+      if( session->view->cmapped ){
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << "JTL :: Applying color map";
+	  function_timer.start();
+	}
+	filter_cmap( rawtile, session->view->cmap );
+	if( session->loglevel >= 4 ){
+	  *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+	}
+      }
+
+
+      // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
+      float contrast = session->view->getContrast();
       if( session->loglevel >= 4 ){
-	*(session->logfile) << "JTL :: Applying gamma of " << gamma;
+	*(session->logfile) << "JTL :: Applying contrast of " << contrast << " and converting to 8 bit";
 	function_timer.start();
       }
-      filter_gamma( rawtile, gamma);
+      filter_contrast( rawtile, contrast );
       if( session->loglevel >= 4 ){
 	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
       }
+
     }
 
 
-    // Apply inversion if requested
-    if( session->view->inverted ){
+    // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
+    if( rawtile.channels == 2 || rawtile.channels > 3 ){
+      unsigned int bands = (rawtile.channels==2) ? 1 : 3;
       if( session->loglevel >= 4 ){
-	*(session->logfile) << "JTL :: Applying inversion";
+	*(session->logfile) << "JTL :: Flattening channels to " << bands;
 	function_timer.start();
       }
-      filter_inv( rawtile );
+      filter_flatten( rawtile, bands );
       if( session->loglevel >= 4 ){
 	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply color mapping if requested
-    if( session->view->cmapped ){
+    // Convert to greyscale if requested
+    if( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
       if( session->loglevel >= 4 ){
-	*(session->logfile) << "JTL :: Applying color map";
+	*(session->logfile) << "JTL :: Converting to greyscale";
 	function_timer.start();
       }
-      filter_cmap( rawtile, session->view->cmap );
+      filter_greyscale( rawtile );
       if( session->loglevel >= 4 ){
 	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
       }
     }
 
 
-    // Apply any contrast adjustments and/or clip to 8bit from 16 or 32 bit
-    float contrast = session->view->getContrast();
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Applying contrast of " << contrast << " and converting to 8 bit";
-      function_timer.start();
-    }
-    filter_contrast( rawtile, contrast );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-    }
-
-  }
-
-
-  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( rawtile.channels == 2 || rawtile.channels > 3 ){
-    unsigned int bands = (rawtile.channels==2) ? 1 : 3;
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Flattening channels to " << bands;
-      function_timer.start();
-    }
-    filter_flatten( rawtile, bands );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
-    }
-  }
+    // Apply flip
+    if( session->view->flip != 0 ){
+      Timer flip_timer;
+      if( session->loglevel >= 5 ){
+	flip_timer.start();
+      }
 
+      filter_flip( rawtile, session->view->flip  );
 
-  // Convert to greyscale if requested
-  if( (*session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Converting to greyscale";
-      function_timer.start();
-    }
-    filter_greyscale( rawtile );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "JTL :: Flipping image ";
+	if( session->view->flip == 1 ) *(session->logfile) << "horizontally";
+	else *(session->logfile) << "vertically";
+	*(session->logfile) << " in " << flip_timer.getTime() << " microseconds" << endl;
+      }
     }
-  }
 
 
-  // Apply flip
-  if( session->view->flip != 0 ){
-    Timer flip_timer;
-    if( session->loglevel >= 5 ){
-      flip_timer.start();
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if( session->view->getRotation() != 0.0 ){
+      float rotation = session->view->getRotation();
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << "JTL :: Rotating image by " << rotation << " degrees";
+	function_timer.start();
+      }
+      filter_rotate( rawtile, rotation );
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
     }
 
-    filter_flip( rawtile, session->view->flip  );
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "JTL :: Flipping image ";
-      if( session->view->flip == 1 ) *(session->logfile) << "horizontally";
-      else *(session->logfile) << "vertically";
-      *(session->logfile) << " in " << flip_timer.getTime() << " microseconds" << endl;
-    }
-  }
 
+    // Compress to JPEG
+    if( rawtile.compressionType == UNCOMPRESSED ){
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
+	function_timer.start();
+      }
+      len = session->jpeg->Compress( rawtile );
+      if( session->loglevel >= 4 ){
+	*(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
+			    << rawtile.dataLength << " bytes" << endl;
 
-  // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-    float rotation = session->view->getRotation();
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Rotating image by " << rotation << " degrees";
-      function_timer.start();
-    }
-    filter_rotate( rawtile, rotation );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
+      }
     }
-  }
 
 
-  // Compress to JPEG
-  if( rawtile.compressionType == UNCOMPRESSED ){
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
-      function_timer.start();
-    }
-    len = session->jpeg->Compress( rawtile );
-    if( session->loglevel >= 4 ){
-      *(session->logfile) << " in " << function_timer.getTime() << " microseconds to "
-                          << rawtile.dataLength << " bytes" << endl;
+    // Cache our processed tile
+    if( ct == UNCOMPRESSED ) tilemanager.insertProcessedTile( rawtile, variant );
 
-    }
   }
 
 
@@ -280,9 +300,10 @@ void JTL::send( Session* session, int resolution, int tile ){
 	    "Content-Type: image/jpeg\r\n"
             "Content-Length: %d\r\n"
 	    "Last-Modified: %s\r\n"
+	    "%s"
 	    "%s\r\n"
 	    "\r\n",
-	    VERSION, len,(*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	    VERSION, len,(*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str() );
 
   session->out->printf( str );
 #endif
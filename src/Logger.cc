@@ -0,0 +1,203 @@
+/*
+    IIP Asynchronous Logging Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Logger.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Atomically replace a value if it is unchanged
+static inline bool compareAndSwap( volatile unsigned long* p, unsigned long o, unsigned long n ){
+#ifdef WIN32
+  return InterlockedCompareExchange( (volatile LONG*) p, (LONG) n, (LONG) o ) == (LONG) o;
+#else
+  return __sync_bool_compare_and_swap( p, o, n );
+#endif
+}
+
+
+/// Atomically add to a value
+static inline void atomicAdd( volatile long* p, long n ){
+#ifdef WIN32
+  InterlockedExchangeAdd( (volatile LONG*) p, (LONG) n );
+#else
+  __sync_fetch_and_add( p, n );
+#endif
+}
+
+
+/// Full memory barrier
+static inline void barrier(){
+#ifdef WIN32
+  MemoryBarrier();
+#else
+  __sync_synchronize();
+#endif
+}
+
+
+
+Logger::Logger( ofstream& o, unsigned int n, long max ): out(o){
+
+  unsigned long size = 1;
+  while( size < n ) size <<= 1;
+
+  slots = new Slot[size];
+  for( unsigned long i=0; i<size; i++ ) slots[i].sequence = i;
+  mask = size - 1;
+
+  tail = head = 0;
+  bytes = 0;
+  maxBytes = max;
+  dropped = reported = 0;
+  stopping = false;
+  reopening = false;
+}
+
+
+
+Logger::~Logger(){
+  this->stop();
+  delete[] slots;
+}
+
+
+
+bool Logger::push( string& record ){
+
+  if( record.empty() ) return true;
+
+  if( bytes + (long) record.length() > maxBytes ){
+    atomicAdd( &dropped, 1 );
+    return false;
+  }
+
+  // Claim a slot: a slot is free once its sequence number equals our position
+  unsigned long pos = tail;
+  Slot* slot;
+  while( true ){
+    slot = &slots[pos & mask];
+    long diff = (long) ( slot->sequence - pos );
+    if( diff == 0 && compareAndSwap( &tail, pos, pos+1 ) ) break;
+    if( diff < 0 ){
+      // Our thread has not yet written out this slot, so we are full
+      atomicAdd( &dropped, 1 );
+      return false;
+    }
+    pos = tail;
+  }
+
+  slot->record.swap( record );
+  atomicAdd( &bytes, slot->record.length() );
+
+  // Publish the record to our thread
+  barrier();
+  slot->sequence = pos + 1;
+
+  return true;
+}
+
+
+
+unsigned int Logger::drain(){
+
+  unsigned int n = 0;
+
+  while( true ){
+
+    Slot* slot = &slots[head & mask];
+    if( slot->sequence != head + 1 ) break;
+    barrier();
+
+    // Take the record, leaving the slot empty so that it holds no memory
+    string record;
+    record.swap( slot->record );
+
+    // Hand the slot back to the producers for their next pass around the ring
+    barrier();
+    slot->sequence = head + mask + 1;
+    head++;
+
+    atomicAdd( &bytes, -(long) record.length() );
+    out << record;
+    n++;
+  }
+
+  return n;
+}
+
+
+
+void Logger::run(){
+
+  while( true ){
+
+    // Check before draining so that nothing queued before stop() is lost
+    bool stop = stopping;
+
+    if( reopening ){
+      ScopedLock lock( reopenMutex );
+      out.close();
+      out.open( reopenFile.c_str(), ios::app );
+      reopening = false;
+    }
+
+    unsigned int n = this->drain();
+
+    long d = dropped;
+    if( d != reported ){
+      out << "Logger :: " << d - reported << " log records dropped as the queue was full" << endl;
+      reported = d;
+    }
+
+    if( n > 0 ) out.flush();
+    else if( stop ) break;
+    else{
+#ifdef WIN32
+      Sleep( LOGGER_INTERVAL );
+#else
+      usleep( LOGGER_INTERVAL * 1000 );
+#endif
+    }
+  }
+}
+
+
+
+void Logger::reopen( const string& file ){
+  ScopedLock lock( reopenMutex );
+  reopenFile = file;
+  reopening = true;
+}
+
+
+
+void Logger::stop(){
+  stopping = true;
+  this->join();
+  stopping = false;
+}
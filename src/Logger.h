@@ -0,0 +1,137 @@
+// Asynchronous Logging Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+
+#include <string>
+#include <fstream>
+
+#include "Thread.h"
+
+
+/// Number of log records which can be queued, which must be a power of 2
+#define LOGGER_QUEUE_SIZE 4096
+
+/// Maximum number of bytes of log records which can be queued
+#define LOGGER_MAX_BYTES 16777216
+
+/// Number of milliseconds the logging thread sleeps when there is nothing to write
+#define LOGGER_INTERVAL 20
+
+
+
+/// Write log records to our log file from a background thread
+/** Request threads push complete, formatted log records into a bounded
+    lock-free ring buffer and return immediately. A single background thread
+    drains the buffer, writes the records to the log file and flushes it
+    once per batch. If the buffer is full or holds more than its byte limit,
+    records are dropped rather than blocking the request and are counted.
+    The byte limit is checked before queuing, so may be slightly exceeded
+    when several threads push at once.
+ */
+class Logger : public Thread {
+
+ private:
+
+  /// A slot in our ring buffer
+  struct Slot {
+    /// Slot sequence number, used to hand the slot between producers and our thread
+    volatile unsigned long sequence;
+    /// Log record
+    std::string record;
+  };
+
+  /// Log file
+  std::ofstream& out;
+
+  /// Ring buffer
+  Slot* slots;
+  unsigned long mask;
+
+  /// Next slot to be filled, shared by all producers
+  volatile unsigned long tail;
+
+  /// Next slot to be written out, used only by our thread
+  unsigned long head;
+
+  /// Number of bytes queued
+  volatile long bytes;
+  long maxBytes;
+
+  /// Number of records dropped and the number we have already reported
+  volatile long dropped;
+  long reported;
+
+  /// Whether we should exit once our queue is empty
+  volatile bool stopping;
+
+  /// Log file to be reopened by our thread, if any
+  Mutex reopenMutex;
+  std::string reopenFile;
+  volatile bool reopening;
+
+  /// Write out all queued records
+  /** @return number of records written */
+  unsigned int drain();
+
+
+ protected:
+
+  /// Main loop of our logging thread
+  void run();
+
+
+ public:
+
+  /// Constructor
+  /** @param o log file, which must not be written to directly while our thread is running
+      @param n number of records which can be queued, rounded up to a power of 2
+      @param max maximum number of bytes queued
+   */
+  Logger( std::ofstream& o, unsigned int n = LOGGER_QUEUE_SIZE, long max = LOGGER_MAX_BYTES );
+
+  /// Destructor
+  ~Logger();
+
+  /// Queue a log record without blocking
+  /** The record is swapped out, so that it is not copied
+      @param record log record, which is left empty
+      @return false if the record was dropped
+   */
+  bool push( std::string& record );
+
+  /// Close and reopen the log file from our thread, such as after log rotation
+  /** @param file log file path */
+  void reopen( const std::string& file );
+
+  /// Write out any queued records and stop our thread
+  void stop();
+
+  /// Return the number of records dropped
+  long getDropped(){ return dropped; };
+
+};
+
+
+#endif
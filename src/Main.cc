@@ -31,6 +31,8 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <sstream>
+#include <vector>
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -42,6 +44,19 @@
 #include "Task.h"
 #include "Environment.h"
 #include "Writer.h"
+#include "Thread.h"
+#include "Scheduler.h"
+#include "Logger.h"
+#include "ImageIndex.h"
+
+#ifndef WIN32
+#include "HTTPServer.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#endif
 
 #ifdef HAVE_MEMCACHED
 #ifdef WIN32
@@ -74,56 +89,1014 @@ static void unsetenv(char *env_name) {
 #endif
 
 
-// Define our default socket backlog
-#define DEFAULT_BACKLOG 2048
+// Define our default socket backlog
+#define DEFAULT_BACKLOG 2048
+
+//#define DEBUG 1
+
+using namespace std;
+
+
+
+/* We need to define some variables globally so that the signal handler
+   can have access to them
+*/
+int loglevel;
+ofstream logfile;
+unsigned long IIPcount;
+char *tz = NULL;
+
+// Our tile cache and the snapshot file it should be written to on shutdown
+Cache* tileCachePtr = NULL;
+string cache_snapshot;
+bool cache_snapshot_uncompressed = false;
+
+
+
+/* Write our tile cache out to our snapshot file if one has been configured
+ */
+void saveCacheSnapshot()
+{
+  if( !tileCachePtr || cache_snapshot.empty() ) return;
+
+  Timer snapshot_timer;
+  snapshot_timer.start();
+  int n = tileCachePtr->save( cache_snapshot, cache_snapshot_uncompressed );
+
+  if( loglevel >= 1 ){
+    if( n < 0 ) logfile << "Unable to write cache snapshot to '" << cache_snapshot << "'" << endl;
+    else logfile << "Cache snapshot: " << n << " tiles written to '" << cache_snapshot
+		 << "' in " << snapshot_timer.getTime() << " microseconds" << endl;
+  }
+}
+
+
+
+/* Set when we have been asked to reload our configuration
+ */
+volatile sig_atomic_t reloadRequested = 0;
+
+
+
+/* Handle SIGHUP - we only record the request here as the reload itself
+   is carried out by a worker between requests
+ */
+void IIPReloadHandler( int signal )
+{
+  reloadRequested = 1;
+}
+
+
+
+/* Set to the signal which asked us to shut down and the socket on which we accept connections
+ */
+volatile sig_atomic_t shutdownRequested = 0;
+int listenSocket = -1;
+
+
+
+/* Handle a termination signal - we only record the request here and stop accepting
+   connections. Our main thread then waits for our workers to finish, saves our cache
+   and exits, as none of this can safely be done from within a signal handler
+ */
+void IIPSignalHandler( int signal )
+{
+  shutdownRequested = signal;
+
+  // Make any FCGX_Accept_r fail from now on
+  FCGX_ShutdownPending();
+
+#ifndef WIN32
+  // Wake up any threads blocked in accept()
+  if( listenSocket >= 0 ) shutdown( listenSocket, SHUT_RDWR );
+#endif
+}
+
+
+
+
+
+/* Settings which can be changed without restarting
+ */
+struct Settings {
+
+  // Default JPEG quality, maximum CVT size and number of quality layers
+  int jpeg_quality;
+  int max_CVT;
+  int max_layers;
+
+  // HTTP header settings
+  string cors;
+  string base_url;
+  string cache_control;
+
+  // Our watermark
+  Watermark* watermark;
+
+};
+
+
+
+/* Settings and objects shared by all of our worker threads
+ */
+struct Server {
+
+  // Our version string
+  string version;
+
+  // Settings which may be changed by a reload and the lock which protects them.
+  // Each request works with its own copy
+  Settings settings;
+  Mutex settingsMutex;
+
+  // Watermarks created by reloads: these are kept until shutdown as requests
+  // in progress may still be using them
+  vector<Watermark*> watermarks;
+
+  // Our image metadata cache and index, if any
+  ImageCache* imageCache;
+  ImageIndex* imageIndex;
+
+  // Recently failed image lookups
+  NegativeCache* negativeCache;
+
+  // Our tile cache and background cache warm-up
+  Cache* tileCache;
+  CacheWarmer* warmer;
+
+  // Background conversion of striped TIFF images, if enabled
+  TiffConverter* tiffConverter;
+
+#ifdef HAVE_MEMCACHED
+  // Memcached servers and timeout: each worker has its own connection
+  string memcached_servers;
+  unsigned int memcached_timeout;
+#endif
+
+  // FCGI or HTTP socket on which to accept connections
+  int listen_socket;
+
+  // Whether we are serving HTTP directly rather than FCGI
+  bool http;
+
+  // Whether more than one worker thread is running
+  bool threaded;
+
+  // Number of threads used to build each region
+  unsigned int region_threads;
+
+  // Whether clients may request cache statistics with the STATS command
+  bool stats_command;
+
+  // Scheduler giving interactive requests priority over bulk requests, if used
+  Scheduler* scheduler;
+
+  // Lock serializing calls to FCGX_Accept_r
+  Mutex acceptMutex;
+
+  // FCGI connections which the web server has asked us to keep open, handed back by our
+  // workers once they have finished a request so that our dispatcher can wait for the next
+  // request on them, protected by our mutex
+  vector<FCGX_Request*> kept;
+
+  // Pipe with which our workers wake up our dispatcher when handing back a connection
+  int wakeup[2];
+
+  // Number of workers waiting for a new HTTP connection, protected by our mutex
+  unsigned int accepting;
+
+  // Background thread writing our log records, if running
+  Logger* logger;
+
+  // Lock protecting our log file, when written to directly, and request count
+  Mutex mutex;
+
+};
+
+
+
+/* Write out a complete log record, via our logging thread if it is running
+ */
+static void writeLog( Server& server, string& record )
+{
+  if( server.logger ) server.logger->push( record );
+  else{
+    ScopedLock lock( server.mutex );
+    logfile << record << flush;
+  }
+}
+
+
+
+/* Reopen our log file and re-read those settings which are safe to change while running.
+   Our caches and memcached connections are kept
+ */
+static void reload( Server& server )
+{
+  ostringstream log;
+
+  {
+    ScopedLock lock( server.mutex );
+
+    // Another worker may already have reloaded
+    if( !reloadRequested ) return;
+    reloadRequested = 0;
+
+    // Our environment cannot be changed from outside, so take any new values
+    // from our configuration file, which contains NAME=value lines. These override
+    // our environment, which is never modified as other threads may be reading it
+    Environment::Config config;
+    string config_file = Environment::getConfigFile();
+    if( !config_file.empty() && !Environment::readConfig( config_file, config ) && loglevel >= 1 ){
+      log << "Unable to open configuration file '" << config_file << "'" << endl;
+    }
+
+    // Reopen our log file, so that it can be rotated
+    if( loglevel >= 1 ){
+      if( server.logger ) server.logger->reopen( Environment::getLogFile( &config ) );
+      else{
+	logfile.close();
+	logfile.open( Environment::getLogFile( &config ).c_str(), ios::app );
+      }
+    }
+
+    Settings settings;
+    {
+      ScopedLock lock( server.settingsMutex );
+      settings = server.settings;
+    }
+
+    settings.jpeg_quality = Environment::getJPEGQuality( &config );
+    settings.max_CVT = Environment::getMaxCVT( &config );
+    settings.max_layers = Environment::getMaxLayers( &config );
+    settings.cors = Environment::getCORS( &config );
+    settings.base_url = Environment::getBaseURL( &config );
+    settings.cache_control = Environment::getCacheControl( &config );
+
+    // Only load a new watermark if its settings have changed
+    Watermark* w = settings.watermark;
+    if( Environment::getWatermark( &config ) != w->getImage() ||
+	Environment::getWatermarkOpacity( &config ) != w->getOpacity() ||
+	Environment::getWatermarkProbability( &config ) != w->getProbability() ){
+      w = new Watermark( Environment::getWatermark( &config ),
+		       Environment::getWatermarkOpacity( &config ),
+		       Environment::getWatermarkProbability( &config ) );
+      if( w->getImage().length() > 0 ) w->init();
+      server.watermarks.push_back( w );
+      settings.watermark = w;
+    }
+
+    // Resize our tile cache, keeping its contents
+    float max_image_cache_size = Environment::getMaxImageCacheSize( &config );
+    float pinned_cache_size = Environment::getPinnedCacheSize( &config );
+    server.tileCache->setMaxSize( max_image_cache_size, pinned_cache_size );
+    unsigned int metadata_cache_size = Environment::getMetadataCacheSize( &config );
+    server.imageCache->setMaxSize( metadata_cache_size );
+
+    {
+      ScopedLock lock( server.settingsMutex );
+      server.settings = settings;
+    }
+
+    if( loglevel >= 1 ){
+      time_t current_time = time( NULL );
+      log << "<----------------------------------->" << endl
+	    << ctime( &current_time )
+	    << "Configuration reloaded" << endl
+	    << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl
+	    << "Setting pinned tile cache size to " << pinned_cache_size << "MB" << endl
+	    << "Setting maximum number of images in metadata cache to " << metadata_cache_size << endl
+	    << "Setting default JPEG quality to " << settings.jpeg_quality << endl
+	    << "Setting maximum CVT size to " << settings.max_CVT << endl
+	    << "Setting max quality layers to " << settings.max_layers << endl
+	    << "Setting HTTP Cache-Control header to '" << settings.cache_control << "'" << endl
+	    << "Setting Cross Origin Resource Sharing to '" << settings.cors << "'" << endl
+	    << "Setting base URL to '" << settings.base_url << "'" << endl;
+      if( settings.watermark->isSet() ){
+	log << "Using watermark image '" << settings.watermark->getImage()
+	      << "' with probability " << settings.watermark->getProbability()
+	      << " and opacity " << settings.watermark->getOpacity() << endl;
+      }
+      log << "<----------------------------------->" << endl << endl;
+    }
+  }
+
+  string record = log.str();
+  writeLog( server, record );
+}
+
+
+
+/* Turn away a request when we are overloaded
+ */
+static void unavailable( Writer& writer, Server& server, const char* reason )
+{
+  stringstream status;
+  status << "Status: 503 Service Unavailable\r\n"
+	 << "Retry-After: " << SCHEDULER_RETRY_AFTER << "\r\n"
+	 << "Server: iipsrv/" << server.version << "\r\n\r\n";
+  writer.printf( status.str().c_str() );
+  writer.flush();
+
+  if( loglevel >= 2 ){
+    string record = string( "Scheduler :: " ) + reason + ": sending HTTP 503 Service Unavailable\n\n";
+    writeLog( server, record );
+  }
+}
+
+
+
+#ifndef DEBUG
+/* Discard a finished FCGI request, closing its connection. libfcgi lingers for up to two
+   seconds when closing, so that the web server receives all of our response. Idle
+   connections have nothing left to send, so are closed straight away
+ */
+static void discard( FCGX_Request* request, bool idle = false )
+{
+#ifndef WIN32
+  if( idle && request->ipcFd >= 0 ){
+    close( request->ipcFd );
+    request->ipcFd = -1;
+  }
+#endif
+  FCGX_Free( request, 1 );
+  delete request;
+}
+
+
+
+/* Hand a finished FCGI request back to our dispatcher if the web server has asked us to
+   keep its connection open, so that further requests on it are read. Otherwise discard it
+ */
+static void keep( Server& server, FCGX_Request* request )
+{
+#ifndef WIN32
+  if( request->ipcFd >= 0 ){
+    ScopedLock lock( server.mutex );
+    server.kept.push_back( request );
+    char c = 0;
+    if( write( server.wakeup[1], &c, 1 ) < 0 ){}   // The pipe is only full if a wake-up is pending
+    return;
+  }
+#endif
+  discard( request );
+}
+#endif
+
+
+
+/* A worker handles requests one at a time. Each worker has its own FCGI
+   request or HTTP connection as well as its own compressor, view and session objects for each
+   request, so that several workers can run in parallel, sharing only our
+   thread-safe tile cache and image metadata cache.
+*/
+class Worker : public Thread {
+
+ private:
+
+  Server& server;
+
+  // Arena for the transient buffers of each request, which is reset once the response has been sent
+  Arena arena;
+
+#ifdef HAVE_MEMCACHED
+  Memcache memcached;
+#endif
+
+  /* Thread function
+   */
+  void run(){ this->loop(); };
+
+  /* Accept and process FCGI requests until FCGX_Accept_r fails, or
+     take them from our scheduler until it is stopped
+   */
+  void serveFCGI();
+
+  /* Accept HTTP connections and process their requests until accept fails
+   */
+  void serveHTTP();
+
+  /* Process a request, writing out its log output in one piece if other workers are running
+   */
+  void handle( Writer& writer, FCGX_ParamArray envp );
+
+
+ public:
+
+  /* Constructor
+   */
+  Worker( Server& s ):
+#ifdef HAVE_MEMCACHED
+    server(s), memcached( s.memcached_servers, s.memcached_timeout ) {};
+#else
+    server(s) {};
+#endif
+
+#ifdef HAVE_MEMCACHED
+  /* Whether our memcached connection succeeded
+   */
+  bool memcachedConnected(){ return memcached.connected(); };
+  const char* memcachedError(){ return memcached.error(); };
+#endif
+
+  /* Accept and process requests until we can no longer accept connections
+   */
+  void loop(){
+#ifndef WIN32
+    if( server.http ){
+      this->serveHTTP();
+      return;
+    }
+#endif
+    this->serveFCGI();
+  };
+
+  /* Process a single request
+   */
+  void process( Writer& writer, FCGX_ParamArray envp, ostream& log );
+
+};
+
+
+
+void Worker::handle( Writer& writer, FCGX_ParamArray envp )
+{
+  // Apply any configuration reload before starting on this request
+  if( reloadRequested ) reload( server );
+
+  // Buffer our log output so that each request is written out in one piece
+  // and without waiting for the log file
+  if( loglevel >= 1 ){
+    ostringstream log;
+    this->process( writer, envp, log );
+    string record = log.str();
+    writeLog( server, record );
+  }
+  else this->process( writer, envp, logfile );
+
+  // Release this request's transient buffers
+  arena.reset();
+}
+
+
+
+void Worker::serveFCGI()
+{
+#ifndef DEBUG
+
+  // Requests accepted and queued by our dispatcher
+  if( server.scheduler ){
+    Scheduler::Job job;
+    while( server.scheduler->pop( job ) ){
+      FCGIWriter writer( job.request->out );
+      // Don't waste time on requests the client has probably given up on
+      if( server.scheduler->hasExpired( job ) ) unavailable( writer, server, "Request waited too long" );
+      else this->handle( writer, job.request->envp );
+      FCGX_Finish_r( job.request );
+      keep( server, job.request );
+      server.scheduler->done( job.priority );
+    }
+    return;
+  }
+
+  FCGX_Request request;
+  if( FCGX_InitRequest( &request, server.listen_socket, 0 ) ) return;
+
+  while( true ){
+
+    // Only one thread at a time may wait for a connection
+    server.acceptMutex.lock();
+    int status = FCGX_Accept_r( &request );
+    server.acceptMutex.unlock();
+
+    if( status < 0 ) break;
+
+    FCGIWriter writer( request.out );
+    this->handle( writer, request.envp );
+
+    FCGX_Finish_r( &request );
+  }
+#endif
+}
+
+
+
+#ifndef WIN32
+void Worker::serveHTTP()
+{
+  while( true ){
+
+    server.mutex.lock();
+    server.accepting++;
+    server.mutex.unlock();
+
+    int socket = accept( server.listen_socket, NULL, NULL );
+    int error = errno;
+
+    server.mutex.lock();
+    server.accepting--;
+    server.mutex.unlock();
+
+    if( socket < 0 ){
+      if( shutdownRequested || error == EBADF || error == EINVAL || error == ENOTSOCK ) break;
+      // Give other connections a chance to close rather than spinning when out of resources
+      if( error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM ){
+	usleep( HTTP_ACCEPT_BACKOFF * 1000 );
+      }
+      continue;
+    }
+
+    // Serve requests on this connection until the client closes it, asks
+    // us to close it or leaves it idle. Pipelined requests are answered in order.
+    // If no other worker is free, an idle connection gives way to any waiting clients
+    HTTPConnection connection( socket, HTTP_KEEPALIVE_TIMEOUT );
+    HTTPRequest request;
+    while( true ){
+      server.mutex.lock();
+      int listener = ( server.accepting == 0 ) ? server.listen_socket : -1;
+      server.mutex.unlock();
+      if( !connection.read( request, listener ) ) break;
+
+      bool keepalive = request.keepAlive();
+      HTTPWriter writer( socket, request.method == "HEAD", keepalive, request.protocol != "HTTP/1.0" );
+      char** envp = request.getEnvironment();
+
+      // Limit the number of bulk requests running at the same time
+      Scheduler::Priority priority = Scheduler::INTERACTIVE;
+      bool admitted = true;
+      if( server.scheduler ){
+	const char* query = FCGX_GetParam( "QUERY_STRING", envp );
+	priority = Scheduler::classify( query ? query : "" );
+	admitted = server.scheduler->enter( priority );
+      }
+      if( admitted ){
+	this->handle( writer, envp );
+	if( server.scheduler ) server.scheduler->done( priority );
+      }
+      else unavailable( writer, server, "Bulk request rejected" );
+
+      if( !writer.finish() || !keepalive || shutdownRequested ) break;
+    }
+  }
+}
+#endif
+
+
+
+#ifndef DEBUG
+/* Classify an FCGI request which has been read and queue it for our workers
+ */
+static void queue( Server& server, FCGX_Request* request )
+{
+  const char* query = FCGX_GetParam( "QUERY_STRING", request->envp );
+  if( !server.scheduler->push( request, Scheduler::classify( query ? query : "" ) ) ){
+    // Too many bulk requests are already waiting, so reject this one straight away
+    {
+      FCGIWriter writer( request->out );
+      unavailable( writer, server, "Bulk request queue full" );
+    }
+    FCGX_Finish_r( request );
+    keep( server, request );
+  }
+}
+
+
+
+/* Accept FCGI requests, classify them and queue them for our workers. Connections which
+   the web server keeps open between requests (FCGI_KEEP_CONN) are watched together with
+   our listening socket, so that each is only read once a new request arrives on it
+ */
+static void dispatch( Server& server )
+{
+#ifndef WIN32
+
+  // Connections waiting for their next request
+  vector<FCGX_Request*> connections;
+
+  while( !shutdownRequested ){
+
+    // Take any connections handed back by our workers
+    {
+      ScopedLock lock( server.mutex );
+      connections.insert( connections.end(), server.kept.begin(), server.kept.end() );
+      server.kept.clear();
+      char buffer[64];
+      while( read( server.wakeup[0], buffer, sizeof(buffer) ) > 0 );
+    }
+
+    vector<struct pollfd> fds( connections.size() + 2 );
+    fds[0].fd = server.listen_socket;
+    fds[1].fd = server.wakeup[0];
+    for( unsigned int i=0; i<connections.size(); i++ ) fds[i+2].fd = connections[i]->ipcFd;
+    for( unsigned int i=0; i<fds.size(); i++ ){
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+
+    if( poll( &fds[0], fds.size(), -1 ) < 0 ){
+      if( errno == EINTR ) continue;
+      break;
+    }
+
+    // Read new requests from our open connections, closing any the web server has closed.
+    // Go backwards so that we can remove connections as we go
+    for( unsigned int i=connections.size(); i-- > 0; ){
+      if( !fds[i+2].revents ) continue;
+      FCGX_Request* request = connections[i];
+      connections.erase( connections.begin() + i );
+      char c;
+      if( recv( request->ipcFd, &c, 1, MSG_PEEK ) <= 0 ) discard( request, true );
+      else if( FCGX_Accept_r( request ) < 0 ) discard( request );
+      else queue( server, request );
+    }
+
+    // Accept a new connection
+    if( fds[0].revents ){
+      FCGX_Request* request = new FCGX_Request;
+      if( FCGX_InitRequest( request, server.listen_socket, 0 ) || FCGX_Accept_r( request ) < 0 ){
+	delete request;
+	break;
+      }
+      queue( server, request );
+    }
+  }
+
+  for( unsigned int i=0; i<connections.size(); i++ ) discard( connections[i], true );
+
+#else
+
+  while( true ){
+    FCGX_Request* request = new FCGX_Request;
+    if( FCGX_InitRequest( request, server.listen_socket, 0 ) || FCGX_Accept_r( request ) < 0 ){
+      delete request;
+      break;
+    }
+    queue( server, request );
+  }
+
+#endif
+
+  server.scheduler->stop();
+}
+#endif
+
+
+
+void Worker::process( Writer& writer, FCGX_ParamArray envp, ostream& log )
+{
+
+  // Time each request
+  Timer request_timer;
+  if( loglevel >= 2 ) request_timer.start();
+
+  // Take a copy of our settings, which may be changed by a reload
+  Settings settings;
+  server.settingsMutex.lock();
+  settings = server.settings;
+  server.settingsMutex.unlock();
+
+  Task* task = NULL;
+
+
+  // Declare our image pointer here outside of the try scope
+  //  so that we can close the image on exceptions
+  IIPImage *image = NULL;
+  JPEGCompressor jpeg( settings.jpeg_quality );
+  jpeg.setArena( &arena );
+
+
+  // View object for use with the CVT command etc
+  View view;
+  if( settings.max_CVT != -1 ) view.setMaxSize( settings.max_CVT );
+  if( settings.max_layers != 0 ) view.setMaxLayers( settings.max_layers );
+
+
+
+  // Create an IIPResponse object - we use this for the OBJ requests.
+  // As the commands return images etc, they handle their own responses.
+  IIPResponse response;
+  response.setCORS( settings.cors );
+  response.setCacheControl( settings.cache_control );
+
+  try{
+
+    // Set up our session data object
+    Session session;
+    session.image = &image;
+    session.response = &response;
+    session.view = &view;
+    session.jpeg = &jpeg;
+    session.loglevel = loglevel;
+    session.logfile = &log;
+    session.imageCache = server.imageCache;
+    session.imageIndex = server.imageIndex;
+    session.negativeCache = server.negativeCache;
+    session.tileCache = server.tileCache;
+    session.warmer = server.warmer;
+    session.tiffConverter = server.tiffConverter;
+    session.out = &writer;
+    session.arena = &arena;
+    session.regionThreads = server.region_threads;
+    session.statsCommand = server.stats_command;
+    session.watermark = settings.watermark;
+    session.headers.clear();
+
+    char* header = NULL;
+
+    // Get the query into a string
+    header = FCGX_GetParam( "QUERY_STRING", envp );
+
+    const string request_string = (header!=NULL)? header : "";
+
+    // Check that we actually have a request string
+    if( request_string.empty() ){
+      throw string( "QUERY_STRING not set" );
+    }
+
+    if( loglevel >=2 ){
+      log << "Full Request is " << request_string << endl;
+    }
+
+
+    // Store some headers
+    session.headers["QUERY_STRING"] = request_string;
+    session.headers["BASE_URL"] = settings.base_url;
+
+    // Get several other HTTP headers
+    if( (header = FCGX_GetParam("SERVER_PROTOCOL", envp)) ){
+      session.headers["SERVER_PROTOCOL"] = string(header);
+    }
+    if( (header = FCGX_GetParam("HTTP_HOST", envp)) ){
+      session.headers["HTTP_HOST"] = string(header);
+    }
+    if( (header = FCGX_GetParam("REQUEST_URI", envp)) ){
+      session.headers["REQUEST_URI"] = string(header);
+    }
+    if ( (header = FCGX_GetParam("HTTPS", envp)) ) {
+      session.headers["HTTPS"] = string(header);
+    }
+
+    // Check for IF_NONE_MATCH
+    if( (header = FCGX_GetParam("HTTP_IF_NONE_MATCH", envp)) ){
+      session.headers["HTTP_IF_NONE_MATCH"] = string(header);
+      if( loglevel >= 2 ){
+	log << "HTTP Header: If-None-Match: " << header << endl;
+      }
+    }
+
+    // Check for IF_MODIFIED_SINCE
+    if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", envp)) ){
+      session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+      if( loglevel >= 2 ){
+	log << "HTTP Header: If-Modified-Since: " << header << endl;
+      }
+    }
+
+
+#ifdef HAVE_MEMCACHED
+    // Check whether this exists in memcached, but only if we haven't had a conditional
+    // request, which should always be faster to send
+    if( session.headers.find("HTTP_IF_MODIFIED_SINCE") == session.headers.end() &&
+	session.headers.find("HTTP_IF_NONE_MATCH") == session.headers.end() ){
+      char* memcached_response = NULL;
+      if( (memcached_response = memcached.retrieve( request_string )) ){
+	writer.putStr( memcached_response, memcached.length() );
+	writer.flush();
+	free( memcached_response );
+	throw( 100 );
+      }
+    }
+
+    // Record our response so that it can be stored
+    if( memcached.connected() ) writer.capture();
+#endif
+
+
+    // Parse up the command list
+
+    list < pair<string,string> > requests;
+    list < pair<string,string> > :: const_iterator commands;
+
+    Tokenizer izer( request_string, "&" );
+    while( izer.hasMoreTokens() ){
+      pair <string,string> p;
+      string token = izer.nextToken();
+      int n = token.find_first_of( "=" );
+      p.first = token.substr( 0, n );
+      p.second = token.substr( n+1, token.length() );
+      if( p.first.length() && p.second.length() ) requests.push_back( p );
+    }
+
+
+    int i = 0;
+    for( commands = requests.begin(); commands != requests.end(); commands++ ){
+
+      string command = (*commands).first;
+      string argument = (*commands).second;
+
+      if( loglevel >= 2 ){
+	log << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
+	i++;
+      }
+
+      task = Task::factory( command );
+      if( task ) task->run( &session, argument );
+
+      if( !task ){
+	if( loglevel >= 1 ) log << "Unsupported command: " << command << endl;
+	// Unsupported command error code is 2 2
+	response.setError( "2 2", command );
+      }
+
+
+      // Delete our task
+      if( task ){
+	delete task;
+	task = NULL;
+      }
+
+    }
+
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Send out our Errors if necessary ////////////
+    ////////////////////////////////////////////////////////
+
+    /* Make sure something has actually been sent to the client
+       If no response has been sent by now, we must have a malformed command
+     */
+    if( (!response.imageSent()) && (!response.isSet()) ){
+      // Malformed command syntax error code is 2 1
+      response.setError( "2 1", request_string );
+    }
+
+
+    /* Once we have finished parsing all our OBJ and COMMAND requests
+       send out our response.
+     */
+    if( response.isSet() ){
+      if( loglevel >= 4 ){
+	log << "---" << endl <<
+	  response.formatResponse() <<
+	  endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	if( loglevel >= 1 ) log << "Error sending IIPResponse" << endl;
+      }
+    }
+
+
+    ////////////////////////////////////////////////////////
+    ////////// Insert the result into Memcached  ///////////
+    ////////// - Note that we never store errors ///////////
+    //////////   or 304 replies                  ///////////
+    //////////   or uncacheable responses        ///////////
+    ////////////////////////////////////////////////////////
+
+#ifdef HAVE_MEMCACHED
+    if( memcached.connected() && response.isCacheable() ){
+      Timer memcached_timer;
+      memcached_timer.start();
+      size_t len;
+      const char* output = writer.getOutput( len );
+      if( output ) memcached.store( session.headers["QUERY_STRING"], (void*) output, len );
+      if( loglevel >= 3 ){
+	log << "Memcached :: stored " << len << " bytes in "
+		<< memcached_timer.getTime() << " microseconds" << endl;
+      }
+    }
+#endif
+
+
+
+    //////////////////////////////////////////////////////
+    //////////////// End of try block ////////////////////
+    //////////////////////////////////////////////////////
+  }
+
+  /* Use this for sending various HTTP status codes
+   */
+  catch( const int& code ){
+
+    string status;
+
+    switch( code ){
+
+      case 304:
+	status = "Status: 304 Not Modified\r\nServer: iipsrv/" + server.version + "\r\n" + response.getETag() + "\r\n";
+	writer.printf( status.c_str() );
+	writer.flush();
+	if( loglevel >= 2 ){
+	  log << "Sending HTTP 304 Not Modified" << endl;
+	}
+	break;
+
+      case 100:
+	if( loglevel >= 2 ){
+	  log << "Memcached hit" << endl;
+	}
+	break;
+
+      default:
+	if( loglevel >= 1 ){
+	  log << "Unsupported HTTP status code: " << code << endl << endl;
+	}
+     }
+  }
+
+  /* Catch any errors
+   */
+  catch( const string& error ){
+
+    if( loglevel >= 1 ){
+      log << endl << error << endl << endl;
+    }
 
-//#define DEBUG 1
+    if( response.errorIsSet() ){
+      if( loglevel >= 4 ){
+	log << "---" << endl <<
+	  response.formatResponse() <<
+	  endl << "---" << endl;
+      }
+      if( writer.printf( response.formatResponse().c_str() ) == -1 ){
+	if( loglevel >= 1 ) log << "Error sending IIPResponse" << endl;
+      }
+    }
+    else{
+      /* Display our advertising banner ;-)
+       */
+      writer.printf( response.getAdvert( server.version ).c_str() );
+    }
 
-using namespace std;
+  }
 
+  // Image file errors
+  catch( const file_error& error ){
+    string status = "Status: 404 Not Found\r\nServer: iipsrv/" + server.version + "\r\n\r\n" + error.what();
+    writer.printf( status.c_str() );
+    writer.flush();
+    if( loglevel >= 2 ){
+      log << error.what() << endl;
+      log << "Sending HTTP 404 Not Found" << endl;
+    }
+  }
 
+  // Parameter errors
+  catch( const invalid_argument& error ){
+    string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + server.version + "\r\n\r\n" + error.what();
+    writer.printf( status.c_str() );
+    writer.flush();
+    if( loglevel >= 2 ){
+      log << error.what() << endl;
+      log << "Sending HTTP 400 Bad Request" << endl;
+    }
+  }
 
-/* We need to define some variables globally so that the signal handler
-   can have access to them
-*/
-int loglevel;
-ofstream logfile;
-unsigned long IIPcount;
-char *tz = NULL;
+  /* Default catch
+   */
+  catch( ... ){
 
+    if( loglevel >= 1 ){
+      log << "Error: Default Catch: " << endl << endl;
+    }
 
+    /* Display our advertising banner ;-)
+     */
+    writer.printf( response.getAdvert( server.version ).c_str() );
 
-/* Handle a signal - print out some stats and exit
- */
-void IIPSignalHandler( int signal )
-{
-  if( loglevel >= 1 ){
+  }
 
-    // Reset our time zone environment
-    if(tz) setenv("TZ", tz, 1);
-    else unsetenv("TZ");
-    tzset();
 
-    time_t current_time = time( NULL );
-    char *date = ctime( &current_time );
+  /* Do some cleaning up etc. here after all the potential exceptions
+     have been handled
+   */
+  if( task ){
+    delete task;
+    task = NULL;
+  }
+  delete image;
+  image = NULL;
 
-    // No strsignal on Windows
-#ifdef WIN32
-    int sigstr = signal;
-#else
-    char *sigstr = strsignal( signal );
-#endif
+  unsigned long count;
+  server.mutex.lock();
+  count = ++IIPcount;
+  server.mutex.unlock();
 
-    logfile << endl << "Caught " << sigstr << " signal. "
-	    << "Terminating after " << IIPcount << " accesses" << endl
-	    << date
-	    << "<----------------------------------->" << endl << endl;
-    logfile.close();
+
+
+  // How long did this request take?
+  if( loglevel >= 2 ){
+    log << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
   }
 
-  exit( 1 );
-}
 
+  if( loglevel >= 2 ){
+    log << "image closed and deleted" << endl
+	    << "Server count is " << count << endl << endl;
+  }
+
+}
 
 
 
@@ -190,9 +1163,31 @@ int main( int argc, char *argv[] )
 
 #ifndef DEBUG
 
-  FCGX_Request request;
+  // Build a metadata index from a list of images and exit
+  if( argv[1] && (string(argv[1]) == "--build-index") ){
+    if( argc < 4 ){
+      cerr << "Usage: " << argv[0] << " --build-index <image list> <index file>" << endl;
+      return( 1 );
+    }
+    ifstream list( argv[2] );
+    if( !list ){
+      cerr << "Unable to open image list '" << argv[2] << "'" << endl;
+      return( 1 );
+    }
+    Timer index_timer;
+    index_timer.start();
+    int n = ImageIndex::build( list, argv[3], cerr );
+    if( n < 0 ){
+      cerr << "Unable to write index file '" << argv[3] << "'" << endl;
+      return( 1 );
+    }
+    cerr << n << " images indexed in " << index_timer.getTime()/1000000.0 << " seconds" << endl;
+    return( 0 );
+  }
+
   int listen_socket = 0;
   bool standalone = false;
+  bool http = false;
 
   if( argv[1] && (string(argv[1]) == "--bind") ){
     string socket = argv[2];
@@ -213,18 +1208,43 @@ int main( int argc, char *argv[] )
     standalone = true;
     logfile << "Running in standalone mode on socket: " << socket << " with backlog: " << backlog << endl << endl;
   }
+#ifndef WIN32
+  // Alternatively serve HTTP directly
+  else if( argv[1] && (string(argv[1]) == "--http") ){
+    string address = argv[2] ? argv[2] : "";
+    if( !address.length() ){
+      logfile << "No HTTP address specified" << endl << endl;
+      exit(1);
+    }
+    int backlog = DEFAULT_BACKLOG;
+    if( argv[3] && (string(argv[3]) == "--backlog") && argv[4] ){
+      string bklg = argv[4];
+      if( bklg.length() ) backlog = atoi( bklg.c_str() );
+    }
+    listen_socket = HTTPConnection::listen( address, backlog );
+    if( listen_socket < 0 ){
+      logfile << "Unable to open HTTP socket '" << address << "'" << endl << endl;
+      exit(1);
+    }
+    http = true;
+    logfile << "Running as an HTTP server on: " << address << " with backlog: " << backlog << endl << endl;
+  }
+#endif
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  if( !http ){
 
-  // Check whether we are really in FCGI mode - only if we are not in standalone mode
-  if( FCGX_IsCGI() ){
-    if( !standalone ){
-      if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
-      return( 1 );
+    if( FCGX_Init() ) return(1);
+
+    // Check whether we are really in FCGI mode - only if we are not in standalone mode
+    if( FCGX_IsCGI() ){
+      if( !standalone ){
+	if( loglevel >= 1 ) logfile << "CGI-only mode detected" << endl << endl;
+	return( 1 );
+      }
+    }
+    else{
+      if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
     }
-  }
-  else{
-    if( loglevel >= 1 ) logfile << "Running in FCGI mode" << endl << endl;
   }
 
 #endif
@@ -232,7 +1252,18 @@ int main( int argc, char *argv[] )
 
   // Set our maximum image cache size
   float max_image_cache_size = Environment::getMaxImageCacheSize();
-  imageCacheMapType imageCache;
+  unsigned int metadata_cache_size = Environment::getMetadataCacheSize();
+  ImageCache imageCache( metadata_cache_size );
+
+  // Map our metadata index if we have one
+  string metadata_index = Environment::getMetadataIndex();
+  ImageIndex imageIndex;
+  bool indexed = !metadata_index.empty() && imageIndex.open( metadata_index );
+
+  // Set up our cache of missing and unsupported images
+  unsigned int negative_cache_size = Environment::getNegativeCacheSize();
+  unsigned int negative_cache_ttl = Environment::getNegativeCacheTTL();
+  NegativeCache negativeCache( negative_cache_size, negative_cache_ttl );
 
 
   // Get our image pattern variable
@@ -273,9 +1304,61 @@ int main( int argc, char *argv[] )
   string cache_control = Environment::getCacheControl();
 
 
+  // Get our tile cache snapshot settings
+  cache_snapshot = Environment::getCacheSnapshot();
+  cache_snapshot_uncompressed = Environment::getCacheSnapshotUncompressed();
+
+
+  // Get the size of the pinned low resolution tile cache and the number of levels to pin
+  float pinned_cache_size = Environment::getPinnedCacheSize();
+  int pinned_resolutions = Environment::getPinnedResolutions();
+
+
+  // Get our tile cache warm-up file and rate
+  string cache_warmup = Environment::getCacheWarmup();
+  unsigned int cache_warmup_rate = Environment::getCacheWarmupRate();
+  bool cache_warmup_command = Environment::getCacheWarmupCommand();
+
+
+  // Whether to allow clients to view cache statistics
+  bool stats_command = Environment::getStatsCommand();
+
+
+  // Get the directory in which to store tiled pyramids of striped TIFF images
+  string tiff_conversion_dir = Environment::getTiffConversionDir();
+
+
+  // Get the number of worker threads with which to handle requests in parallel
+  int worker_threads = Environment::getWorkerThreads();
+  int region_threads = Environment::getRegionThreads();
+
+
+  // Get the maximum number of bulk requests, such as CVT exports, to process at the
+  // same time, always leaving at least one worker free for interactive requests
+  int bulk_threads = Environment::getBulkThreads();
+  if( bulk_threads <= 0 ) bulk_threads = worker_threads / 2;
+  if( bulk_threads > worker_threads - 1 ) bulk_threads = worker_threads - 1;
+  if( bulk_threads < 1 ) bulk_threads = 1;
+
+
+  // Get the maximum number of waiting bulk requests and the time after which waiting requests are dropped
+  unsigned int bulk_queue_limit = Environment::getBulkQueueLimit();
+  unsigned int request_timeout = Environment::getRequestTimeout();
+
+
   // Print out some information
   if( loglevel >= 1 ){
     logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    logfile << "Setting maximum number of images in metadata cache to " << metadata_cache_size << endl;
+    if( !metadata_index.empty() ){
+      if( indexed ) logfile << "Using metadata index '" << metadata_index << "' of " << imageIndex.size() << " images" << endl;
+      else logfile << "Unable to open metadata index '" << metadata_index << "'" << endl;
+    }
+    if( negative_cache_size > 0 && negative_cache_ttl > 0 ){
+      logfile << "Caching up to " << negative_cache_size << " missing or unsupported images for "
+	      << negative_cache_ttl << " seconds" << endl;
+    }
+    else logfile << "Negative image cache disabled" << endl;
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
@@ -283,6 +1366,32 @@ int main( int argc, char *argv[] )
     logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
     if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
     if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
+    if( !cache_snapshot.empty() ){
+      logfile << "Setting tile cache snapshot file to '" << cache_snapshot << "'";
+      if( cache_snapshot_uncompressed ) logfile << " including uncompressed tiles";
+      logfile << endl;
+    }
+    if( pinned_cache_size > 0 && pinned_resolutions > 0 ){
+      logfile << "Pinning the " << pinned_resolutions << " lowest resolution levels in a "
+	      << pinned_cache_size << "MB tile cache" << endl;
+    }
+    if( !cache_warmup.empty() ){
+      logfile << "Setting tile cache warm-up file to '" << cache_warmup << "' at ";
+      if( cache_warmup_rate > 0 ) logfile << cache_warmup_rate << " tiles per second" << endl;
+      else logfile << "an unlimited rate" << endl;
+      if( cache_warmup_command ) logfile << "Allowing clients to start a tile cache warm-up" << endl;
+    }
+    if( stats_command ) logfile << "Allowing clients to view tile cache statistics" << endl;
+    if( !tiff_conversion_dir.empty() ){
+      logfile << "Converting striped TIFF images to tiled pyramids in '" << tiff_conversion_dir << "'" << endl;
+    }
+    logfile << "Setting number of worker threads to " << worker_threads << endl;
+    logfile << "Setting number of threads per region to " << region_threads << endl;
+    if( worker_threads > 1 ){
+      logfile << "Limiting bulk requests to " << bulk_threads << " worker threads" << endl;
+      if( bulk_queue_limit > 0 ) logfile << "Rejecting bulk requests when " << bulk_queue_limit << " are waiting" << endl;
+      if( request_timeout > 0 ) logfile << "Dropping requests which have waited for more than " << request_timeout << " seconds" << endl;
+    }
     if( max_layers != 0 ){
       logfile << "Setting max quality layers (for supported file formats) to ";
       if( max_layers < 0 ) logfile << "all layers" << endl;
@@ -310,22 +1419,28 @@ int main( int argc, char *argv[] )
   }
 
 
+  // Our settings shared between workers, filled in once everything is set up
+  Server server;
+
 #ifdef HAVE_MEMCACHED
 
   // Get our list of memcached servers if we have any and the timeout
-  string memcached_servers = Environment::getMemcachedServers();
-  unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+  server.memcached_servers = Environment::getMemcachedServers();
+  server.memcached_timeout = Environment::getMemcachedTimeout();
+
+#endif
+
+  // Create the worker which runs in our main thread
+  Worker worker( server );
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
+#ifdef HAVE_MEMCACHED
   if( loglevel >= 1 ){
-    if( memcached.connected() ){
-      logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
-	      << "' with timeout " << memcached_timeout << endl;
+    if( worker.memcachedConnected() ){
+      logfile << "Memcached support enabled. Connected to servers: '" << server.memcached_servers
+	      << "' with timeout " << server.memcached_timeout << endl;
     }
-    else logfile << "Unable to connect to Memcached servers: '" << memcached.error() << "'" << endl;
+    else logfile << "Unable to connect to Memcached servers: '" << worker.memcachedError() << "'" << endl;
   }
-
 #endif
 
 
@@ -388,7 +1503,7 @@ int main( int argc, char *argv[] )
 
 #ifndef WIN32
   signal( SIGUSR1, IIPSignalHandler );
-  signal( SIGHUP, IIPSignalHandler );
+  signal( SIGHUP, IIPReloadHandler );
 #endif
 
   signal( SIGTERM, IIPSignalHandler );
@@ -403,368 +1518,188 @@ int main( int argc, char *argv[] )
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
+  // Seed our random number generator with the millisecond count from a timer
+  Timer timer;
+  srand( timer.getTime() );
 
   // Create our tile cache
-  Cache tileCache( max_image_cache_size );
-  Task* task = NULL;
+  Cache tileCache( max_image_cache_size, pinned_cache_size, pinned_resolutions );
+  tileCachePtr = &tileCache;
+
+  // Reload our tile cache from a previous snapshot if we have one
+  if( !cache_snapshot.empty() ){
+    Timer snapshot_timer;
+    snapshot_timer.start();
+    int n = tileCache.load( cache_snapshot, Environment::getFileSystemPrefix() );
+    if( loglevel >= 1 ){
+      if( n < 0 ) logfile << "No usable cache snapshot found at '" << cache_snapshot << "'" << endl << endl;
+      else logfile << "Cache snapshot: " << n << " tiles loaded from '" << cache_snapshot
+		   << "' in " << snapshot_timer.getTime() << " microseconds" << endl << endl;
+    }
+  }
   
-  /****************
-    Main FCGI loop
-  ****************/
-
-#ifdef DEBUG
-  int status = true;
-  while( status ){
-
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-    status = false;
+  // Start filling our tile cache in the background if requested
+  CacheWarmer warmer( &tileCache, cache_warmup, cache_warmup_rate, jpeg_quality, &watermark, cache_warmup_command );
+  if( !cache_warmup.empty() && warmer.begin() ){
+    if( loglevel >= 1 ) logfile << "Starting tile cache warm-up from '" << cache_warmup << "'" << endl << endl;
+  }
 
-#else
+  // Start our converter of striped TIFF images if requested
+  TiffConverter tiffConverter( tiff_conversion_dir, CONVERSION_TILE_SIZE );
+  bool converting = !tiff_conversion_dir.empty() && tiffConverter.start();
+  if( !tiff_conversion_dir.empty() && !converting && loglevel >= 1 ){
+    logfile << "Unable to start TIFF conversion thread" << endl << endl;
+  }
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
 
-    FCGIWriter writer( request.out );
+  // Fill in our shared settings
+  server.version = version;
+  server.settings.jpeg_quality = jpeg_quality;
+  server.settings.max_CVT = max_CVT;
+  server.settings.max_layers = max_layers;
+  server.settings.cors = cors;
+  server.settings.base_url = base_url;
+  server.settings.cache_control = cache_control;
+  server.settings.watermark = &watermark;
+  server.imageCache = &imageCache;
+  server.imageIndex = indexed ? &imageIndex : NULL;
+  server.negativeCache = ( negative_cache_size > 0 && negative_cache_ttl > 0 ) ? &negativeCache : NULL;
+  server.tileCache = &tileCache;
+  server.warmer = &warmer;
+  server.tiffConverter = converting ? &tiffConverter : NULL;
+  server.listen_socket = 0;
+  server.accepting = 0;
+  server.http = false;
+  server.threaded = ( worker_threads > 1 );
+  server.region_threads = region_threads;
+  server.stats_command = stats_command;
+  server.logger = NULL;
+
+  // Schedule requests by priority if we have more than one worker
+  Scheduler scheduler( bulk_threads, bulk_queue_limit, request_timeout );
+  server.scheduler = server.threaded ? &scheduler : NULL;
 
+#ifndef WIN32
+  // Our dispatcher never blocks on its wake-up pipe and our workers never block writing to it
+  if( server.scheduler && ( pipe( server.wakeup ) != 0 ||
+			    fcntl( server.wakeup[0], F_SETFL, O_NONBLOCK ) == -1 ||
+			    fcntl( server.wakeup[1], F_SETFL, O_NONBLOCK ) == -1 ) ){
+    if( loglevel >= 1 ) logfile << "Unable to create dispatcher pipe: requests will not be scheduled" << endl;
+    server.scheduler = NULL;
+  }
 #endif
 
 
-    // Time each request
-    if( loglevel >= 2 ) request_timer.start();
-
-
-    // Declare our image pointer here outside of the try scope
-    //  so that we can close the image on exceptions
-    IIPImage *image = NULL;
-    JPEGCompressor jpeg( jpeg_quality );
-
-
-    // View object for use with the CVT command etc
-    View view;
-    if( max_CVT != -1 ) view.setMaxSize( max_CVT );
-    if( max_layers != 0 ) view.setMaxLayers( max_layers );
-
-
-
-    // Create an IIPResponse object - we use this for the OBJ requests.
-    // As the commands return images etc, they handle their own responses.
-    IIPResponse response;
-    response.setCORS( cors );
-    response.setCacheControl( cache_control );
-
-    try{
-
-      // Set up our session data object
-      Session session;
-      session.image = &image;
-      session.response = &response;
-      session.view = &view;
-      session.jpeg = &jpeg;
-      session.loglevel = loglevel;
-      session.logfile = &logfile;
-      session.imageCache = &imageCache;
-      session.tileCache = &tileCache;
-      session.out = &writer;
-      session.watermark = &watermark;
-      session.headers.clear();
-
-      char* header = NULL;
+  /****************
+    Main FCGI loop
+  ****************/
 
-      // Get the query into a string
 #ifdef DEBUG
-      header = argv[1];
-#else
-      header = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
-
-      const string request_string = (header!=NULL)? header : "";
-
-      // Check that we actually have a request string
-      if( request_string.empty() ){
-	throw string( "QUERY_STRING not set" );
-      }
-
-      if( loglevel >=2 ){
-	logfile << "Full Request is " << request_string << endl;
-      }
-
-
-      // Store some headers
-      session.headers["QUERY_STRING"] = request_string;
-      session.headers["BASE_URL"] = base_url;
-
-      // Get several other HTTP headers
-      if( (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ){
-        session.headers["SERVER_PROTOCOL"] = string(header);
-      }
-      if( (header = FCGX_GetParam("HTTP_HOST", request.envp)) ){
-        session.headers["HTTP_HOST"] = string(header);
-      }
-      if( (header = FCGX_GetParam("REQUEST_URI", request.envp)) ){
-        session.headers["REQUEST_URI"] = string(header);
-      }
-      if ( (header = FCGX_GetParam("HTTPS", request.envp)) ) {
-        session.headers["HTTPS"] = string(header);
-      }
-
-      // Check for IF_MODIFIED_SINCE
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << header << endl;
-	}
-      }
-
-
-#ifdef HAVE_MEMCACHED
-      // Check whether this exists in memcached, but only if we haven't had an if_modified_since
-      // request, which should always be faster to send
-      if( !header || session.headers["HTTP_IF_MODIFIED_SINCE"].empty() ){
-	char* memcached_response = NULL;
-	if( (memcached_response = memcached.retrieve( request_string )) ){
-	  writer.putStr( memcached_response, memcached.length() );
-	  writer.flush();
-	  free( memcached_response );
-	  throw( 100 );
-	}
-      }
-#endif
-
-
-      // Parse up the command list
-
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
-
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
-      }
-
-
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
-
-	string command = (*commands).first;
-	string argument = (*commands).second;
-
-	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
-	}
-
-	task = Task::factory( command );
-	if( task ) task->run( &session, argument );
-
-	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
-	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
-	}
-
-
-	// Delete our task
-	if( task ){
-	  delete task;
-	  task = NULL;
-	}
-
-      }
-
-
-
-      ////////////////////////////////////////////////////////
-      ////////// Send out our Errors if necessary ////////////
-      ////////////////////////////////////////////////////////
-
-      /* Make sure something has actually been sent to the client
-	 If no response has been sent by now, we must have a malformed command
-       */
-      if( (!response.imageSent()) && (!response.isSet()) ){
-	// Malformed command syntax error code is 2 1
-	response.setError( "2 1", request_string );
-      }
-
-
-      /* Once we have finished parsing all our OBJ and COMMAND requests
-	 send out our response.
-       */
-      if( response.isSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
 
+  // Process the single query given on the command line
+  string query = string( "QUERY_STRING=" ) + ( argv[1] ? argv[1] : "" );
+  char *envp[] = { (char*) query.c_str(), NULL };
 
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
+  FILE *f = fopen( "test.jpg", "w" );
+  FileWriter writer( f );
+  worker.process( writer, envp, logfile );
+  fclose( f );
 
-#ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
-      }
-#endif
-
-
-
-      //////////////////////////////////////////////////////
-      //////////////// End of try block ////////////////////
-      //////////////////////////////////////////////////////
-    }
-
-    /* Use this for sending various HTTP status codes
-     */
-    catch( const int& code ){
-
-      string status;
-
-      switch( code ){
-
-        case 304:
-	  status = "Status: 304 Not Modified\r\nServer: iipsrv/" + version + "\r\n\r\n";
-	  writer.printf( status.c_str() );
-	  writer.flush();
-          if( loglevel >= 2 ){
-	    logfile << "Sending HTTP 304 Not Modified" << endl;
-	  }
-	  break;
-
-        case 100:
-	  if( loglevel >= 2 ){
-	    logfile << "Memcached hit" << endl;
-	  }
-	  break;
-
-        default:
-          if( loglevel >= 1 ){
-	    logfile << "Unsupported HTTP status code: " << code << endl << endl;
-	  }
-       }
-    }
-
-    /* Catch any errors
-     */
-    catch( const string& error ){
+#else
 
+  server.listen_socket = listen_socket;
+  server.http = http;
+  listenSocket = listen_socket;
+
+  // Write our log from a background thread so that requests never wait for it
+  Logger logger( logfile );
+  if( loglevel >= 1 && logger.start() ) server.logger = &logger;
+
+  // Start our workers. With FCGI and more than one worker, the main thread accepts
+  // and queues requests. Otherwise it is our first worker
+  bool dispatcher = ( server.scheduler && !http );
+  vector<Worker*> workers;
+  for( i = dispatcher ? 0 : 1; i<worker_threads; i++ ){
+    Worker* w = new Worker( server );
+    if( w->start() ) workers.push_back( w );
+    else{
+      delete w;
       if( loglevel >= 1 ){
-	logfile << endl << error << endl << endl;
-      }
-
-      if( response.errorIsSet() ){
-	if( loglevel >= 4 ){
-	  logfile << "---" << endl <<
-	    response.formatResponse() <<
-	    endl << "---" << endl;
-	}
-	if( writer.printf( response.formatResponse().c_str() ) == -1 ){
-	  if( loglevel >= 1 ) logfile << "Error sending IIPResponse" << endl;
-	}
-      }
-      else{
-	/* Display our advertising banner ;-)
-	 */
-	writer.printf( response.getAdvert( version ).c_str() );
-      }
-
-    }
-
-    // Image file errors
-    catch( const file_error& error ){
-      string status = "Status: 404 Not Found\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 404 Not Found" << endl;
-      }
-    }
-
-    // Parameter errors
-    catch( const invalid_argument& error ){
-      string status = "Status: 400 Bad Request\r\nServer: iipsrv/" + version + "\r\n\r\n" + error.what();
-      writer.printf( status.c_str() );
-      writer.flush();
-      if( loglevel >= 2 ){
-	logfile << error.what() << endl;
-	logfile << "Sending HTTP 400 Bad Request" << endl;
+	stringstream record;
+	record << "Unable to start worker thread " << i+1 << endl;
+	string r = record.str();
+	writeLog( server, r );
       }
+      break;
     }
+  }
 
-    /* Default catch
-     */
-    catch( ... ){
-
-      if( loglevel >= 1 ){
-	logfile << "Error: Default Catch: " << endl << endl;
-      }
-
-      /* Display our advertising banner ;-)
-       */
-      writer.printf( response.getAdvert( version ).c_str() );
+  if( dispatcher && !workers.empty() ) dispatch( server );
+  else{
+    // Serve requests directly if none of our workers could be started
+    if( dispatcher ) server.scheduler = NULL;
+    worker.loop();
+  }
 
-    }
+  // Ask any other workers to stop and wait for them to finish
+  if( !http ) FCGX_ShutdownPending();
+  for( i=0; i<(int)workers.size(); i++ ){
+    workers[i]->join();
+    delete workers[i];
+  }
 
+  // Close any connections handed back by our workers after our dispatcher stopped
+  for( i=0; i<(int)server.kept.size(); i++ ) discard( server.kept[i], true );
+  server.kept.clear();
 
-    /* Do some cleaning up etc. here after all the potential exceptions
-       have been handled
-     */
-    if( task ){
-      delete task;
-      task = NULL;
-    }
-    delete image;
-    image = NULL;
-    IIPcount ++;
+  // Write out any remaining log records
+  if( server.logger ){
+    long dropped = logger.getDropped();
+    logger.stop();
+    server.logger = NULL;
+    if( dropped > 0 ) logfile << "Logger :: " << dropped << " log records dropped in total" << endl;
+  }
 
-#ifdef DEBUG
-    fclose( f );
 #endif
 
+  // Delete any watermarks created by reloads
+  for( i=0; i<(int)server.watermarks.size(); i++ ) delete server.watermarks[i];
 
+  // Stop any warm-up still in progress and save our cache snapshot
+  warmer.stop();
+  tiffConverter.stop();
+  saveCacheSnapshot();
+  tileCachePtr = NULL;
 
-    // How long did this request take?
-    if( loglevel >= 2 ){
-      logfile << "Total Request Time: " << request_timer.getTime() << " microseconds" << endl;
-    }
+  if( loglevel >= 1 ){
 
+    if( shutdownRequested ){
 
-    if( loglevel >= 2 ){
-      logfile << "image closed and deleted" << endl
-	      << "Server count is " << IIPcount << endl << endl;
-    }
+      // Reset our time zone environment now that no other threads are running
+      if(tz) setenv("TZ", tz, 1);
+      else unsetenv("TZ");
+      tzset();
 
+      time_t current_time = time( NULL );
+      char *date = ctime( &current_time );
 
+      // No strsignal on Windows
+#ifdef WIN32
+      int sigstr = shutdownRequested;
+#else
+      char *sigstr = strsignal( shutdownRequested );
+#endif
 
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
-  }
+      logfile << endl << "Caught " << sigstr << " signal. "
+	      << "Terminating after " << IIPcount << " accesses" << endl
+	      << date
+	      << "<----------------------------------->" << endl << endl;
+    }
+    else logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
 
-  if( loglevel >= 1 ){
-    logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
     logfile.close();
   }
 
-  return( 0 );
+  return( shutdownRequested ? 1 : 0 );
 
 }
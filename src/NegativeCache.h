@@ -0,0 +1,156 @@
+// Negative Image Lookup Cache Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _NEGATIVECACHE_H
+#define _NEGATIVECACHE_H
+
+
+#include <string>
+#include <list>
+#include <ctime>
+
+// For our HASHMAP definition
+#include "Cache.h"
+#include "Thread.h"
+
+
+
+/// Cache of image paths which could not be opened
+/** Failed lookups of missing, unreadable or unsupported images are remembered
+    for a fixed number of seconds, together with their error, so that repeated
+    requests for them can be rejected without touching the file system. As all
+    entries live for the same time, the oldest entry is always the next to expire
+    and is the one evicted when the cache is full. All functions are thread safe.
+ */
+class NegativeCache {
+
+ public:
+
+  /// Type of error recorded for an image
+  enum ErrorType { FILE_ERROR, OTHER_ERROR };
+
+
+ private:
+
+  /// A failed lookup
+  struct Entry {
+    /// Time after which this entry is no longer valid
+    time_t expires;
+    /// Type of error and its message
+    ErrorType type;
+    std::string message;
+    /// Position of this image in our list
+    std::list<std::string>::iterator position;
+  };
+
+  /// Image paths, oldest first
+  std::list<std::string> order;
+
+  /// Entries indexed by image path
+  typedef HASHMAP < std::string, Entry > EntryMap;
+  EntryMap entries;
+
+  /// Maximum number of images and the number of seconds for which they are kept
+  unsigned int maxSize;
+  unsigned int ttl;
+
+  /// Lock protecting our entries
+  Mutex mutex;
+
+  NegativeCache( const NegativeCache& );
+  NegativeCache& operator= ( const NegativeCache& );
+
+
+  /// Remove an image. Our lock must be held
+  void _remove( EntryMap::iterator i ){
+    order.erase( i->second.position );
+    entries.erase( i );
+  };
+
+
+ public:
+
+  /// Constructor
+  /** @param max maximum number of images
+      @param t number of seconds for which a failed lookup is remembered
+   */
+  NegativeCache( unsigned int max, unsigned int t ): maxSize(max), ttl(t) {};
+
+
+  /// Look up an image
+  /** @param path image path
+      @param type set to the type of error recorded for the image
+      @param message set to the error message recorded for the image
+      @return whether the image is known to have failed
+   */
+  bool find( const std::string& path, ErrorType& type, std::string& message ){
+    ScopedLock lock( mutex );
+    EntryMap::iterator i = entries.find( path );
+    if( i == entries.end() ) return false;
+    if( i->second.expires <= time( NULL ) ){
+      this->_remove( i );
+      return false;
+    }
+    type = i->second.type;
+    message = i->second.message;
+    return true;
+  };
+
+
+  /// Record a failed lookup, replacing any existing entry
+  /** @param path image path
+      @param type type of error
+      @param message error message
+   */
+  void insert( const std::string& path, ErrorType type, const std::string& message ){
+    if( maxSize == 0 || ttl == 0 ) return;
+    time_t now = time( NULL );
+    ScopedLock lock( mutex );
+
+    EntryMap::iterator i = entries.find( path );
+    if( i != entries.end() ) this->_remove( i );
+
+    // Drop expired entries and, if still full, our oldest entry
+    while( !order.empty() &&
+	   ( entries.size() >= maxSize || entries[order.front()].expires <= now ) ){
+      this->_remove( entries.find( order.front() ) );
+    }
+
+    order.push_back( path );
+    Entry& e = entries[path];
+    e.expires = now + ttl;
+    e.type = type;
+    e.message = message;
+    e.position = --order.end();
+  };
+
+
+  /// Return the number of images
+  unsigned int size(){
+    ScopedLock lock( mutex );
+    return entries.size();
+  };
+
+};
+
+
+#endif
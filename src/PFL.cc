@@ -113,6 +113,7 @@ void PFL::run( Session* session, const std::string& argument ){
 
   // Create our tilemanager object
   TileManager tilemanager( session->tileCache, *session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  tilemanager.setThreads( session->regionThreads );
 
 
   // Use our horizontal views function to get a list of available spectral images
@@ -193,9 +194,10 @@ void PFL::run( Session* session, const std::string& argument ){
 	    "Server: iipsrv/%s\r\n"
 	    "Content-Type: application/json\r\n"
 	    "Last-Modified: %s\r\n"
+	    "%s"
 	    "%s\r\n"
 	    "\r\n",
-	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str() );
 
   session->out->printf( (const char*) str );
   session->out->flush();
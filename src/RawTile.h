@@ -40,6 +40,26 @@ enum CompressionType { UNCOMPRESSED, JPEG, DEFLATE, PNG };
 enum SampleType { FIXEDPOINT, FLOATINGPOINT };
 
 
+/// Window onto an uncompressed image buffer, such as a region being built, into
+/// which part of a tile can be written directly
+struct RawTileView {
+
+  /// Pointer to the first pixel of the window
+  unsigned char* data;
+
+  /// Number of bytes between the start of successive rows of the window
+  size_t stride;
+
+  /// Offset within the tile of the part to be written
+  unsigned int x, y;
+
+  /// Width and height of the window in pixels
+  unsigned int width, height;
+
+};
+
+
+
 /// Class to represent a single image tile
 
 class RawTile{
@@ -224,6 +244,23 @@ class RawTile{
   int size() { return dataLength; }
 
 
+  /// Copy part of this uncompressed tile into a view
+  /** @param view destination and part of the tile to copy
+      @param row_length number of pixels in each row of our data, which for
+      padded tiles is the basic tile width rather than the width of this tile
+   */
+  void copyTo( const RawTileView& view, unsigned int row_length ) const {
+    size_t bytes = channels * bpc / 8;
+    const unsigned char* src = (const unsigned char*) data + ( (size_t) view.y * row_length + view.x ) * bytes;
+    unsigned char* dst = view.data;
+    for( unsigned int k=0; k<view.height; k++ ){
+      memcpy( dst, src, view.width * bytes );
+      src += row_length * bytes;
+      dst += view.stride;
+    }
+  }
+
+
   /// Overloaded equality operator
   friend int operator == ( const RawTile& A, const RawTile& B ) {
     if( (A.tileNum == B.tileNum) &&
@@ -84,9 +84,10 @@ void SPECTRA::run( Session* session, const std::string& argument ){
 	    "Server: iipsrv/%s\r\n"
 	    "Content-Type: application/xml\r\n"
 	    "Last-Modified: %s\r\n"
+	    "%s"
 	    "%s\r\n"
 	    "\r\n",
-	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	    VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str() );
 
   session->out->printf( (const char*) str );
   session->out->flush();
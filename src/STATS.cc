@@ -0,0 +1,162 @@
+/*
+    IIP STATS Command Handler Class Member Function
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include "Task.h"
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+
+/// Time windows in minutes over which hit ratios are reported
+static const int windows[] = { 1, 5, 15, 60 };
+
+
+/// Format a hit ratio, giving null if there were no lookups
+static string ratio( unsigned long hits, unsigned long misses ){
+  if( hits + misses == 0 ) return "null";
+  stringstream s;
+  s << (double) hits / (double) (hits + misses);
+  return s.str();
+}
+
+
+/// Escape a string for use within a JSON string value
+static string escape( const string& s ){
+  string e;
+  for( unsigned int i=0; i<s.length(); i++ ){
+    unsigned char c = (unsigned char) s[i];
+    if( c == '"' ) e += "\\\"";
+    else if( c == '\\' ) e += "\\\\";
+    else if( c < 0x20 ){
+      char tmp[8];
+      snprintf( tmp, 8, "\\u%04x", (unsigned int) c );
+      e += tmp;
+    }
+    else e += (char) c;
+  }
+  return e;
+}
+
+
+/// Return the tile cache statistics in JSON format
+void STATS::run( Session* session, const std::string& argument ){
+
+  /* The argument is the number of images to list by memory usage
+   */
+
+  if( session->loglevel >= 3 ) (*session->logfile) << "STATS handler reached" << endl;
+
+  // Statistics reveal the paths of cached images, so are only available if enabled
+  if( !session->statsCommand ){
+    if( session->loglevel >= 1 ) (*session->logfile) << "STATS :: Cache statistics are disabled" << endl;
+    session->response->setError( "2 2", "STATS" );
+    session->response->setCacheable( false );
+    return;
+  }
+
+  // Time this command
+  if( session->loglevel >= 2 ) command_timer.start();
+
+  int n = atoi( argument.c_str() );
+  if( n < 0 ) n = 0;
+
+  Cache::Statistics stats;
+  session->tileCache->getStatistics( stats, n );
+
+  const char* types[] = { "uncompressed", "jpeg", "deflate", "png" };
+
+  stringstream json;
+  json << "{" << endl
+       << "  \"tiles\" : {" << endl
+       << "    \"main\" : { \"tiles\" : " << stats.tiles << ", \"bytes\" : " << stats.size
+       << ", \"max_bytes\" : " << stats.maxSize << ", \"evictions\" : " << stats.evictions << " }," << endl
+       << "    \"pinned\" : { \"tiles\" : " << stats.pinnedTiles << ", \"bytes\" : " << stats.pinnedSize
+       << ", \"max_bytes\" : " << stats.pinnedMaxSize << ", \"evictions\" : " << stats.pinnedEvictions << " }" << endl
+       << "  }," << endl
+       << "  \"inserts\" : " << stats.inserts << "," << endl
+       << "  \"stale\" : " << stats.stale << "," << endl
+       << "  \"coalesced\" : " << stats.coalesced << "," << endl
+       << "  \"lookups\" : {" << endl;
+
+  for( int i=0; i<4; i++ ){
+    json << "    \"" << types[i] << "\" : { \"hits\" : " << stats.hits[i]
+	 << ", \"misses\" : " << stats.misses[i] << " }," << endl;
+  }
+  json << "    \"processed\" : { \"hits\" : " << stats.processedHits
+       << ", \"misses\" : " << stats.processedMisses << " }" << endl
+       << "  }," << endl;
+
+  // Hit ratios over our time windows
+  json << "  \"hit_ratio\" : {";
+  for( unsigned int w=0; w<sizeof(windows)/sizeof(int); w++ ){
+    unsigned long hits = 0, misses = 0;
+    for( int i=0; i<windows[w] && i<CACHE_STATS_MINUTES; i++ ){
+      hits += stats.minuteHits[i];
+      misses += stats.minuteMisses[i];
+    }
+    json << ( w ? ", " : " " ) << "\"" << windows[w] << "m\" : " << ratio( hits, misses );
+  }
+  json << " }," << endl;
+
+  // Per-minute lookups, most recent first
+  json << "  \"minutes\" : [";
+  for( int i=0; i<CACHE_STATS_MINUTES; i++ ){
+    json << ( i ? ", " : " " ) << "[" << stats.minuteHits[i] << "," << stats.minuteMisses[i] << "]";
+  }
+  json << " ]," << endl;
+
+  // Images using the most memory
+  json << "  \"images\" : [";
+  for( unsigned int i=0; i<stats.images.size(); i++ ){
+    json << ( i ? "," : "" ) << endl
+	 << "     { \"image\" : \"" << escape( stats.images[i].first ) << "\", \"bytes\" : " << stats.images[i].second << " }";
+  }
+  json << ( stats.images.size() ? "\n  " : " " ) << "]" << endl
+       << "}";
+
+
+  // Get our Access-Control-Allow-Origin value, if any
+  string cors = session->response->getCORS();
+  string eof = "\r\n";
+
+  stringstream header;
+  header << "Server: iipsrv/" << VERSION << eof
+	 << "Content-Type: application/json" << eof
+	 << "Cache-Control: no-cache" << eof;
+  if( !cors.empty() ) header << cors << eof;
+  header << eof;
+
+  // Send the body separately as printf would interpret any % characters in image names
+  string body = json.str();
+  session->out->printf( (const char*) header.str().c_str() );
+  session->out->putStr( body.c_str(), body.length() );
+  session->out->flush();
+
+  // Statistics change with every request, so never store them
+  session->response->setCacheable( false );
+  session->response->setImageSent();
+
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "STATS :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+}
@@ -0,0 +1,123 @@
+/*
+    IIP Request Scheduler Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Scheduler.h"
+#include "Tokenizer.h"
+#include "URL.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+
+using namespace std;
+
+
+
+/// Estimate the largest dimension of the image produced by a IIIF image request
+/** @param argument IIIF path of the form identifier/region/size/rotation/quality.format
+    @param known set to whether the size could be determined
+    @return size in pixels, or 0 if this is not an image request
+ */
+static int iiifSize( const string& argument, bool& known ){
+
+  known = false;
+
+  // Split off the last four path components
+  vector<string> parts;
+  size_t end = argument.length();
+  while( parts.size() < 4 ){
+    size_t slash = argument.rfind( '/', end ? end-1 : 0 );
+    if( slash == string::npos || end == 0 ){
+      // Not an image request, such as a redirect to info.json
+      known = true;
+      return 0;
+    }
+    parts.push_back( argument.substr( slash+1, end-slash-1 ) );
+    end = slash;
+  }
+
+  string size = parts[2];
+  string region = parts[3];
+
+  // Requested region size in pixels, if given
+  int rw = -1, rh = -1;
+  if( region.find( "pct:" ) != 0 && count( region.begin(), region.end(), ',' ) == 3 ){
+    size_t c1 = region.find( ',' );
+    size_t c2 = region.find( ',', c1+1 );
+    size_t c3 = region.find( ',', c2+1 );
+    rw = atoi( region.substr( c2+1, c3-c2-1 ).c_str() );
+    rh = atoi( region.substr( c3+1 ).c_str() );
+  }
+
+  // Remove any upscaling and aspect ratio flags from the size
+  while( !size.empty() && (size[0] == '^' || size[0] == '!') ) size.erase( 0, 1 );
+
+  if( size == "full" || size == "max" ){
+    if( rw < 0 ) return -1;
+    known = true;
+    return max( rw, rh );
+  }
+
+  if( size.find( "pct:" ) == 0 ){
+    if( rw < 0 ) return -1;
+    known = true;
+    return (int) ( max( rw, rh ) * atof( size.substr( 4 ).c_str() ) / 100.0 );
+  }
+
+  size_t comma = size.find( ',' );
+  if( comma == string::npos ) return -1;
+  int w = atoi( size.substr( 0, comma ).c_str() );
+  int h = atoi( size.substr( comma+1 ).c_str() );
+  known = true;
+  return max( w, h );
+}
+
+
+
+Scheduler::Priority Scheduler::classify( const string& query ){
+
+  Tokenizer izer( query, "&" );
+  while( izer.hasMoreTokens() ){
+
+    string token = izer.nextToken();
+    size_t n = token.find_first_of( "=" );
+    if( n == string::npos ) continue;
+
+    string command = token.substr( 0, n );
+    transform( command.begin(), command.end(), command.begin(), ::tolower );
+
+    // Whole image exports
+    if( command == "cvt" ) return BULK;
+
+    // IIIF requests are interactive if they are for metadata or of tile size
+    if( command == "iiif" ){
+      string argument = URL( token.substr( n+1 ) ).decode();
+      if( argument.find( "info.json" ) != string::npos ) return INTERACTIVE;
+      bool known;
+      int size = iiifSize( argument, known );
+      if( !known || size > SCHEDULER_TILE_SIZE ) return BULK;
+    }
+  }
+
+  // Tiles, DeepZoom and Zoomify tiles, and metadata
+  return INTERACTIVE;
+}
@@ -0,0 +1,273 @@
+// Request Scheduler Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+
+#include <deque>
+#include <string>
+#include <fcgiapp.h>
+
+#include "Thread.h"
+#include "Timer.h"
+
+
+/// Requests for images larger than this in either dimension are treated as bulk requests
+#define SCHEDULER_TILE_SIZE 1024
+
+/// Number of seconds after which clients are asked to retry rejected requests
+#define SCHEDULER_RETRY_AFTER 5
+
+
+
+/// Schedule requests so that interactive requests always take priority over bulk exports
+/** Requests are classified as either interactive, such as tile and metadata
+    requests, or bulk, such as CVT exports and large IIIF regions. Each class
+    has its own queue. Interactive requests are always taken first, while the
+    number of bulk requests processed at the same time is limited, so that
+    exports cannot occupy every worker. Under overload, new bulk requests are
+    rejected once too many are waiting and requests which have waited longer
+    than the client is likely to wait are dropped before being processed.
+    All functions are thread safe.
+ */
+class Scheduler {
+
+ public:
+
+  /// Request classes, in order of priority
+  enum Priority { INTERACTIVE = 0, BULK = 1 };
+
+  /// A queued request
+  struct Job {
+    /// FCGI request, which has already been accepted
+    FCGX_Request* request;
+    /// Class of this request
+    Priority priority;
+    /// Time since the request was queued
+    Timer queued;
+  };
+
+
+ private:
+
+  /// Lock protecting our queues and counters
+  Mutex mutex;
+
+  /// Signalled whenever a request is queued or finishes
+  Condition available;
+
+  /// Queued requests for each class
+  std::deque<Job> queues[2];
+
+  /// Number of requests of each class currently being processed
+  unsigned int running[2];
+
+  /// Maximum number of bulk requests processed at the same time
+  unsigned int bulkLimit;
+
+  /// Maximum number of bulk requests waiting to be processed (0 for no limit)
+  unsigned int queueLimit;
+
+  /// Number of seconds after which a waiting request is dropped (0 for no limit)
+  unsigned int timeout;
+
+  /// Number of requests of each class waiting in enter()
+  unsigned int waiting[2];
+
+  /// Number of requests rejected because too many were waiting and dropped as they waited too long
+  unsigned long rejected, expired;
+
+  /// Set once no more requests will be queued
+  bool stopping;
+
+
+ public:
+
+  /// Constructor
+  /** @param bulk maximum number of bulk requests to process at the same time
+      @param queue maximum number of bulk requests waiting to be processed (0 for no limit)
+      @param t number of seconds after which a waiting request is dropped (0 for no limit)
+   */
+  Scheduler( unsigned int bulk, unsigned int queue = 0, unsigned int t = 0 ):
+    bulkLimit( bulk > 0 ? bulk : 1 ), queueLimit(queue), timeout(t),
+    rejected(0), expired(0), stopping(false) {
+    running[INTERACTIVE] = running[BULK] = 0;
+    waiting[INTERACTIVE] = waiting[BULK] = 0;
+  };
+
+
+  /// Classify a request from its query string
+  /** @param query request query string
+      @return request class
+   */
+  static Priority classify( const std::string& query );
+
+
+  /// Queue an accepted request
+  /** @param request FCGI request
+      @param priority class of the request
+      @return false if the request was rejected as too many bulk requests are waiting
+   */
+  bool push( FCGX_Request* request, Priority priority ){
+    Job job;
+    job.request = request;
+    job.priority = priority;
+    job.queued.start();
+    ScopedLock lock( mutex );
+    if( priority == BULK && queueLimit > 0 && queues[BULK].size() >= queueLimit ){
+      rejected++;
+      return false;
+    }
+    queues[priority].push_back( job );
+    available.broadcast();
+    return true;
+  };
+
+
+  /// Check whether a request taken from our queues has waited too long to be worth processing
+  /** The request must still be followed by a call to done()
+      @param job request taken with pop()
+      @return whether the request should be dropped
+   */
+  bool hasExpired( Job& job ){
+    if( timeout == 0 || job.queued.getTime() < (long) timeout * 1000000 ) return false;
+    ScopedLock lock( mutex );
+    expired++;
+    return true;
+  };
+
+
+  /// Take the next request to process, waiting if necessary
+  /** Interactive requests are always taken first. Bulk requests are only taken
+      while fewer than our limit are being processed. Each request taken must be
+      followed by a call to done() once it has been processed.
+      @param job filled in with the next request
+      @return false once we have been stopped and our queues are empty
+   */
+  bool pop( Job& job ){
+    ScopedLock lock( mutex );
+    while( true ){
+      if( !queues[INTERACTIVE].empty() ){
+	job = queues[INTERACTIVE].front();
+	queues[INTERACTIVE].pop_front();
+	break;
+      }
+      if( !queues[BULK].empty() && running[BULK] < bulkLimit ){
+	job = queues[BULK].front();
+	queues[BULK].pop_front();
+	break;
+      }
+      if( stopping && queues[INTERACTIVE].empty() && queues[BULK].empty() ) return false;
+      available.wait( mutex );
+    }
+    running[job.priority]++;
+    return true;
+  };
+
+
+  /// Register a request which has not passed through our queues
+  /** Bulk requests wait until fewer than our limit are being processed and
+      no interactive requests are queued. If accepted, the request must be
+      followed by a call to done()
+      @param priority class of the request
+      @return false if the request was rejected as too many are waiting or it has waited too long
+   */
+  bool enter( Priority priority ){
+    ScopedLock lock( mutex );
+    if( priority == BULK ){
+      if( queueLimit > 0 && waiting[BULK] >= queueLimit ){
+	rejected++;
+	return false;
+      }
+      Timer wait;
+      wait.start();
+      waiting[BULK]++;
+      while( running[BULK] >= bulkLimit || !queues[INTERACTIVE].empty() ){
+	// Wait no longer than our timeout, even if no other request finishes
+	if( timeout == 0 ){
+	  available.wait( mutex );
+	  continue;
+	}
+	long remaining = (long) timeout * 1000 - wait.getTime() / 1000;
+	if( remaining <= 0 ){
+	  waiting[BULK]--;
+	  expired++;
+	  return false;
+	}
+	available.wait( mutex, remaining );
+      }
+      waiting[BULK]--;
+    }
+    running[priority]++;
+    return true;
+  };
+
+
+  /// Signal that a request has been processed
+  /** @param priority class of the request */
+  void done( Priority priority ){
+    ScopedLock lock( mutex );
+    running[priority]--;
+    available.broadcast();
+  };
+
+
+  /// Stop accepting requests: pop() returns false once our queues are empty
+  void stop(){
+    ScopedLock lock( mutex );
+    stopping = true;
+    available.broadcast();
+  };
+
+
+  /// Return the number of queued or waiting requests of a class
+  unsigned int getQueued( Priority priority ){
+    ScopedLock lock( mutex );
+    return queues[priority].size() + waiting[priority];
+  };
+
+
+  /// Return the number of requests rejected as too many were waiting
+  unsigned long getRejected(){
+    ScopedLock lock( mutex );
+    return rejected;
+  };
+
+
+  /// Return the number of requests dropped as they had waited too long
+  unsigned long getExpired(){
+    ScopedLock lock( mutex );
+    return expired;
+  };
+
+
+  /// Return the number of requests of a class being processed
+  unsigned int getRunning( Priority priority ){
+    ScopedLock lock( mutex );
+    return running[priority];
+  };
+
+};
+
+
+#endif
@@ -114,9 +114,10 @@ void TIL::run( Session* session, const std::string& a ){
 	      "Server: iipsrv/%s\r\n"
 	      "Content-Type: application/vnd.netfpx\r\n"
 	      "Last-Modified: %s\r\n"
+	      "%s"
 	      "%s\r\n"
 	      "\r\n",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str() );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str() );
 
     session->out->printf( (const char*)str );
   }
@@ -23,6 +23,7 @@
 
 #include "TPTImage.h"
 #include <sstream>
+#include <vector>
 
 
 using namespace std;
@@ -46,9 +47,29 @@ void TPTImage::openImage() throw (file_error)
     throw file_error( "tiff open failed for: " + filename );
   }
 
+  // Use the tiled pyramid of a striped image if it has been converted, otherwise
+  // have it converted in the background
+  bool striped = !TIFFIsTiled( tiff );
+  derivative.clear();
+  if( striped && converter && getIsFile() ){
+    string path = converter->find( filename, timestamp );
+    TIFF* t;
+    if( !path.empty() && ( t = TIFFOpen( path.c_str(), "rm" ) ) != NULL ){
+      TIFFClose( tiff );
+      tiff = t;
+      derivative = path;
+    }
+  }
+
   // Load our metadata if not already loaded
   if( bpc == 0 ) loadImageInfo( currentX, currentY );
 
+  // Our pyramid has the same resolutions as those we generate for the striped image,
+  // so only whether they are virtual depends on which of the two we are reading
+  if( striped && tile_width > 0 ){
+    virtual_levels = derivative.empty() ? numResolutions - 1 : 0;
+  }
+
   // Insist on a tiled image
   if( (tile_width == 0) && (tile_height == 0) ){
     throw file_error( "TIFF image is not tiled" );
@@ -73,9 +94,16 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   currentX = seq;
   currentY = ang;
 
-  // Get the tile and image sizes
-  TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
-  TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
+  // Get the tile and image sizes. Striped images are read in tiles of the size
+  // of their converted pyramid
+  bool striped = !TIFFIsTiled( tiff );
+  if( striped ){
+    tile_width = tile_height = converter ? converter->getTileSize() : CONVERSION_TILE_SIZE;
+  }
+  else{
+    TIFFGetField( tiff, TIFFTAG_TILEWIDTH, &tile_width );
+    TIFFGetField( tiff, TIFFTAG_TILELENGTH, &tile_height );
+  }
   TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
   TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
   TIFFGetField( tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel );
@@ -93,10 +121,13 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
   TIFFSetDirectory( tiff, 0 );
 
   // Store the list of image dimensions available
+  image_widths.clear();
+  image_heights.clear();
   image_widths.push_back( w );
   image_heights.push_back( h );
 
-  for( count = 0; TIFFReadDirectory( tiff ); count++ ){
+  // Only the first directory of a striped image is used
+  for( count = 0; !striped && TIFFReadDirectory( tiff ); count++ ){
     TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &w );
     TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &h );
     image_widths.push_back( w );
@@ -107,6 +138,22 @@ void TPTImage::loadImageInfo( int seq, int ang ) throw(file_error)
 
   numResolutions = count+1;
 
+  // If our pyramid stops short of a single tile, add virtual resolutions down to that size.
+  // Their tiles are generated by our TileManager from the resolution above and cached as usual
+  virtual_levels = 0;
+  if( tile_width > 0 && tile_height > 0 ){
+    w = image_widths.back();
+    h = image_heights.back();
+    while( (w>tile_width) || (h>tile_height) ){
+      w = (w > 1) ? w/2 : 1;
+      h = (h > 1) ? h/2 : 1;
+      image_widths.push_back( w );
+      image_heights.push_back( h );
+      virtual_levels++;
+    }
+    numResolutions += virtual_levels;
+  }
+
   // Handle various colour spaces
   if( colour == PHOTOMETRIC_CIELAB ) colourspace = CIELAB;
   else if( colour == PHOTOMETRIC_MINISBLACK ) colourspace = GREYSCALE;
@@ -183,14 +230,12 @@ void TPTImage::closeImage()
     _TIFFfree( tile_buf );
     tile_buf = NULL;
   }
+  band_rows = 0;
 }
 
 
-RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+void TPTImage::selectResolution( int seq, int ang, unsigned int res ) throw (file_error)
 {
-  uint32 im_width, im_height, tw, th, ntlx, ntly;
-  uint32 rem_x, rem_y;
-  uint16 colour;
   string filename;
 
 
@@ -202,6 +247,14 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
+  // Virtual resolutions do not exist in the file
+  if( res < virtual_levels ){
+    ostringstream error;
+    error << "TPTImage :: Asked for virtual resolution: " << res;
+    throw file_error( error.str() );
+  }
+
+
   // If we are currently working on a different sequence number, then
   //  close and reload the image.
   if( (currentX != seq) || (currentY != ang) ){
@@ -209,9 +262,9 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
   }
 
 
-  // Open the TIFF if it's not already open
+  // Open the TIFF if it's not already open, using our converted pyramid if we have one
   if( !tiff ){
-    filename = getFileName( seq, ang );
+    filename = derivative.empty() ? getFileName( seq, ang ) : derivative;
     if( ( tiff = TIFFOpen( filename.c_str(), "rm" ) ) == NULL ){
       throw file_error( "tiff open failed for:" + filename );
     }
@@ -235,6 +288,23 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
     throw file_error( "TIFFSetDirectory failed" );
   }
 
+}
+
+
+RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height, tw, th, ntlx, ntly;
+  uint32 rem_x, rem_y;
+  uint16 colour;
+
+
+  // Open our image at the right directory for the resolution
+  selectResolution( seq, ang, res );
+
+
+  // Striped images are read strip by strip
+  if( !TIFFIsTiled( tiff ) ) return getStripTile( seq, ang, res, tile );
+
 
   // Check that a valid tile number was given  
   if( tile >= TIFFNumberOfTiles( tiff ) ) {
@@ -364,3 +434,145 @@ RawTile TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsig
 
 }
 
+
+
+
+RawTile TPTImage::readStrips( int seq, int ang, unsigned int res, unsigned int x, unsigned int y,
+			      unsigned int w, unsigned int h ) throw (file_error)
+{
+  uint32 im_width, im_height, rows_per_strip;
+  uint16 colour, planar;
+
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+  TIFFGetField( tiff, TIFFTAG_PHOTOMETRIC, &colour );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip );
+  TIFFGetFieldDefaulted( tiff, TIFFTAG_PLANARCONFIG, &planar );
+  if( rows_per_strip > im_height ) rows_per_strip = im_height;
+
+  // 1 bit images are unpacked to 8 bits, other packed samples and palettes are not supported
+  if( planar != PLANARCONFIG_CONTIG || colour == PHOTOMETRIC_PALETTE ||
+      ( bpc < 8 && !( bpc == 1 && channels == 1 ) ) ){
+    throw file_error( "TPTImage :: Unsupported striped image layout in " + getFileName( seq, ang ) );
+  }
+
+  if( x + w > im_width || y + h > im_height ){
+    throw file_error( "TPTImage :: Asked for region outside of image" );
+  }
+
+  // JPEG encoded strips can be subsampled YCbCr encoded. Ask to decode these to RGB
+  if( colour == PHOTOMETRIC_YCBCR ){
+    TIFFSetField( tiff, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+  }
+
+  unsigned int np = w * h;
+  unsigned int obpc = ( bpc == 1 ) ? 8 : bpc;
+  unsigned int pixel = channels * obpc/8;
+
+  RawTile rawtile( 0, res, seq, ang, w, h, channels, obpc );
+  if( obpc == 16 ) rawtile.data = new unsigned short[np*channels];
+  else if( obpc == 32 && sampleType == FIXEDPOINT ) rawtile.data = new unsigned int[np*channels];
+  else if( obpc == 32 ) rawtile.data = new float[np*channels];
+  else rawtile.data = new unsigned char[np*channels];
+  rawtile.dataLength = np * pixel;
+  rawtile.filename = getImagePath();
+  rawtile.timestamp = timestamp;
+  rawtile.sampleType = sampleType;
+
+  // Make sure each decoded row holds exactly the pixels we expect, so that we never
+  // read beyond it, for instance with subsampled YCbCr data
+  unsigned int line = TIFFScanlineSize( tiff );
+  unsigned int expected = ( bpc == 1 ) ? (im_width+7)/8 : im_width * channels * bpc/8;
+  if( line != expected ){
+    throw file_error( "TPTImage :: Unsupported striped image layout in " + getFileName( seq, ang ) );
+  }
+
+  // Copy out the columns we need from each row, decoding a new band whenever a row is
+  // not in our current one. Our tile owns its data, so it is freed if we fail
+  for( unsigned int row = y; row < y + h; row++ ){
+
+    if( band_rows == 0 || row < band_top || row >= band_top + band_rows ){
+
+      unsigned int top = ( row / tile_height ) * tile_height;
+      unsigned int rows = ( im_height - top < tile_height ) ? im_height - top : tile_height;
+      band_rows = 0;
+      band.resize( (size_t) rows * line );
+
+      // Most codecs cannot skip rows, so decode forward from where libtiff has got to
+      // within the strip holding our band, or otherwise from the start of that strip,
+      // discarding any rows above our band
+      unsigned int first = ( top / rows_per_strip ) * rows_per_strip;
+      unsigned int current = TIFFCurrentRow( tiff );
+      unsigned int start = ( TIFFCurrentStrip( tiff ) == TIFFComputeStrip( tiff, top, 0 ) &&
+			     current >= first && current <= top ) ? current : first;
+
+      for( unsigned int r = start; r < top + rows; r++ ){
+	unsigned char *buf = ( r < top ) ? &band[0] : &band[(size_t)(r - top) * line];
+	if( TIFFReadScanline( tiff, buf, r, 0 ) == -1 ){
+	  throw file_error( "TIFFReadScanline failed for " + getFileName( seq, ang ) );
+	}
+      }
+
+      band_top = top;
+      band_rows = rows;
+    }
+
+    const unsigned char *src = &band[(size_t)(row - band_top) * line];
+    unsigned char *out = (unsigned char*) rawtile.data + (row - y) * w * pixel;
+
+    if( bpc == 1 ){
+      // Take into account photometric interpretation:
+      //   0: white is zero, 1: black is zero
+      unsigned char min = (colour == 0) ? 255 : 0;
+      unsigned char max = (colour == 0) ? 0 : 255;
+      for( unsigned int i=0; i<w; i++ ){
+	unsigned int b = x + i;
+	out[i] = ( src[b/8] & (0x80 >> (b%8)) ) ? max : min;
+      }
+    }
+    else memcpy( out, &src[x*pixel], w*pixel );
+  }
+
+  return( rawtile );
+
+}
+
+
+RawTile TPTImage::getStripTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error)
+{
+  uint32 im_width, im_height;
+
+  TIFFGetField( tiff, TIFFTAG_IMAGEWIDTH, &im_width );
+  TIFFGetField( tiff, TIFFTAG_IMAGELENGTH, &im_height );
+
+  // Our tiles are laid out as for a tiled image
+  unsigned int ntlx = (im_width / tile_width) + (im_width % tile_width == 0 ? 0 : 1);
+  unsigned int x = (tile % ntlx) * tile_width;
+  unsigned int y = (tile / ntlx) * tile_height;
+  if( y >= im_height ){
+    ostringstream tile_no;
+    tile_no << "Asked for non-existent tile: " << tile;
+    throw file_error( tile_no.str() );
+  }
+  unsigned int tw = ( im_width - x < tile_width ) ? im_width - x : tile_width;
+  unsigned int th = ( im_height - y < tile_height ) ? im_height - y : tile_height;
+
+  RawTile rawtile = readStrips( seq, ang, res, x, y, tw, th );
+  rawtile.tileNum = tile;
+
+  return( rawtile );
+
+}
+
+
+RawTile TPTImage::getRegion( int seq, int ang, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h ) throw (file_error)
+{
+  // Open our image at the right directory for the resolution
+  selectResolution( seq, ang, res );
+
+  if( TIFFIsTiled( tiff ) || x < 0 || y < 0 ){
+    throw file_error( "TPTImage :: Regions can only be read directly from striped images" );
+  }
+
+  return readStrips( seq, ang, res, x, y, w, h );
+}
@@ -25,9 +25,10 @@
 
 
 #include "IIPImage.h"
+#include "TiffConverter.h"
 #include <tiff.h>
 #include <tiffio.h>
-
+#include <vector>
 
 
 
@@ -42,21 +43,68 @@ class TPTImage : public IIPImage {
   /// Tile data buffer pointer
   tdata_t tile_buf;
 
+  /// Converter of striped images to tiled pyramids, if any
+  TiffConverter* converter;
+
+  /// Path of the converted pyramid we are reading instead of a striped image
+  std::string derivative;
+
+  /// Rows of a striped image decoded by our last read, one tile height band of the full width
+  std::vector<unsigned char> band;
+
+  /// First row and number of rows held in our band
+  unsigned int band_top, band_rows;
+
+
+  /// Read part of a striped image from bands of one tile height
+  /** Rows are decoded one scanline at a time into a band of the full image width, aligned to
+      our tile rows, whatever the size of the strips. Our last band is kept, so that the
+      neighbouring tiles of a tile row and consecutive regions are served from it rather
+      than being decoded again. 1 bit images are unpacked to 8 bits
+      @param seq horizontal sequence angle
+      @param ang vertical sequence angle
+      @param res resolution
+      @param x left edge
+      @param y top edge
+      @param w width
+      @param h height
+   */
+  RawTile readStrips( int seq, int ang, unsigned int res, unsigned int x, unsigned int y,
+		      unsigned int w, unsigned int h ) throw (file_error);
+
+  /// Open the image or derivative for a sequence position and select its directory for a resolution
+  /** @param seq horizontal sequence angle
+      @param ang vertical sequence angle
+      @param res resolution
+   */
+  void selectResolution( int seq, int ang, unsigned int res ) throw (file_error);
+
+  /// Read a tile of a striped image
+  /** @param seq horizontal sequence angle
+      @param ang vertical sequence angle
+      @param res resolution
+      @param tile tile number
+   */
+  RawTile getStripTile( int seq, int ang, unsigned int res, unsigned int tile ) throw (file_error);
+
 
  public:
 
   /// Constructor
-  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage():IIPImage(), tiff( NULL ), tile_buf( NULL ),
+    converter( NULL ), band_top( 0 ), band_rows( 0 ) {};
 
   /// Constructor
   /** @param path image path
    */
-  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ) {};
+  TPTImage( const std::string& path ): IIPImage( path ), tiff( NULL ), tile_buf( NULL ),
+    converter( NULL ), band_top( 0 ), band_rows( 0 ) {};
 
   /// Copy Constructor
   /** @param image IIPImage object
    */
-  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ) {};
+  TPTImage( const TPTImage& image ): IIPImage( image ), tiff( NULL ),tile_buf( NULL ),
+    converter( image.converter ), derivative( image.derivative ), band_top( 0 ), band_rows( 0 ) {};
 
   /// Assignment Operator
   /** @param image TPTImage object
@@ -67,6 +115,9 @@ class TPTImage : public IIPImage {
       IIPImage::operator=(image);
       tiff = image.tiff;
       tile_buf = image.tile_buf;
+      converter = image.converter;
+      derivative = image.derivative;
+      band_rows = 0;
     }
     return *this;
   }
@@ -75,12 +126,25 @@ class TPTImage : public IIPImage {
   /** @param image IIPImage object
    */
   TPTImage( const IIPImage& image ): IIPImage( image ) {
-    tiff = NULL; tile_buf = NULL; 
+    tiff = NULL; tile_buf = NULL; converter = NULL;
+    band_top = 0; band_rows = 0;
   };
 
   /// Destructor
   ~TPTImage() { closeImage(); };
 
+  /// Overloaded function returning an unopened copy of this image
+  IIPImage* clone() { return new TPTImage( *this ); };
+
+  /// Set the converter with which striped images are converted to tiled pyramids
+  /** Without a converter, striped images are always read from their strips
+      @param c converter
+   */
+  void setConverter( TiffConverter* c ){ converter = c; };
+
+  /// Overloaded function returning the number of virtual resolutions generated by the TileManager
+  unsigned int getVirtualTileLevels() { return virtual_levels; };
+
   /// Overloaded function for opening a TIFF image
   void openImage() throw (file_error);
 
@@ -102,6 +166,24 @@ class TPTImage : public IIPImage {
    */
   RawTile getTile( int x, int y, unsigned int r, int l, unsigned int t ) throw (file_error);
 
+  /// Overloaded function returning whether we decode regions directly: true for striped images
+  /** Only the full resolution of striped images is read directly, as their other
+      resolutions are generated by the TileManager
+   */
+  bool regionDecoding(){ return tiff && !TIFFIsTiled( tiff ); };
+
+  /// Overloaded function for getting a region of the full resolution of a striped image
+  /** @param ha horizontal sequence angle
+      @param va vertical sequence angle
+      @param r resolution
+      @param l quality layers
+      @param x left edge
+      @param y top edge
+      @param w width
+      @param h height
+   */
+  RawTile getRegion( int ha, int va, unsigned int r, int l, int x, int y, unsigned int w, unsigned int h ) throw (file_error);
+
 };
 
 
@@ -64,6 +64,8 @@ Task* Task::factory( const string& t ){
   else if( type == "deepzoom" ) return new DeepZoom;
   else if( type == "ctw" ) return new CTW;
   else if( type == "iiif" ) return new IIIF;
+  else if( type == "wrm" ) return new WRM;
+  else if( type == "stats" ) return new STATS;
   else return NULL;
 
 }
@@ -98,6 +100,41 @@ void QLT::run( Session* session, const string& argument ){
 }
 
 
+void WRM::run( Session* session, const string& argument ){
+
+  if( session->loglevel >= 3 ) *(session->logfile) << "WRM handler reached" << endl;
+
+  // The status changes over time, so never store this response
+  session->response->setCacheable( false );
+
+  // Only the warm-up file configured at startup can be used. The argument
+  // selects whether to start a new warm-up or simply report the status
+  string arg = argument;
+  transform( arg.begin(), arg.end(), arg.begin(), ::tolower );
+
+  if( !session->warmer || session->warmer->getFile().empty() ){
+    session->response->addResponse( "Cache-Warmup:disabled" );
+    return;
+  }
+
+  // Starting a warm-up decodes many tiles, so is only allowed if enabled
+  if( arg == "start" && !session->warmer->commandEnabled() ){
+    if( session->loglevel >= 1 ) *(session->logfile) << "WRM :: Starting a tile cache warm-up is disabled" << endl;
+  }
+  else if( arg == "start" ){
+    if( session->warmer->begin() ){
+      if( session->loglevel >= 1 ){
+	*(session->logfile) << "WRM :: Starting tile cache warm-up from '" << session->warmer->getFile() << "'" << endl;
+      }
+    }
+    else if( session->loglevel >= 2 ) *(session->logfile) << "WRM :: Tile cache warm-up already running" << endl;
+  }
+
+  session->response->addResponse( "Cache-Warmup", session->warmer->isRunning() ? 1 : 0,
+				  (int) session->warmer->getTilesWarmed() );
+}
+
+
 void SDS::run( Session* session, const string& argument ){
 
   if( session->loglevel >= 3 ) *(session->logfile) << "SDS handler reached" << endl;
@@ -34,7 +34,13 @@
 #include "Timer.h"
 #include "Writer.h"
 #include "Cache.h"
+#include "ImageCache.h"
+#include "ImageIndex.h"
+#include "NegativeCache.h"
+#include "CacheWarmer.h"
+#include "TiffConverter.h"
 #include "Watermark.h"
+#include "Arena.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
 #endif
@@ -48,20 +54,6 @@
 
 
 
-#ifdef HAVE_EXT_POOL_ALLOCATOR
-#include <ext/pool_allocator.h>
-typedef HASHMAP < std::string, IIPImage,
-			      __gnu_cxx::hash< const std::string >,
-			      std::equal_to< const std::string >,
-			      __gnu_cxx::__pool_alloc< std::pair<const std::string,IIPImage> >
-			      > imageCacheMapType;
-#else
-typedef HASHMAP <std::string,IIPImage> imageCacheMapType;
-#endif
-
-
-
-
 
 
 /// Structure to hold our session data
@@ -75,19 +67,22 @@ struct Session {
   IIPResponse* response;
   Watermark* watermark;
   int loglevel;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   std::map <const std::string, std::string> headers;
 
-  imageCacheMapType *imageCache;
+  ImageCache* imageCache;
+  ImageIndex* imageIndex;
+  NegativeCache* negativeCache;
   Cache* tileCache;
+  CacheWarmer* warmer;
+  TiffConverter* tiffConverter;
 #ifdef REMOTE_IO
   CurlSession* curl;
 #endif
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
-#endif
+  Writer* out;
+  Arena* arena;
+  unsigned int regionThreads;
+  bool statsCommand;
 
 };
 
@@ -341,5 +336,19 @@ class CTW : public Task {
 };
 
 
+/// Tile Cache Warm-up Command
+class WRM : public Task {
+ public:
+  void run( Session* session, const std::string& argument );
+};
+
+
+/// Tile Cache Statistics Command
+class STATS : public Task {
+ public:
+  void run( Session* session, const std::string& argument );
+};
+
+
 
 #endif
@@ -0,0 +1,292 @@
+// Simple Threading Primitives
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _THREAD_H
+#define _THREAD_H
+
+
+#ifdef WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+
+
+/// Mutual exclusion lock
+class Mutex {
+
+  friend class Condition;
+
+ private:
+
+#ifdef WIN32
+  CRITICAL_SECTION mutex;
+#else
+  pthread_mutex_t mutex;
+#endif
+
+  // Mutexes cannot be copied
+  Mutex( const Mutex& );
+  Mutex& operator= ( const Mutex& );
+
+
+ public:
+
+  /// Constructor
+  Mutex(){
+#ifdef WIN32
+    InitializeCriticalSection( &mutex );
+#else
+    pthread_mutex_init( &mutex, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Mutex(){
+#ifdef WIN32
+    DeleteCriticalSection( &mutex );
+#else
+    pthread_mutex_destroy( &mutex );
+#endif
+  };
+
+  /// Acquire the lock, blocking if necessary
+  void lock(){
+#ifdef WIN32
+    EnterCriticalSection( &mutex );
+#else
+    pthread_mutex_lock( &mutex );
+#endif
+  };
+
+  /// Try to acquire the lock without blocking
+  /** @return whether the lock was acquired */
+  bool tryLock(){
+#ifdef WIN32
+    return TryEnterCriticalSection( &mutex ) != 0;
+#else
+    return pthread_mutex_trylock( &mutex ) == 0;
+#endif
+  };
+
+  /// Release the lock
+  void unlock(){
+#ifdef WIN32
+    LeaveCriticalSection( &mutex );
+#else
+    pthread_mutex_unlock( &mutex );
+#endif
+  };
+
+};
+
+
+
+/// Lock a mutex for the lifetime of this object
+class ScopedLock {
+
+ private:
+
+  Mutex& mutex;
+
+  ScopedLock( const ScopedLock& );
+  ScopedLock& operator= ( const ScopedLock& );
+
+ public:
+
+  /// Constructor
+  /** @param m mutex to lock */
+  ScopedLock( Mutex& m ): mutex(m) { mutex.lock(); };
+
+  /// Destructor: releases the lock
+  ~ScopedLock(){ mutex.unlock(); };
+
+};
+
+
+
+/// Condition variable
+class Condition {
+
+ private:
+
+#ifdef WIN32
+  CONDITION_VARIABLE condition;
+#else
+  pthread_cond_t condition;
+#endif
+
+  Condition( const Condition& );
+  Condition& operator= ( const Condition& );
+
+
+ public:
+
+  /// Constructor
+  Condition(){
+#ifdef WIN32
+    InitializeConditionVariable( &condition );
+#else
+    pthread_cond_init( &condition, NULL );
+#endif
+  };
+
+  /// Destructor
+  ~Condition(){
+#ifndef WIN32
+    pthread_cond_destroy( &condition );
+#endif
+  };
+
+  /// Wait for the condition to be signalled
+  /** @param m mutex which must be locked by the caller */
+  void wait( Mutex& m ){
+#ifdef WIN32
+    SleepConditionVariableCS( &condition, &m.mutex, INFINITE );
+#else
+    pthread_cond_wait( &condition, &m.mutex );
+#endif
+  };
+
+  /// Wait for the condition to be signalled or for a time limit to pass
+  /** @param m mutex which must be locked by the caller
+      @param ms maximum time to wait in milliseconds
+      @return false if our time limit passed
+   */
+  bool wait( Mutex& m, unsigned long ms ){
+#ifdef WIN32
+    return SleepConditionVariableCS( &condition, &m.mutex, ms ) != 0;
+#else
+    struct timeval now;
+    gettimeofday( &now, NULL );
+    unsigned long long usec = (unsigned long long) now.tv_usec + (unsigned long long) ms * 1000;
+    struct timespec until;
+    until.tv_sec = now.tv_sec + usec / 1000000;
+    until.tv_nsec = ( usec % 1000000 ) * 1000;
+    return pthread_cond_timedwait( &condition, &m.mutex, &until ) == 0;
+#endif
+  };
+
+  /// Wake up one waiting thread
+  void signal(){
+#ifdef WIN32
+    WakeConditionVariable( &condition );
+#else
+    pthread_cond_signal( &condition );
+#endif
+  };
+
+  /// Wake up all waiting threads
+  void broadcast(){
+#ifdef WIN32
+    WakeAllConditionVariable( &condition );
+#else
+    pthread_cond_broadcast( &condition );
+#endif
+  };
+
+};
+
+
+
+/// Base class for objects which run in their own thread
+/** Derived classes implement run(). Signals are blocked within the new thread
+    so that they continue to be delivered to the main thread.
+ */
+class Thread {
+
+ private:
+
+#ifdef WIN32
+  HANDLE thread;
+  static unsigned __stdcall _run( void* t ){
+    static_cast<Thread*>(t)->run();
+    return 0;
+  };
+#else
+  pthread_t thread;
+  static void* _run( void* t ){
+    static_cast<Thread*>(t)->run();
+    return NULL;
+  };
+#endif
+
+  bool started;
+
+  Thread( const Thread& );
+  Thread& operator= ( const Thread& );
+
+
+ protected:
+
+  /// Function executed in the new thread
+  virtual void run() = 0;
+
+
+ public:
+
+  /// Constructor
+  Thread(): started(false) {};
+
+  /// Destructor
+  virtual ~Thread() {};
+
+  /// Start the thread
+  /** @return whether the thread was successfully created */
+  bool start(){
+    if( started ) return false;
+#ifdef WIN32
+    thread = (HANDLE) _beginthreadex( NULL, 0, &Thread::_run, this, 0, NULL );
+    started = ( thread != 0 );
+#else
+    sigset_t all, old;
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+    started = ( pthread_create( &thread, NULL, &Thread::_run, this ) == 0 );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+#endif
+    return started;
+  };
+
+  /// Wait for the thread to finish
+  void join(){
+    if( !started ) return;
+#ifdef WIN32
+    WaitForSingleObject( thread, INFINITE );
+    CloseHandle( thread );
+#else
+    pthread_join( thread, NULL );
+#endif
+    started = false;
+  };
+
+  /// Whether the thread has been started and not yet joined
+  bool isStarted(){ return started; };
+
+};
+
+
+#endif
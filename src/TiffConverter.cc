@@ -0,0 +1,436 @@
+/*
+    IIP Background TIFF Pyramid Conversion Member Functions
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TiffConverter.h"
+
+#include <tiff.h>
+#include <tiffio.h>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+
+/// Pixel format of a converted image
+struct Format {
+  uint16 photometric;
+  uint16 channels;
+  uint16 bpc;
+  uint16 sampleformat;
+  vector<uint16> extrasamples;
+};
+
+
+/// A resolution of the pyramid being built
+struct Level {
+  /// Size of this resolution
+  unsigned int width, height;
+  /// Number of rows received and the number of these held in our band
+  unsigned int row, rows;
+  /// Rows of the current row of tiles
+  vector<unsigned char> band;
+  /// Even row waiting to be reduced with the row below it
+  vector<unsigned char> pending;
+  /// Reduced row passed to the next resolution
+  vector<unsigned char> reduced;
+  /// Output file and its path
+  TIFF* tiff;
+  string path;
+};
+
+
+/// A pyramid being built
+struct Pyramid {
+  Format format;
+  unsigned int tileSize;
+  /// Number of bytes per pixel
+  unsigned int pixel;
+  vector<Level> levels;
+  /// Buffer for a single tile
+  vector<unsigned char> tile;
+};
+
+
+
+/// Reduce two rows by 2x2 box filtering
+/** @param row1 first row
+    @param row2 second row
+    @param width width of our input rows
+    @param out output row
+    @param w width of our output row
+    @param channels number of channels
+ */
+template <class T, class A> static void reduceRow( const T* row1, const T* row2, unsigned int width,
+						   T* out, unsigned int w, unsigned int channels ){
+  for( unsigned int i=0; i<w; i++ ){
+    // Rows only one pixel wide are not reduced horizontally
+    unsigned int a = 2*i*channels;
+    unsigned int b = ( 2*i+1 < width ) ? a + channels : a;
+    for( unsigned int k=0; k<channels; k++ ){
+      A sum = (A) row1[a+k] + (A) row1[b+k] + (A) row2[a+k] + (A) row2[b+k];
+      *out++ = (T) ( sum / 4 );
+    }
+  }
+}
+
+
+
+/// Set the fields of a resolution of our pyramid
+static void setFields( TIFF* tiff, const Format& f, unsigned int width, unsigned int height,
+		       unsigned int tileSize, bool reduced ){
+  TIFFSetField( tiff, TIFFTAG_SUBFILETYPE, reduced ? FILETYPE_REDUCEDIMAGE : 0 );
+  TIFFSetField( tiff, TIFFTAG_IMAGEWIDTH, width );
+  TIFFSetField( tiff, TIFFTAG_IMAGELENGTH, height );
+  TIFFSetField( tiff, TIFFTAG_TILEWIDTH, tileSize );
+  TIFFSetField( tiff, TIFFTAG_TILELENGTH, tileSize );
+  TIFFSetField( tiff, TIFFTAG_SAMPLESPERPIXEL, f.channels );
+  TIFFSetField( tiff, TIFFTAG_BITSPERSAMPLE, f.bpc );
+  TIFFSetField( tiff, TIFFTAG_SAMPLEFORMAT, f.sampleformat );
+  TIFFSetField( tiff, TIFFTAG_PHOTOMETRIC, f.photometric );
+  TIFFSetField( tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+  TIFFSetField( tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE );
+  if( !f.extrasamples.empty() ){
+    TIFFSetField( tiff, TIFFTAG_EXTRASAMPLES, (uint16) f.extrasamples.size(), &f.extrasamples[0] );
+  }
+}
+
+
+
+/// Write out the band of a resolution as a row of tiles
+static bool writeBand( Pyramid& p, Level& l ){
+
+  unsigned int ts = p.tileSize;
+  unsigned int y = l.row - l.rows;
+  unsigned int line = l.width * p.pixel;
+
+  for( unsigned int x=0; x<l.width; x+=ts ){
+    unsigned int w = ( l.width - x < ts ) ? l.width - x : ts;
+    // Edge tiles are padded with zeros
+    if( w < ts || l.rows < ts ) memset( &p.tile[0], 0, p.tile.size() );
+    for( unsigned int j=0; j<l.rows; j++ ){
+      memcpy( &p.tile[j*ts*p.pixel], &l.band[j*line + x*p.pixel], w*p.pixel );
+    }
+    if( TIFFWriteEncodedTile( l.tiff, TIFFComputeTile( l.tiff, x, y, 0, 0 ),
+			      &p.tile[0], p.tile.size() ) == -1 ) return false;
+  }
+
+  l.rows = 0;
+  return true;
+}
+
+
+
+/// Add a row to a resolution, passing reduced rows on to the next resolution
+static bool pushRow( Pyramid& p, unsigned int n, const unsigned char* data ){
+
+  Level& l = p.levels[n];
+  unsigned int line = l.width * p.pixel;
+  unsigned int r = l.row++;
+
+  memcpy( &l.band[l.rows*line], data, line );
+  l.rows++;
+  if( l.rows == p.tileSize || l.row == l.height ){
+    if( !writeBand( p, l ) ) return false;
+  }
+
+  if( n+1 == p.levels.size() ) return true;
+
+  // Even rows wait for the row below them, except in images only one row high
+  const unsigned char* first = data;
+  if( r % 2 == 0 ){
+    if( l.height > 1 ){
+      memcpy( &l.pending[0], data, line );
+      return true;
+    }
+  }
+  else first = &l.pending[0];
+
+  Level& next = p.levels[n+1];
+  unsigned int channels = p.format.channels;
+
+  if( p.format.bpc == 16 ){
+    reduceRow<unsigned short,unsigned int>( (const unsigned short*) first, (const unsigned short*) data, l.width,
+					    (unsigned short*) &l.reduced[0], next.width, channels );
+  }
+  else if( p.format.bpc == 32 && p.format.sampleformat == SAMPLEFORMAT_IEEEFP ){
+    reduceRow<float,float>( (const float*) first, (const float*) data, l.width,
+			    (float*) &l.reduced[0], next.width, channels );
+  }
+  else if( p.format.bpc == 32 ){
+    reduceRow<unsigned int,unsigned long long>( (const unsigned int*) first, (const unsigned int*) data, l.width,
+						(unsigned int*) &l.reduced[0], next.width, channels );
+  }
+  else{
+    reduceRow<unsigned char,unsigned int>( first, data, l.width, &l.reduced[0], next.width, channels );
+  }
+
+  return pushRow( p, n+1, &l.reduced[0] );
+}
+
+
+
+string TiffConverter::getDerivativePath( const string& path ){
+
+  // 64 bit FNV-1a hash of our image path
+  unsigned long long hash = 14695981039346656037ULL;
+  for( unsigned int i=0; i<path.length(); i++ ){
+    hash ^= (unsigned char) path[i];
+    hash *= 1099511628211ULL;
+  }
+
+  // Include our tile size, so that changing it creates new derivatives
+  char name[64];
+  snprintf( name, 64, "%016llx_%u.tif", hash, tileSize );
+
+  if( !directory.empty() && directory[directory.length()-1] != '/' ) return directory + "/" + name;
+  return directory + name;
+}
+
+
+
+string TiffConverter::find( const string& path, time_t mtime ){
+
+  string derivative = this->getDerivativePath( path );
+
+  struct stat sb;
+  if( stat( derivative.c_str(), &sb ) == 0 && sb.st_mtime >= mtime ) return derivative;
+
+  ScopedLock lock( mutex );
+
+  if( stopping || pending.find( path ) != pending.end() ) return string();
+
+  map<string,time_t>::iterator f = failed.find( path );
+  if( f != failed.end() ){
+    if( f->second == mtime ) return string();
+    failed.erase( f );
+  }
+
+  pending.insert( path );
+  queue.push_back( path );
+  condition.signal();
+
+  return string();
+}
+
+
+
+void TiffConverter::stop(){
+  {
+    ScopedLock lock( mutex );
+    stopping = true;
+    condition.broadcast();
+  }
+  this->join();
+}
+
+
+
+void TiffConverter::run(){
+
+  while( true ){
+
+    string path;
+    {
+      ScopedLock lock( mutex );
+      while( queue.empty() && !stopping ) condition.wait( mutex );
+      if( stopping ) break;
+      path = queue.front();
+      queue.pop_front();
+    }
+
+    // Record the modification time of the version we convert
+    struct stat sb;
+    time_t mtime = ( stat( path.c_str(), &sb ) == 0 ) ? sb.st_mtime : 0;
+
+    bool ok = this->convert( path, this->getDerivativePath( path ) );
+
+    ScopedLock lock( mutex );
+    pending.erase( path );
+    if( !ok && !stopping ) failed[path] = mtime;
+  }
+}
+
+
+
+bool TiffConverter::convert( const string& src, const string& dst ){
+
+  TIFF* in = TIFFOpen( src.c_str(), "rm" );
+  if( !in ) return false;
+
+  Pyramid p;
+  p.tileSize = tileSize;
+  Format& f = p.format;
+
+  uint32 width = 0, height = 0, rows_per_strip = 0;
+  uint16 planar, compression, *extra = NULL, nextra = 0;
+
+  TIFFGetField( in, TIFFTAG_IMAGEWIDTH, &width );
+  TIFFGetField( in, TIFFTAG_IMAGELENGTH, &height );
+  TIFFGetFieldDefaulted( in, TIFFTAG_SAMPLESPERPIXEL, &f.channels );
+  TIFFGetFieldDefaulted( in, TIFFTAG_BITSPERSAMPLE, &f.bpc );
+  TIFFGetFieldDefaulted( in, TIFFTAG_SAMPLEFORMAT, &f.sampleformat );
+  TIFFGetFieldDefaulted( in, TIFFTAG_PLANARCONFIG, &planar );
+  TIFFGetFieldDefaulted( in, TIFFTAG_COMPRESSION, &compression );
+  TIFFGetFieldDefaulted( in, TIFFTAG_ROWSPERSTRIP, &rows_per_strip );
+  if( !TIFFGetField( in, TIFFTAG_PHOTOMETRIC, &f.photometric ) ) f.photometric = PHOTOMETRIC_MINISBLACK;
+  if( TIFFGetField( in, TIFFTAG_EXTRASAMPLES, &nextra, &extra ) && nextra > 0 ){
+    f.extrasamples.assign( extra, extra + nextra );
+  }
+
+  // JPEG compressed YCbCr strips are decoded to RGB. Other YCbCr, colourmapped,
+  // sub-byte and planar images are not converted
+  if( f.photometric == PHOTOMETRIC_YCBCR && compression == COMPRESSION_JPEG ){
+    TIFFSetField( in, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
+    f.photometric = PHOTOMETRIC_RGB;
+  }
+
+  p.pixel = f.channels * f.bpc / 8;
+  unsigned int line = width * p.pixel;
+
+  if( TIFFIsTiled( in ) || width == 0 || height == 0 || rows_per_strip == 0 ||
+      planar != PLANARCONFIG_CONTIG || f.photometric == PHOTOMETRIC_YCBCR ||
+      f.photometric == PHOTOMETRIC_PALETTE ||
+      ( f.bpc != 8 && f.bpc != 16 && f.bpc != 32 ) ||
+      (unsigned int) TIFFScanlineSize( in ) != line ){
+    TIFFClose( in );
+    return false;
+  }
+
+  // Our resolutions halve in size until they fit within a single tile
+  unsigned int w = width, h = height;
+  while( true ){
+    Level l;
+    l.width = w;
+    l.height = h;
+    l.row = l.rows = 0;
+    l.tiff = NULL;
+    p.levels.push_back( l );
+    if( w <= tileSize && h <= tileSize ) break;
+    w = (w > 1) ? w/2 : 1;
+    h = (h > 1) ? h/2 : 1;
+  }
+
+  // Very large images need BigTIFF
+  const char* mode = "w";
+#ifdef TIFF_BIGTIFF_VERSION
+  if( (unsigned long long) line * height > 2147483648ULL ) mode = "w8";
+#endif
+
+  // The full resolution is written to our output and the others to temporary
+  // files which are appended to our output once complete. Several server processes
+  // may share our directory, so our temporary files are named after our process
+  bool ok = true;
+  for( unsigned int n=0; n<p.levels.size(); n++ ){
+    Level& l = p.levels[n];
+    char suffix[64];
+    if( n == 0 ) snprintf( suffix, 64, ".%ld.tmp", (long) getpid() );
+    else snprintf( suffix, 64, ".%ld.%u.tmp", (long) getpid(), n );
+    l.path = dst + suffix;
+    if( !( l.tiff = TIFFOpen( l.path.c_str(), mode ) ) ){
+      ok = false;
+      break;
+    }
+    setFields( l.tiff, f, l.width, l.height, tileSize, n > 0 );
+    l.band.resize( (size_t) tileSize * l.width * p.pixel );
+    l.pending.resize( (size_t) l.width * p.pixel );
+    if( n+1 < p.levels.size() ) l.reduced.resize( (size_t) p.levels[n+1].width * p.pixel );
+  }
+
+  // Copy our basic metadata
+  if( ok ){
+    TIFF* out = p.levels[0].tiff;
+    static const uint32 tags[] = { TIFFTAG_ARTIST, TIFFTAG_COPYRIGHT, TIFFTAG_DATETIME,
+				   TIFFTAG_IMAGEDESCRIPTION, TIFFTAG_SOFTWARE };
+    char* tmp = NULL;
+    for( unsigned int i=0; i<sizeof(tags)/sizeof(tags[0]); i++ ){
+      if( TIFFGetField( in, tags[i], &tmp ) ) TIFFSetField( out, tags[i], tmp );
+    }
+    uint32 count;
+    if( TIFFGetField( in, TIFFTAG_XMLPACKET, &count, &tmp ) ) TIFFSetField( out, TIFFTAG_XMLPACKET, count, tmp );
+    double value;
+    if( TIFFGetField( in, TIFFTAG_SMINSAMPLEVALUE, &value ) ) TIFFSetField( out, TIFFTAG_SMINSAMPLEVALUE, value );
+    if( TIFFGetField( in, TIFFTAG_SMAXSAMPLEVALUE, &value ) ) TIFFSetField( out, TIFFTAG_SMAXSAMPLEVALUE, value );
+  }
+
+  // Read our image one row at a time, feeding each row into our pyramid. Only a single
+  // row is buffered, however large the strips of our image
+  if( ok ){
+    p.tile.resize( (size_t) tileSize * tileSize * p.pixel );
+    vector<unsigned char> row( line );
+    for( unsigned int y=0; ok && y<height; y++ ){
+      ok = !stopping && TIFFReadScanline( in, &row[0], y, 0 ) != -1 && pushRow( p, 0, &row[0] );
+    }
+  }
+  TIFFClose( in );
+
+  // Append our reduced resolutions by copying their compressed tiles
+  TIFF* out = p.levels.empty() ? NULL : p.levels[0].tiff;
+  if( ok ) ok = TIFFWriteDirectory( out );
+  vector<unsigned char> buffer;
+
+  for( unsigned int n=1; n<p.levels.size(); n++ ){
+    Level& l = p.levels[n];
+    if( !l.tiff ) break;
+    TIFFClose( l.tiff );
+    l.tiff = NULL;
+    if( !ok ) continue;
+
+    TIFF* level = TIFFOpen( l.path.c_str(), "rm" );
+    if( !level ){
+      ok = false;
+      continue;
+    }
+    setFields( out, f, l.width, l.height, tileSize, true );
+
+    // Allow for tiles which do not compress
+    buffer.resize( 2 * TIFFTileSize( level ) + 1024 );
+    ttile_t ntiles = TIFFNumberOfTiles( level );
+    for( ttile_t t=0; ok && t<ntiles; t++ ){
+      tmsize_t length = TIFFReadRawTile( level, t, &buffer[0], buffer.size() );
+      ok = ( length > 0 && TIFFWriteRawTile( out, t, &buffer[0], length ) == length );
+    }
+    TIFFClose( level );
+    if( ok ) ok = TIFFWriteDirectory( out );
+  }
+
+  if( out ) TIFFClose( out );
+  for( unsigned int n=1; n<p.levels.size(); n++ ) remove( p.levels[n].path.c_str() );
+
+  // Replace any existing derivative
+  string tmp = p.levels.empty() ? string() : p.levels[0].path;
+  if( !ok || rename( tmp.c_str(), dst.c_str() ) != 0 ){
+    remove( tmp.c_str() );
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,131 @@
+// Background TIFF Pyramid Conversion Class
+
+/*  IIP Image Server
+
+    Copyright (C) 2026 Ruven Pillay.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TIFFCONVERTER_H
+#define _TIFFCONVERTER_H
+
+
+#include <string>
+#include <list>
+#include <set>
+#include <map>
+#include <ctime>
+
+#include "Thread.h"
+
+
+/// Tile size of converted images and of the striped images they are made from
+#define CONVERSION_TILE_SIZE 256
+
+
+
+/// Convert striped TIFF images to tiled pyramids in a background thread
+/** Striped images are served directly from their strips while a tiled,
+    deflate compressed pyramidal copy is built in our conversion directory.
+    Once this derivative is complete, it is used in place of the original.
+    Images are read one row at a time and each resolution is built from the
+    one above as rows arrive, so only a band of one tile height per resolution
+    is held in memory, even for images stored in a single strip. Our
+    resolutions have the same dimensions and the same 2x2 box filtering as
+    the virtual resolutions generated by the TileManager for the original
+    image, so tiles are identical whichever is used.
+    Derivatives older than their original are rebuilt. Images which fail to
+    convert are not retried until they are modified.
+ */
+class TiffConverter : public Thread {
+
+ private:
+
+  /// Directory in which derivatives are stored
+  std::string directory;
+
+  /// Tile width and height of our derivatives
+  unsigned int tileSize;
+
+  /// Lock protecting our queue
+  Mutex mutex;
+
+  /// Signalled when an image is queued or we are stopped
+  Condition condition;
+
+  /// Images waiting to be converted, oldest first
+  std::list<std::string> queue;
+
+  /// Images which are queued or being converted
+  std::set<std::string> pending;
+
+  /// Images which failed to convert together with their modification time
+  std::map<std::string,time_t> failed;
+
+  /// Set to request that our thread stops
+  volatile bool stopping;
+
+  TiffConverter( const TiffConverter& );
+  TiffConverter& operator= ( const TiffConverter& );
+
+
+  /// Return the path of the derivative of an image
+  std::string getDerivativePath( const std::string& path );
+
+  /// Convert a single image
+  /** @param src path of the striped image
+      @param dst path of the tiled pyramid to create, which is replaced atomically
+      @return whether the conversion succeeded
+   */
+  bool convert( const std::string& src, const std::string& dst );
+
+  /// Thread function
+  void run();
+
+
+ public:
+
+  /// Constructor
+  /** @param d directory in which to store derivatives
+      @param t tile size of our derivatives
+   */
+  TiffConverter( const std::string& d, unsigned int t ):
+    directory(d), tileSize(t), stopping(false) {};
+
+  /// Destructor: stops any conversion in progress
+  ~TiffConverter(){ this->stop(); };
+
+  /// Look up the derivative of an image, queueing its conversion if necessary
+  /** @param path path of the striped image
+      @param mtime modification time of the striped image
+      @return path of an up to date derivative or an empty string if none is ready
+   */
+  std::string find( const std::string& path, time_t mtime );
+
+  /// Stop our thread, abandoning any conversion in progress
+  void stop();
+
+  /// Return the tile size of our derivatives
+  unsigned int getTileSize(){ return tileSize; };
+
+  /// Return our conversion directory
+  const std::string& getDirectory(){ return directory; };
+
+};
+
+
+#endif
@@ -24,7 +24,11 @@
 
 
 #include <cmath>
+#include <sstream>
+#include <vector>
+#include <algorithm>
 #include "TileManager.h"
+#include "Thread.h"
 
 
 using namespace std;
@@ -38,24 +42,9 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
 
 
-  RawTile ttt;
-
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
-
-
-  // Apply the watermark if we have one.
-  // Do this before inserting into cache so that we cache watermarked tiles
-  if( watermark && watermark->isSet() ){
-
-    if( loglevel >= 2 ) insert_timer.start();
-    unsigned int tw = ttt.padded? image->getTileWidth() : ttt.width;
-    unsigned int th = ttt.padded? image->getTileHeight() : ttt.height;
-
-    watermark->apply( ttt.data, tw, th, ttt.channels, ttt.bpc );
-    if( loglevel >= 2 ) *logfile << "TileManager :: Watermark applied: " << insert_timer.getTime()
-				 << " microseconds" << endl;
-  }
+  // Get our raw tile from the IIPImage image object, watermarked before
+  // inserting into cache so that we cache watermarked tiles
+  RawTile ttt = this->decodeTile( resolution, tile, xangle, yangle, layers );
 
 
   // We need to crop our edge tiles if they are padded
@@ -117,6 +106,154 @@ RawTile TileManager::getNewTile( int resolution, int tile, int xangle, int yangl
 
 
 
+RawTile TileManager::decodeTile( int resolution, int tile, int xangle, int yangle, int layers ){
+
+  if( resolution < (int) image->getVirtualTileLevels() ){
+    return this->getVirtualTile( resolution, tile, xangle, yangle, layers );
+  }
+
+  RawTile ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  this->applyWatermark( ttt );
+  return ttt;
+}
+
+
+
+/// Reduce a tile of the resolution above by a 2x2 box filter into part of a tile
+/** Images one pixel wide or high are only reduced in the other direction
+    @param in input tile data
+    @param width input tile width
+    @param height input tile height
+    @param out output tile data
+    @param stride output tile width
+    @param w width of the part of our output covered by the input tile
+    @param h height of the part of our output covered by the input tile
+    @param channels number of channels
+ */
+template <class T, class A> static void reduce( const T* in, unsigned int width, unsigned int height,
+						T* out, unsigned int stride,
+						unsigned int w, unsigned int h, unsigned int channels ){
+  unsigned int dx = ( width > 1 ) ? channels : 0;
+  for( unsigned int j=0; j<h; j++ ){
+    const T* row1 = &in[2*j*width*channels];
+    const T* row2 = ( height > 1 ) ? row1 + width*channels : row1;
+    T* o = &out[j*stride*channels];
+    for( unsigned int i=0; i<w; i++ ){
+      for( unsigned int k=0; k<channels; k++ ){
+	unsigned int n = 2*i*channels + k;
+	A sum = (A) row1[n] + (A) row1[n+dx] + (A) row2[n] + (A) row2[n+dx];
+	*o++ = (T) ( sum / 4 );
+      }
+    }
+  }
+}
+
+
+
+RawTile TileManager::getVirtualTile( int resolution, int tile, int xangle, int yangle, int layers ){
+
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  int num_res = image->getNumResolutions();
+
+  // Size of this resolution and of the one above
+  unsigned int width = image->image_widths[num_res-resolution-1];
+  unsigned int height = image->image_heights[num_res-resolution-1];
+  unsigned int src_width = image->image_widths[num_res-resolution-2];
+  unsigned int src_height = image->image_heights[num_res-resolution-2];
+
+  unsigned int ntlx = (width / tw) + (width % tw == 0 ? 0 : 1);
+  unsigned int src_ntlx = (src_width / tw) + (src_width % tw == 0 ? 0 : 1);
+  unsigned int src_ntly = (src_height / th) + (src_height % th == 0 ? 0 : 1);
+
+  unsigned int x = (tile % ntlx) * tw;
+  unsigned int y = (tile / ntlx) * th;
+  if( y >= height ){
+    ostringstream error;
+    error << "TileManager :: Asked for non-existent virtual tile: " << tile;
+    throw file_error( error.str() );
+  }
+
+  unsigned int w = min( tw, width - x );
+  unsigned int h = min( th, height - y );
+
+  if( loglevel >= 3 ){
+    *logfile << "TileManager :: Generating virtual tile " << tile << " at resolution " << resolution
+	     << " with size " << w << "x" << h << endl;
+  }
+
+  // Our tile covers a block of up to 2x2 tiles of the resolution above
+  RawTile rawtile( tile, resolution, xangle, yangle, w, h, 0, 0 );
+  rawtile.filename = image->getImagePath();
+  rawtile.timestamp = image->timestamp;
+
+  for( unsigned int n=0; n<4; n++ ){
+
+    unsigned int sx = 2*(tile % ntlx) + (n % 2);
+    unsigned int sy = 2*(tile / ntlx) + (n / 2);
+    if( sx >= src_ntlx || sy >= src_ntly ) continue;
+
+    RawTile src = this->getTile( resolution+1, sy*src_ntlx + sx, xangle, yangle, layers, UNCOMPRESSED, false );
+
+    // Allocate our tile with the same type as the tiles above
+    if( n == 0 ){
+      rawtile.channels = src.channels;
+      rawtile.bpc = src.bpc;
+      rawtile.sampleType = src.sampleType;
+      rawtile.dataLength = w * h * src.channels * src.bpc/8;
+      if( src.bpc == 16 ) rawtile.data = new unsigned short[w*h*src.channels];
+      else if( src.bpc == 32 && src.sampleType == FIXEDPOINT ) rawtile.data = new unsigned int[w*h*src.channels];
+      else if( src.bpc == 32 ) rawtile.data = new float[w*h*src.channels];
+      else rawtile.data = new unsigned char[w*h*src.channels];
+    }
+
+    // Cached tiles are never padded. Every output pixel has a complete 2x2 block,
+    // other than in images one pixel wide or high
+    unsigned int ox = (n % 2) * tw/2;
+    unsigned int oy = (n / 2) * th/2;
+    unsigned int ow = min( (src.width+1)/2, w - ox );
+    unsigned int oh = min( (src.height+1)/2, h - oy );
+    unsigned int offset = (oy*w + ox) * rawtile.channels;
+
+    if( rawtile.bpc == 16 ){
+      reduce<unsigned short,unsigned int>( (unsigned short*) src.data, src.width, src.height,
+					   &((unsigned short*)rawtile.data)[offset], w, ow, oh, rawtile.channels );
+    }
+    else if( rawtile.bpc == 32 && rawtile.sampleType == FIXEDPOINT ){
+      reduce<unsigned int,unsigned long long>( (unsigned int*) src.data, src.width, src.height,
+					       &((unsigned int*)rawtile.data)[offset], w, ow, oh, rawtile.channels );
+    }
+    else if( rawtile.bpc == 32 ){
+      reduce<float,float>( (float*) src.data, src.width, src.height,
+			   &((float*)rawtile.data)[offset], w, ow, oh, rawtile.channels );
+    }
+    else{
+      reduce<unsigned char,unsigned int>( (unsigned char*) src.data, src.width, src.height,
+					  &((unsigned char*)rawtile.data)[offset], w, ow, oh, rawtile.channels );
+    }
+  }
+
+  return rawtile;
+}
+
+
+
+void TileManager::applyWatermark( RawTile& ttt ){
+
+  if( watermark && watermark->isSet() ){
+
+    if( loglevel >= 2 ) insert_timer.start();
+    unsigned int tw = ttt.padded? image->getTileWidth() : ttt.width;
+    unsigned int th = ttt.padded? image->getTileHeight() : ttt.height;
+
+    watermark->apply( ttt.data, tw, th, ttt.channels, ttt.bpc );
+    if( loglevel >= 2 ) *logfile << "TileManager :: Watermark applied: " << insert_timer.getTime()
+				 << " microseconds" << endl;
+  }
+}
+
+
+
 void TileManager::crop( RawTile *ttt ){
 
   int tw = image->getTileWidth();
@@ -128,23 +265,19 @@ void TileManager::crop( RawTile *ttt ){
 	     << endl;
   }
 
-  // Create a new buffer, fill it with the old data, then copy
-  // back the cropped part into the RawTile buffer
-  int len = tw * th * ttt->channels * ttt->bpc/8;
-  unsigned char* buffer = (unsigned char*) malloc( len );
-  unsigned char* src_ptr = (unsigned char*) memcpy( buffer, ttt->data, len );
+  // Move each scanline of the cropped part up within the RawTile buffer. Each scanline
+  // moves to the same or a lower address, so this can be done in place. The first
+  // scanline is already in place
+  unsigned int len = ttt->width * ttt->channels * ttt->bpc/8;
+  unsigned char* src_ptr = (unsigned char*) ttt->data;
   unsigned char* dst_ptr = (unsigned char*) ttt->data;
 
-  // Copy one scanline at a time
-  for( unsigned int i=0; i<ttt->height; i++ ){
-    len =  ttt->width * ttt->channels * ttt->bpc/8;
-    memcpy( dst_ptr, src_ptr, len );
+  for( unsigned int i=1; i<ttt->height; i++ ){
     dst_ptr += len;
     src_ptr += tw * ttt->channels * ttt->bpc/8;
+    memmove( dst_ptr, src_ptr, len );
   }
 
-  free( buffer );
-
   // Reset the data length
   len = ttt->width * ttt->height * ttt->channels * ttt->bpc/8;
   ttt->dataLength = len;
@@ -155,46 +288,36 @@ void TileManager::crop( RawTile *ttt ){
 
 
 
-RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c ){
-
-  RawTile* rawtile = NULL;
-  string tileCompression;
-  string compName;
+bool TileManager::findTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& rawtile ){
 
+  bool found = false;
 
-  // Time the tile retrieval
-  if( loglevel >= 2 ) tile_timer.start();
-
-
-  /* Try to get this tile from our cache first as a JPEG, then uncompressed
-     Otherwise decode one from the source image and add it to the cache
-   */
   switch( c )
     {
 
     case JPEG:
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					  xangle, yangle, JPEG, jpeg->getQuality() )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					  xangle, yangle, JPEG, jpeg->getQuality(), rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, DEFLATE, 0, rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
     case DEFLATE:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, DEFLATE, 0 )) ) break;
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, DEFLATE, 0, rawtile )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
     case UNCOMPRESSED:
 
-      if( (rawtile = tileCache->getTile( image->getImagePath(), resolution, tile,
-					 xangle, yangle, UNCOMPRESSED, 0 )) ) break;
+      if( (found = tileCache->getTile( image->getImagePath(), resolution, tile,
+					 xangle, yangle, UNCOMPRESSED, 0, rawtile )) ) break;
       break;
 
 
@@ -203,26 +326,70 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
     }
 
+  return found;
+}
+
+
+
+
+RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool record ){
+
+  RawTile rawtile;
+  string tileCompression;
+  string compName;
+
+
+  // Time the tile retrieval
+  if( loglevel >= 2 ) tile_timer.start();
+
+
+  /* Try to get this tile from our cache first as a JPEG, then uncompressed
+     Otherwise decode one from the source image and add it to the cache
+   */
+  bool found = this->findTile( resolution, tile, xangle, yangle, c, rawtile );
+  if( record ) tileCache->record( resolution, c, found && (rawtile.timestamp >= image->timestamp) );
+
 
   // If we haven't been able to get a tile, get a raw one
-  if( !rawtile || (rawtile && (rawtile->timestamp < image->timestamp)) ){
+  if( !found || (rawtile.timestamp < image->timestamp) ){
 
-    if( rawtile && (rawtile->timestamp < image->timestamp) ){
+    if( found && (rawtile.timestamp < image->timestamp) ){
       if( loglevel >= 3 ) *logfile << "TileManager :: Tile has old timestamp "
-			           << rawtile->timestamp << " - " << image->timestamp
+			           << rawtile.timestamp << " - " << image->timestamp
                                    << " ... updating" << endl;
     }
 
-    RawTile newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+    // If another thread is already decoding this tile, wait for it and use its result
+    string path = image->getImagePath();
+    if( tileCache->beginDecode( path, resolution, tile, xangle, yangle ) ){
+      found = this->findTile( resolution, tile, xangle, yangle, c, rawtile ) &&
+	( rawtile.timestamp >= image->timestamp );
+      if( found ){
+	tileCache->endDecode( path, resolution, tile, xangle, yangle );
+	if( loglevel >= 2 ) *logfile << "TileManager :: Waited for concurrent decoding of tile" << endl;
+      }
+    }
 
-    if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				 << tile_timer.getTime() << " microseconds" << endl;
-    return newtile;
+    if( !found ){
+      RawTile newtile;
+      try{
+	newtile = this->getNewTile( resolution, tile, xangle, yangle, layers, c );
+      }
+      catch( ... ){
+	tileCache->endDecode( path, resolution, tile, xangle, yangle );
+	throw;
+      }
+      tileCache->endDecode( path, resolution, tile, xangle, yangle );
+
+      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+				   << tile_timer.getTime() << " microseconds" << endl;
+      return newtile;
+    }
   }
 
 
   // Define our compression names
-  switch( rawtile->compressionType ){
+  switch( rawtile.compressionType ){
     case JPEG: compName = "JPEG"; break;
     case DEFLATE: compName = "DEFLATE"; break;
     case UNCOMPRESSED: compName = "UNCOMPRESSED"; break;
@@ -240,23 +407,22 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
   // Check whether the compression used for out tile matches our requested compression type.
   // If not, we must convert
 
-  if( c == JPEG && rawtile->compressionType == UNCOMPRESSED ){
-
-    // Rawtile is a pointer to the cache data, so we need to create a copy of it in case we compress it
-    RawTile ttt( *rawtile );
+  if( c == JPEG && rawtile.compressionType == UNCOMPRESSED ){
 
+    // Rawtile is our own copy of the cache data, so we can compress it in place
     // Do our JPEG compression iff we have an 8 bit per channel image and either 1 or 3 bands
-    if( rawtile->bpc==8 && (rawtile->channels==1 || rawtile->channels==3) ){
+    if( rawtile.bpc==8 && (rawtile.channels==1 || rawtile.channels==3) ){
+
+      unsigned int oldlen = rawtile.dataLength;
 
       // Crop if this is an edge tile
-      if( ( (ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight()) ) && ttt.padded ){
+      if( ( (rawtile.width != image->getTileWidth()) || (rawtile.height != image->getTileHeight()) ) && rawtile.padded ){
 	if( loglevel >= 5 ) * logfile << "TileManager :: Cropping tile" << endl;
-	this->crop( &ttt );
+	this->crop( &rawtile );
       }
 
       if( loglevel >=2 ) compression_timer.start();
-      unsigned int oldlen = rawtile->dataLength;
-      unsigned int newlen = jpeg->Compress( ttt );
+      unsigned int newlen = jpeg->Compress( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -265,29 +431,320 @@ RawTile TileManager::getTile( int resolution, int tile, int xangle, int yangle,
 
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
-      tileCache->insert( ttt );
+      tileCache->insert( rawtile );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
+    }
+  }
 
-      if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
-				   << tile_timer.getTime() << " microseconds" << endl;
-      return RawTile( ttt );
+  if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
+			       << tile_timer.getTime() << " microseconds" << endl;
+
+  return rawtile;
+
+
+}
+
+
+bool TileManager::getProcessedTile( int resolution, int tile, int xangle, int yangle, const string& variant, RawTile& rawtile ){
+
+  bool found = tileCache->getTile( image->getImagePath(), resolution, tile,
+				   xangle, yangle, JPEG, jpeg->getQuality(), rawtile, variant ) &&
+    ( rawtile.timestamp >= image->timestamp );
+  tileCache->record( resolution, JPEG, found, true );
+  if( !found ) return false;
+
+  if( loglevel >= 2 ) *logfile << "TileManager :: Processed tile cache hit for resolution: " << resolution
+			       << ", tile: " << tile << ", variant: " << variant << endl;
+
+  return true;
+}
+
+
+
+void TileManager::insertProcessedTile( const RawTile& rawtile, const string& variant ){
+
+  if( rawtile.compressionType != JPEG ) return;
+
+  if( loglevel >= 2 ) insert_timer.start();
+  tileCache->insert( rawtile, variant );
+  if( loglevel >= 2 ) *logfile << "TileManager :: Processed tile cache insertion time: " << insert_timer.getTime()
+			       << " microseconds" << endl;
+}
+
+
+
+/// Tiles to be composited into a region, shared by all of the threads working on it
+struct RegionJob {
+
+  /// Region being built and its position within the image
+  RawTile* region;
+  unsigned int x, y;
+
+  /// Resolution, sequence and quality layers requested
+  unsigned int res;
+  int seq, ang, layers;
+
+  /// First tile, number of tiles per row of the region and of the image and total number of tiles
+  unsigned int startx, starty, ncols, ntlx, total;
+
+  /// The basic tile size ie. not that of edge tiles
+  unsigned int tile_width, tile_height;
+
+  /// Lock protecting the fields below
+  Mutex mutex;
+
+  /// Next tile to be composited
+  unsigned int next;
+
+  /// Whether a thread has failed, and its error
+  bool failed;
+  bool fileError;
+  string error;
+
+  /// Record the first failure of any thread, so that the others stop taking tiles
+  void fail( bool f, const string& e ){
+    ScopedLock lock( mutex );
+    if( !failed ){
+      failed = true;
+      fileError = f;
+      error = e;
+    }
+  };
+
+};
+
+
+
+/// Thread compositing tiles into regions using its own copy of our image
+/** Workers are kept by their TileManager for its lifetime, so that a series of regions
+    from the same image, such as the bands of a streamed CVT, reuse the same threads
+    and opened images rather than creating them for each region
+ */
+class RegionWorker : public Thread {
+
+ private:
+
+  IIPImage* image;
+  ostringstream log;
+  TileManager manager;
+
+  /// Lock protecting the fields below
+  Mutex mutex;
+
+  /// Signalled when we are given a job, finish one or are asked to stop
+  Condition condition;
+
+  /// Job we are working on, or NULL if we are idle
+  RegionJob* job;
+
+  /// Whether our image has been opened and whether we have been asked to stop
+  bool opened, stopping;
+
+ protected:
+
+  void run(){
+
+    while( true ){
+
+      RegionJob* j;
+      {
+	ScopedLock lock( mutex );
+	while( !job && !stopping ) condition.wait( mutex );
+	if( stopping ) return;
+	j = job;
+      }
+
+      try{
+	if( !opened ) image->openImage();
+	opened = true;
+	manager.compositeTiles( *j );
+      }
+      catch( const file_error& error ){
+	j->fail( true, error.what() );
+      }
+      catch( const string& error ){
+	j->fail( false, error );
+      }
+      // Anything else, such as a failed allocation, must not escape our thread
+      catch( ... ){
+	j->fail( false, "TileManager :: Unexpected error compositing region" );
+      }
+
+      ScopedLock lock( mutex );
+      job = NULL;
+      condition.broadcast();
+    }
+  };
+
+ public:
+
+  RegionWorker( IIPImage* im, Cache* tc, Watermark* w, JPEGCompressor* jpeg, int loglevel ):
+    image(im), manager( tc, im, w, jpeg, &log, loglevel ), job(NULL), opened(false), stopping(false) {};
+
+  ~RegionWorker(){ delete image; };
+
+  /// Start working on a job
+  void submit( RegionJob& j ){
+    ScopedLock lock( mutex );
+    job = &j;
+    condition.broadcast();
+  };
+
+  /// Wait until our current job is finished
+  void wait(){
+    ScopedLock lock( mutex );
+    while( job ) condition.wait( mutex );
+  };
+
+  /// Stop our thread once it is idle
+  void stop(){
+    {
+      ScopedLock lock( mutex );
+      stopping = true;
+      condition.broadcast();
     }
+    this->join();
+  };
+
+  /// Return and clear our log output. Only call while we are idle
+  string getLog(){
+    string l = log.str();
+    log.str( "" );
+    return l;
+  };
+
+};
+
+
+
+TileManager::~TileManager(){
+  for( unsigned int t=0; t<workers.size(); t++ ){
+    workers[t]->stop();
+    delete workers[t];
   }
+}
+
+
+
+void TileManager::getTile( int resolution, int tile, int xangle, int yangle, int layers, const RawTileView& view ){
+
+  if( loglevel >= 2 ) tile_timer.start();
+
+  // Copy straight from our cache if we can
+  string path = image->getImagePath();
+  bool found = tileCache->copyTile( path, resolution, tile, xangle, yangle, image->timestamp, view );
+  tileCache->record( resolution, UNCOMPRESSED, found );
+  if( found ){
+    if( loglevel >= 2 ) *logfile << "TileManager :: Cache Hit for resolution: " << resolution
+				 << ", tile: " << tile << ", compression: UNCOMPRESSED" << endl
+				 << "TileManager :: Total Tile Access Time: "
+				 << tile_timer.getTime() << " microseconds" << endl;
+    return;
+  }
+
+  // If another thread is already decoding this tile, wait for it and use its result
+  if( tileCache->beginDecode( path, resolution, tile, xangle, yangle ) &&
+      tileCache->copyTile( path, resolution, tile, xangle, yangle, image->timestamp, view ) ){
+    tileCache->endDecode( path, resolution, tile, xangle, yangle );
+    if( loglevel >= 2 ) *logfile << "TileManager :: Waited for concurrent decoding of tile" << endl;
+    return;
+  }
+
+  if( loglevel >= 2 ) *logfile << "TileManager :: Cache Miss for resolution: " << resolution << ", tile: " << tile << endl;
+
+  try{
+
+    // Use the tile as decoded by our image without copying it
+    RawTile ttt = this->decodeTile( resolution, tile, xangle, yangle, layers );
+
+    // Copy the part we need before cropping, taking into account any padding
+    ttt.copyTo( view, ttt.padded ? image->getTileWidth() : ttt.width );
+
+    // Crop edge tiles in place and add to our cache
+    if( ((ttt.width != image->getTileWidth()) || (ttt.height != image->getTileHeight())) && ttt.padded ){
+      this->crop( &ttt );
+    }
+    if( loglevel >= 2 ) insert_timer.start();
+    tileCache->insert( ttt );
+    if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
+				 << " microseconds" << endl;
+  }
+  catch( ... ){
+    tileCache->endDecode( path, resolution, tile, xangle, yangle );
+    throw;
+  }
+  tileCache->endDecode( path, resolution, tile, xangle, yangle );
 
   if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 			       << tile_timer.getTime() << " microseconds" << endl;
+}
+
 
-  return RawTile( *rawtile );
 
+void TileManager::compositeTiles( RegionJob& job ){
+
+  while( true ){
+
+    // Take the next tile
+    unsigned int n;
+    {
+      ScopedLock lock( job.mutex );
+      if( job.failed || job.next >= job.total ) return;
+      n = job.next++;
+    }
 
+    unsigned int i = job.starty + n / job.ncols;
+    unsigned int j = job.startx + n % job.ncols;
+    unsigned int tile = (i*job.ntlx) + j;
+
+    // The part of the region covered by this tile
+    RawTile& region = *job.region;
+    unsigned int tx = j * job.tile_width;
+    unsigned int ty = i * job.tile_height;
+    unsigned int x0 = max( tx, job.x );
+    unsigned int x1 = min( tx + job.tile_width, job.x + region.width );
+    unsigned int y0 = max( ty, job.y );
+    unsigned int y1 = min( ty + job.tile_height, job.y + region.height );
+    if( x1 <= x0 || y1 <= y0 ) continue;
+
+    size_t bytes = region.channels * region.bpc / 8;
+    RawTileView view;
+    view.stride = region.width * bytes;
+    view.data = (unsigned char*) region.data + (y0 - job.y) * view.stride + (x0 - job.x) * bytes;
+    view.x = x0 - tx;
+    view.y = y0 - ty;
+    view.width = x1 - x0;
+    view.height = y1 - y0;
+
+    try{
+      // Copy or decode just this part of the tile straight into our region
+      this->getTile( job.res, tile, job.seq, job.ang, job.layers, view );
+    }
+    catch( const file_error& error ){
+      job.fail( true, error.what() );
+      return;
+    }
+    catch( const string& error ){
+      job.fail( false, error );
+      return;
+    }
+    catch( ... ){
+      job.fail( false, "TileManager :: Unexpected error compositing region" );
+      return;
+    }
+  }
 }
 
 
+
 RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
 
-  // If our image type can directly handle region compositing, simply return that
-  if( image->regionDecoding() ){
+  // If our image type can directly handle region compositing, simply return that.
+  // Virtual resolutions are always composited from their tiles, as are watermarked
+  // images so that the watermark is applied tile by tile exactly as for tile requests
+  if( image->regionDecoding() && res >= image->getVirtualTileLevels() &&
+      !( watermark && watermark->isSet() ) ){
     if( loglevel >= 3 ){
       *logfile << "TileManager getRegion :: requesting region directly from image" << endl;
     }
@@ -296,54 +753,34 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
 
   // Otherwise do the compositing ourselves
 
-  // The tile size of the source tile
-  unsigned int src_tile_width = image->getTileWidth();
-  unsigned int src_tile_height = image->getTileHeight();
-
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
   // The basic tile size ie. not the current tile
-  unsigned int basic_tile_width = src_tile_width;
-  unsigned int basic_tile_height = src_tile_height;
+  unsigned int basic_tile_width = image->getTileWidth();
+  unsigned int basic_tile_height = image->getTileHeight();
 
   int num_res = image->getNumResolutions();
   unsigned int im_width = image->image_widths[num_res-res-1];
   unsigned int im_height = image->image_heights[num_res-res-1];
 
-  unsigned int rem_x = im_width % src_tile_width;
-  unsigned int rem_y = im_height % src_tile_height;
+  unsigned int rem_x = im_width % basic_tile_width;
+  unsigned int rem_y = im_height % basic_tile_height;
 
   // The number of tiles in each direction
-  unsigned int ntlx = (im_width / src_tile_width) + (rem_x == 0 ? 0 : 1);
-  unsigned int ntly = (im_height / src_tile_height) + (rem_y == 0 ? 0 : 1);
-
-  // Start and end tiles and pixel offsets
-  unsigned int startx, endx, starty, endy, xoffset, yoffset;
-
-
-  if( ! ( x==0 && y==0 && width==im_width && height==im_height ) ){
-    // Calculate the start tiles
-    startx = (unsigned int) ( x / src_tile_width );
-    starty = (unsigned int) ( y / src_tile_height );
-    xoffset = x % src_tile_width;
-    yoffset = y % src_tile_height;
+  unsigned int ntlx = (im_width / basic_tile_width) + (rem_x == 0 ? 0 : 1);
+  unsigned int ntly = (im_height / basic_tile_height) + (rem_y == 0 ? 0 : 1);
 
-    endx = (unsigned int) ceil( (float)(width + x) / (float)src_tile_width );
-    endy = (unsigned int) ceil( (float)(height + y) / (float)src_tile_height );
+  // Start and end tiles
+  unsigned int startx = x / basic_tile_width;
+  unsigned int starty = y / basic_tile_height;
+  unsigned int endx = (unsigned int) ceil( (float)(width + x) / (float)basic_tile_width );
+  unsigned int endy = (unsigned int) ceil( (float)(height + y) / (float)basic_tile_height );
+  if( endx > ntlx ) endx = ntlx;
+  if( endy > ntly ) endy = ntly;
 
-    if( loglevel >= 3 ){
-      *logfile << "TileManager getRegion :: Total tiles in image: " << ntlx << "x" << ntly << " tiles" << endl
-	       << "TileManager getRegion :: Tile start: " << startx << "," << starty << " with offset: "
-	       << xoffset << "," << yoffset << endl
-	       << "TileManager getRegion :: Tile end: " << endx-1 << "," << endy-1 << endl;
-    }
-  }
-  else{
-    startx = starty = xoffset = yoffset = 0;
-    endx = ntlx;
-    endy = ntly;
+  if( loglevel >= 3 ){
+    *logfile << "TileManager getRegion :: Total tiles in image: " << ntlx << "x" << ntly << " tiles" << endl
+	     << "TileManager getRegion :: Tile start: " << startx << "," << starty << " with offset: "
+	     << x % basic_tile_width << "," << y % basic_tile_height << endl
+	     << "TileManager getRegion :: Tile end: " << endx-1 << "," << endy-1 << endl;
   }
 
 
@@ -365,123 +802,71 @@ RawTile TileManager::getRegion( unsigned int res, int seq, int ang, int layers,
   else if( bpc == 32 && sampleType == FIXEDPOINT ) region.data = new int[width*height*channels];
   else if( bpc == 32 && sampleType == FLOATINGPOINT ) region.data = new float[width*height*channels];
 
-  unsigned int current_height = 0;
 
-  // Decode the image strip by strip
-  for( unsigned int i=starty; i<endy; i++ ){
-
-    unsigned int buffer_index = 0;
-
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
-
-    for( unsigned int j=startx; j<endx; j++ ){
-
-      // Time the tile retrieval
-      if( loglevel >= 2 ) tile_timer.start();
-
-      // Get an uncompressed tile
-      RawTile rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
-
-      if( loglevel >= 2 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
-      }
-
-
-      // Only print this out once per image
-      if( (loglevel >= 4) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile.channels << " channels, "
-		 << rawtile.bpc << " bits per channel" << endl;
-      }
-
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile.width;
-      src_tile_height = rawtile.height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
-	}
-
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
-	}
-
-	if( loglevel >= 4 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
-	}
-      }
+  // Set up the tiles to be composited
+  RegionJob job;
+  job.region = &region;
+  job.x = x;
+  job.y = y;
+  job.res = res;
+  job.seq = seq;
+  job.ang = ang;
+  job.layers = layers;
+  job.startx = startx;
+  job.starty = starty;
+  job.ncols = endx - startx;
+  job.ntlx = ntlx;
+  job.total = job.ncols * (endy - starty);
+  job.tile_width = basic_tile_width;
+  job.tile_height = basic_tile_height;
+  job.next = 0;
+  job.failed = false;
+  job.fileError = false;
+
+
+  // Use additional threads, each with its own copy of our image, to decode and composite
+  // tiles in parallel. Each tile covers a different part of the region, so no locking is
+  // needed when writing to it. Image types which cannot be copied are decoded by this thread alone.
+  // Our threads are kept for any further regions we are asked for
+  unsigned int nthreads = min( threads, job.total );
+  while( workers.size() + 1 < nthreads ){
+    IIPImage* im = image->clone();
+    if( !im ) break;
+    RegionWorker* worker = new RegionWorker( im, tileCache, watermark, jpeg, loglevel );
+    if( !worker->start() ){
+      delete worker;
+      break;
+    }
+    workers.push_back( worker );
+  }
+  unsigned int nworkers = min( (unsigned int) workers.size(), nthreads - 1 );
 
+  for( unsigned int t=0; t<nworkers; t++ ) workers[t]->submit( job );
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
-
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile.width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile.data;
-	  unsigned char* buf = (unsigned char*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile.data;
-	  unsigned short* buf = (unsigned short*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile.data;
-	  unsigned int* buf = (unsigned int*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile.data;
-	  float* buf = (float*) region.data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-      }
+  if( loglevel >= 3 && nworkers > 0 ){
+    *logfile << "TileManager getRegion :: Compositing " << job.total << " tiles using "
+	     << nworkers + 1 << " threads" << endl;
+  }
 
-      current_width += dst_tile_width;
-    }
+  // This thread also takes part. Our threads write into our region through our job,
+  // so always wait for them before either can go out of scope
+  try{
+    this->compositeTiles( job );
+  }
+  catch( ... ){
+    job.fail( false, "TileManager :: Unexpected error compositing region" );
+    for( unsigned int t=0; t<nworkers; t++ ) workers[t]->wait();
+    throw;
+  }
 
-    current_height += dst_tile_height;
+  for( unsigned int t=0; t<nworkers; t++ ){
+    workers[t]->wait();
+    if( logfile ) *logfile << workers[t]->getLog();
+  }
 
+  if( job.failed ){
+    if( job.fileError ) throw file_error( job.error );
+    throw job.error;
   }
 
   return region;
@@ -25,6 +25,7 @@
 
 
 #include <fstream>
+#include <vector>
 
 #include "RawTile.h"
 #include "IIPImage.h"
@@ -35,10 +36,15 @@
 
 
 
+struct RegionJob;
+class RegionWorker;
+
+
 /// Class to manage access to the tile cache and tile cropping
 
 class TileManager{
 
+  friend class RegionWorker;
 
  private:
 
@@ -46,10 +52,17 @@ class TileManager{
   JPEGCompressor* jpeg;
   IIPImage* image;
   Watermark* watermark;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   int loglevel;
+  unsigned int threads;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// Threads used to build regions, which are started as needed and kept until we are destroyed
+  std::vector<RegionWorker*> workers;
+
+  TileManager( const TileManager& );
+  TileManager& operator= ( const TileManager& );
+
   /// Get a new tile from the image file
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -66,12 +79,81 @@ class TileManager{
   RawTile getNewTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Look for a tile in the cache
+  /**
+   *  Look first for a tile of the requested compression type, then for any
+   *  other type from which it can be obtained
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType
+   *  @param rawtile tile to be filled in if found
+   *  @return whether a tile was found
+   */
+  bool findTile( int resolution, int tile, int xangle, int yangle, CompressionType c, RawTile& rawtile );
+
+
+  /// Decode a tile from our image, applying any watermark, or generate it if it is virtual
+  /**
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return RawTile, which may be padded
+   */
+  RawTile decodeTile( int resolution, int tile, int xangle, int yangle, int layers );
+
+
+  /// Generate a tile of a virtual resolution
+  /**
+   *  The tile is reduced by a 2x2 box filter from the corresponding tiles of the
+   *  resolution above, which are themselves obtained via getTile and so are cached
+   *  and may in turn be virtual. These are already watermarked.
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @return RawTile
+   */
+  RawTile getVirtualTile( int resolution, int tile, int xangle, int yangle, int layers );
+
+
+  /// Apply our watermark to a newly decoded tile, if we have one
+  /** @param t tile
+   */
+  void applyWatermark( RawTile& t );
+
+
   /// Crop a tile to remove padding
   /** @param t pointer to tile to crop
    */
   void crop( RawTile* t );
 
 
+  /// Write part of an uncompressed tile directly into a view
+  /**
+   *  The part of the tile is copied straight from the cache, or the tile is decoded
+   *  and the part copied from the decoded data before the tile is added to the cache.
+   *  No intermediate copy of the tile is made.
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param view destination and part of the tile to write
+   */
+  void getTile( int resolution, int tile, int xangle, int yangle, int layers, const RawTileView& view );
+
+
+  /// Composite tiles into a region until none are left
+  /** @param job region and tiles shared with any other threads working on it
+   */
+  void compositeTiles( RegionJob& job );
+
+
  public:
 
 
@@ -84,16 +166,27 @@ class TileManager{
    * @param s  pointer to output file stream
    * @param l  logging level
    */
-  TileManager( Cache* tc, IIPImage* im, Watermark* w, JPEGCompressor* j, std::ofstream* s, int l ){
+  TileManager( Cache* tc, IIPImage* im, Watermark* w, JPEGCompressor* j, std::ostream* s, int l ){
     tileCache = tc; 
     image = im;
     watermark = w;
     jpeg = j;
     logfile = s ;
     loglevel = l;
+    threads = 1;
   };
 
 
+  /// Destructor: stops any threads used to build regions
+  ~TileManager();
+
+
+  /// Set the number of threads used to build regions
+  /** @param n number of threads including the calling thread
+   */
+  void setThreads( unsigned int n ){ threads = ( n > 0 ) ? n : 1; };
+
+
 
   /// Get a tile from the cache
   /**
@@ -106,16 +199,40 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param layers number of quality layers within image to decode
    *  @param c CompressionType
+   *  @param record whether to record the lookup in the cache statistics, which is
+   *         not done for tiles only needed to generate another tile
    *  @return RawTile
    */
-  RawTile getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
+  RawTile getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c, bool record = true );
+
+
+  /// Get a previously processed and JPEG compressed tile from the cache
+  /**
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param variant hash of the processing applied to the tile
+   *  @param rawtile tile to be filled in if found
+   *  @return whether an up to date tile was found
+   */
+  bool getProcessedTile( int resolution, int tile, int xangle, int yangle, const std::string& variant, RawTile& rawtile );
+
+
+  /// Store a processed and JPEG compressed tile in the cache
+  /**
+   *  @param rawtile processed tile
+   *  @param variant hash of the processing applied to the tile
+   */
+  void insertProcessedTile( const RawTile& rawtile, const std::string& variant );
 
 
 
   /// Generate a complete region
   /**
    *  Build up an arbitrary region by extracting tiles from the cache by using getTile function.
-   *  Data returned as uncompressed data.
+   *  Data returned as uncompressed data. Tiles are decoded in parallel if more than one
+   *  thread has been set and our image can be cloned.
    *  @param res resolution number
    *  @param xangle horizontal sequence number
    *  @param yangle vertical sequence number
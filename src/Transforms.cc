@@ -578,6 +578,57 @@ void filter_interpolate_bilinear( RawTile& in, unsigned int resampled_width, uns
 
 
 
+// Resize a single row using nearest neighbour interpolation
+void filter_interpolate_row_nearestneighbour( const unsigned char* in, unsigned int width, int channels,
+					      unsigned char* out, unsigned int resampled_width ){
+
+  // Calculate our scale
+  float xscale = (float)width / (float)resampled_width;
+
+  for( unsigned int i=0; i<resampled_width; i++ ){
+    unsigned int ii = (unsigned int) floorf(i*xscale);
+    unsigned int pyramid_index = (unsigned int) channels * ii;
+    unsigned int resampled_index = i*channels;
+    for( int k=0; k<channels; k++ ){
+      out[resampled_index+k] = in[pyramid_index+k];
+    }
+  }
+}
+
+
+
+// Resize a single row using bilinear interpolation between two input rows with
+// weights c and d. Produces the same result as the equivalent row of filter_interpolate_bilinear
+void filter_interpolate_row_bilinear( const unsigned char* in1, const unsigned char* in2, float c, float d,
+				      unsigned int width, int channels, unsigned char* out, unsigned int resampled_width ){
+
+  // Calculate our scale
+  float xscale = (float)(width-1) / (float)resampled_width;
+
+  for( unsigned int i=0; i<resampled_width; i++ ){
+
+    // Index to the current pyramid resolution's left pixel and its right neighbour
+    int ii = (int) floor( i*xscale );
+    unsigned int p1 = (unsigned int) ( channels * ii );
+    unsigned int p2 = ( (unsigned int)(ii+1) < width ) ? p1 + channels : p1;
+
+    // Calculate the rest of our weights
+    float iscale = i*xscale;
+    float a = (float)(ii+1) - iscale;
+    float b = iscale - (float)ii;
+
+    unsigned int resampled_index = i*channels;
+
+    for( int k=0; k<channels; k++ ){
+      float tx = in1[p1+k]*a + in1[p2+k]*b;
+      float ty = in2[p1+k]*a + in2[p2+k]*b;
+      out[resampled_index+k] = (unsigned char)( c*tx + d*ty );
+    }
+  }
+}
+
+
+
 // Function to apply a contrast adjustment and clip to 8 bit
 void filter_contrast( RawTile& in, float c ){
 
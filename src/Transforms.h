@@ -90,6 +90,33 @@ void filter_interpolate_nearestneighbour( RawTile& in, unsigned int w, unsigned
 void filter_interpolate_bilinear( RawTile& in, unsigned int w, unsigned int h );
 
 
+/// Resize a single row using nearest neighbour interpolation
+/** Used for incremental resizing, one output row at a time
+    @param in input row of 8 bit data
+    @param width input width
+    @param channels number of channels
+    @param out output row
+    @param w target width
+*/
+void filter_interpolate_row_nearestneighbour( const unsigned char* in, unsigned int width, int channels,
+					      unsigned char* out, unsigned int w );
+
+
+/// Resize a single row using bilinear interpolation between two input rows
+/** Used for incremental resizing, one output row at a time
+    @param in1 upper input row of 8 bit data
+    @param in2 lower input row of 8 bit data
+    @param c weight of the upper row
+    @param d weight of the lower row
+    @param width input width
+    @param channels number of channels
+    @param out output row
+    @param w target width
+*/
+void filter_interpolate_row_bilinear( const unsigned char* in1, const unsigned char* in2, float c, float d,
+				      unsigned int width, int channels, unsigned char* out, unsigned int w );
+
+
 /// Rotate image - currently only by 90, 180 or 270 degrees, other values will do nothing
 /** @param in tile input data
     @param angle angle of rotation - currently only rotations by 90, 180 and 270 degrees
@@ -21,6 +21,8 @@
 
 #include "View.h"
 #include <cmath>
+#include <sstream>
+#include <iomanip>
 using namespace std;
 
 
@@ -265,3 +267,34 @@ int View::getLayers(){
 
   return layers;
 }
+
+
+/// Return a canonical hash of the processing parameters
+std::string View::getProcessingHash(){
+
+  // Build a canonical description of every parameter that affects a processed tile.
+  // Parameters that are inactive are not included so that equivalent views hash identically
+  ostringstream s;
+  s.precision( 9 );
+  s << "l" << this->getLayers() << "c" << contrast << "g" << gamma
+    << "r" << rotation << "f" << flip << "s" << (int) colourspace;
+  if( shaded ) s << "h" << shade[0] << "," << shade[1];
+  if( cmapped ) s << "m" << (int) cmap;
+  if( inverted ) s << "i";
+  for( unsigned int i=0; i<ctw.size(); i++ ){
+    s << "t";
+    for( unsigned int j=0; j<ctw[i].size(); j++ ) s << ctw[i][j] << ",";
+  }
+
+  // 64 bit FNV-1a hash of this description
+  std::string desc = s.str();
+  unsigned long long hash = 14695981039346656037ULL;
+  for( unsigned int i=0; i<desc.length(); i++ ){
+    hash ^= (unsigned char) desc[i];
+    hash *= 1099511628211ULL;
+  }
+
+  ostringstream h;
+  h << hex << setw(16) << setfill('0') << hash;
+  return h.str();
+}
@@ -25,6 +25,7 @@
 
 #include <cstddef>
 #include <vector>
+#include <string>
 
 #include "Transforms.h"
 
@@ -253,6 +254,13 @@ class View{
     else return false;
   }
 
+  /// Return a canonical hash of all the processing parameters applied to tiles by this view
+  /** Two views with the same hash produce identical output from the same source tile,
+      which allows processed tiles to be cached
+      @return hash as a hexadecimal string
+   */
+  std::string getProcessingHash();
+
 };
 
 
@@ -25,6 +25,12 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+/// Maximum number of bytes recorded for storage in Memcached, which is Memcached's default maximum item size
+#define WRITER_CAPTURE_LIMIT 1048576
 
 
 /// Virtual base class for various writers
@@ -32,7 +38,7 @@ class Writer {
 
  public:
 
-  virtual ~Writer() = 0;
+  virtual ~Writer() {};
 
   /// Write out a binary string
   /** \param msg message string
@@ -51,39 +57,75 @@ class Writer {
   /// Flush the output buffer
   virtual int flush() = 0;
 
+  /// Return everything written so far if it has been recorded
+  /** \param len set to the length of the recorded output
+      \return recorded output or NULL if output is not recorded
+  */
+  virtual const char* getOutput( size_t& len ){ len = 0; return NULL; };
+
+  /// Start recording our output so that it can be returned by getOutput
+  /** Output is only recorded by writers which do not already buffer it
+      and only from this point on, so this should be called before anything is written
+  */
+  virtual void capture() {};
+
 };
 
 
 
 /// FCGI Writer Class
-class FCGIWriter {
+/** Output is passed straight to the FastCGI stream. It is only recorded, for
+    storage in Memcached, once capture() has been called and only up to
+    WRITER_CAPTURE_LIMIT bytes, beyond which the response could not be stored.
+ */
+class FCGIWriter : public Writer {
 
  private:
 
-  
   FCGX_Stream *out;
-  static const unsigned int bufsize = 65536;
 
-  /// Add the message to our buffer
+  /// Recorded output
+  char* buffer;
+  size_t sz, bufsize;
+
+  /// Whether we are recording our output
+  bool capturing;
+
+  /// Add the message to our buffer if we are recording
   void cpy2buf( const char* msg, size_t len ){
-    if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
-    if( buffer ){
-      memcpy( &buffer[sz], msg, len );
-      sz += len;
+    if( !capturing ) return;
+    if( sz+len > WRITER_CAPTURE_LIMIT ){
+      // Too large to be stored, so stop recording
+      free( buffer );
+      buffer = NULL;
+      capturing = false;
+      return;
     }
+    if( sz+len > bufsize ){
+      // Grow geometrically to avoid a reallocation for each write
+      while( sz+len > bufsize ) bufsize *= 2;
+      char* b = (char*) realloc( buffer, bufsize );
+      if( !b ){
+        free( buffer );
+        buffer = NULL;
+        capturing = false;
+        return;
+      }
+      buffer = b;
+    }
+    memcpy( &buffer[sz], msg, len );
+    sz += len;
   };
 
 
  public:
 
-  char* buffer;
-  size_t sz;
-
   /// Constructor
   FCGIWriter( FCGX_Stream* o ){
     out = o;
-    buffer = (char*) malloc(bufsize);
-    sz = 0;
+    buffer = NULL;
+    sz = bufsize = 0;
+    capturing = false;
   };
 
   /// Destructor
@@ -94,23 +136,33 @@ class FCGIWriter {
     return FCGX_PutStr( msg, len, out );
   };
   int putS( const char* msg ){
-    cpy2buf( msg, strlen(msg) );
+    if( capturing ) cpy2buf( msg, strlen(msg) );
     return FCGX_PutS( msg, out );
   }
   int printf( const char* msg ){
-    cpy2buf( msg, strlen(msg) );
+    if( capturing ) cpy2buf( msg, strlen(msg) );
     return FCGX_FPrintF( out, msg );
   };
   int flush(){
     return FCGX_FFlush( out );
   };
+  void capture(){
+    if( capturing || buffer ) return;
+    bufsize = 65536;
+    buffer = (char*) malloc( bufsize );
+    capturing = ( buffer != NULL );
+  };
+  const char* getOutput( size_t& len ){
+    len = capturing ? sz : 0;
+    return capturing ? buffer : NULL;
+  };
 
 };
 
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 
@@ -108,10 +108,11 @@ void Zoomify::run( Session* session, const std::string& argument ){
 	      "Server: iipsrv/%s\r\n"
 	      "Content-Type: application/xml\r\n"
 	      "Last-Modified: %s\r\n"
+	      "%s"
 	      "%s\r\n"
 	      "\r\n"
 	      "<IMAGE_PROPERTIES WIDTH=\"%d\" HEIGHT=\"%d\" NUMTILES=\"%d\" NUMIMAGES=\"1\" VERSION=\"1.8\" TILESIZE=\"%d\" />",
-	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getCacheControl().c_str(), width, height, ntiles, tw );
+	      VERSION, (*session->image)->getTimestamp().c_str(), session->response->getETag().c_str(), session->response->getCacheControl().c_str(), width, height, ntiles, tw );
 
     session->out->printf( (const char*) str );
     session->response->setImageSent();